@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2021, Alejandro Liu
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+/*
+ * contoy-bench: throughput and fan-out latency benchmark for contoy
+ *
+ * Build: cc -O2 -o contoy-bench contoy-bench.c
+ *
+ * Starts contoy with contoy-bench itself as the command, acting as a
+ * synthetic output generator.  Every generated line starts with the
+ * CLOCK_MONOTONIC time it was written, so the clients attached by the
+ * benchmark can measure how late each line arrives.  Some of the
+ * clients can be made to read slowly on purpose.
+ *
+ * Reports:
+ *  - generator write stalls (time the command spent blocked in write)
+ *  - per client latency percentiles
+ *  - contoy CPU time per GB fanned out to the clients
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "contoy-proto.h"
+
+#define MAX_CLIENTS	8		/* contoy's per command limit */
+#define STALL_NS	1000000		/* writes slower than this are stalls */
+#define TICK_NS		1000000
+#define HEADSZ		24
+
+struct bclient {
+  int fd;
+  int slow;
+  uint64_t bytes, lines;
+  uint64_t budget_ts;			/* slow clients: last refill */
+  double budget;
+  char head[HEADSZ];			/* start of the current line */
+  int hlen, skip;
+  size_t flen;				/* framed: partial frame */
+  unsigned char *fbuf;
+  uint64_t *lat;			/* latency samples (ns) */
+  size_t nlat, szlat;
+};
+
+static void perror_msg(int ncode,const char *msg) {
+  perror(msg);
+  exit(ncode);
+}
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static double cpu_secs(const struct rusage *ru) {
+  return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+	 ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+static uint64_t parse_size(const char *str) {
+  char *end;
+  uint64_t v = strtoull(str, &end, 0);
+  switch (*end) {
+  case 'g': case 'G': v *= 1024;
+  case 'm': case 'M': v *= 1024;
+  case 'k': case 'K': v *= 1024;
+  }
+  return v;
+}
+
+static void usage(char *cmd) {
+  fprintf(stderr,"Usage:\n"
+		"\t%s [options]\n"
+		"\n"
+		"\t-c path\tcontoy binary (default ./contoy)\n"
+		"\t-r rate\tbytes/s written by the command, 0 for flat out (default 10M)\n"
+		"\t-l len\tline length (default 100)\n"
+		"\t-d secs\tduration (default 5)\n"
+		"\t-n num\tclients to attach (default 4)\n"
+		"\t-s num\thow many of those read slowly (default 0)\n"
+		"\t-S rate\tbytes/s read by slow clients (default 64k)\n"
+		"\t-f\tuse contoy --framed\n"
+		"\n", cmd);
+  exit(0);
+}
+
+/*
+ * Generator mode: runs as the command under contoy.  Waits for a line
+ * on stdin before starting and writes its own numbers to statfile.
+ */
+static int generate(uint64_t rate, size_t linesz, double secs, const char *statfile) {
+  uint64_t start, now, end, sent = 0, lines = 0, writes = 0;
+  uint64_t stalls = 0, stall_ns = 0, stall_max = 0;
+  char *buf, go[64];
+  size_t bufsz = 65536 + linesz;
+  struct rusage ru;
+  FILE *fp;
+
+  if (linesz < HEADSZ) linesz = HEADSZ;
+  buf = malloc(bufsz);
+  if (buf == NULL) perror_msg(__LINE__,"malloc");
+  if (read(0, go, sizeof go) <= 0) return 1;
+
+  start = mono_ns();
+  end = start + secs * 1e9;
+  while ((now = mono_ns()) < end) {
+    uint64_t due = rate ? (double)(now - start) * rate / 1e9 : sent + 65536;
+    size_t len = 0;
+    uint64_t t0, dt;
+
+    if (due <= sent) {
+      struct timespec ts = { 0, TICK_NS };
+      nanosleep(&ts, NULL);
+      continue;
+    }
+    while (sent + len < due && len + linesz <= bufsz) {
+      char *p = buf + len;
+      int n = sprintf(p, "T%020llu ", (unsigned long long)mono_ns());
+      memset(p + n, 'x', linesz - n - 1);
+      p[linesz-1] = '\n';
+      len += linesz;
+      lines++;
+    }
+    t0 = mono_ns();
+    if (write(1, buf, len) != len) break;
+    dt = mono_ns() - t0;
+    writes++;
+    sent += len;
+    if (dt > STALL_NS) {
+      stalls++;
+      stall_ns += dt;
+      if (dt > stall_max) stall_max = dt;
+    }
+  }
+  now = mono_ns();
+  getrusage(RUSAGE_SELF, &ru);
+
+  fp = fopen(statfile, "w");
+  if (fp == NULL) perror_msg(__LINE__, statfile);
+  fprintf(fp, "%llu %llu %llu %llu %llu %llu %llu %.6f\n",
+	  (unsigned long long)sent, (unsigned long long)lines,
+	  (unsigned long long)writes, (unsigned long long)stalls,
+	  (unsigned long long)stall_ns, (unsigned long long)stall_max,
+	  (unsigned long long)(now - start), cpu_secs(&ru));
+  fclose(fp);
+  return 0;
+}
+
+static void sample(struct bclient *c, uint64_t now) {
+  uint64_t ts;
+
+  c->lines++;
+  if (c->hlen < 22 || c->head[0] != 'T') return;
+  c->head[21] = 0;
+  ts = strtoull(c->head + 1, NULL, 10);
+  if (c->nlat == c->szlat) {
+    c->szlat = c->szlat ? c->szlat * 2 : 65536;
+    c->lat = realloc(c->lat, c->szlat * sizeof *c->lat);
+    if (c->lat == NULL) perror_msg(__LINE__,"realloc");
+  }
+  c->lat[c->nlat++] = now > ts ? now - ts : 0;
+}
+
+/* Split output into lines, only the start of each line is kept */
+static void scan(struct bclient *c, const char *p, size_t len, uint64_t now) {
+  while (len) {
+    const char *nl = memchr(p, '\n', len);
+    size_t n = nl ? nl - p : len;
+    if (c->hlen < HEADSZ) {
+      size_t k = n < HEADSZ - c->hlen ? n : HEADSZ - c->hlen;
+      memcpy(c->head + c->hlen, p, k);
+      c->hlen += k;
+    }
+    if (!nl) break;
+    sample(c, now);
+    c->hlen = 0;
+    p = nl + 1;
+    len -= n + 1;
+  }
+}
+
+static void unframe(struct bclient *c, const unsigned char *p, size_t len, uint64_t now) {
+  size_t off = 0;
+
+  memcpy(c->fbuf + c->flen, p, len);
+  c->flen += len;
+  while (c->flen - off >= FRAME_HDRSZ) {
+    struct frame f;
+    frame_parse(c->fbuf + off, &f);
+    if (c->flen - off < FRAME_HDRSZ + f.len) break;
+    if (f.channel == CH_STDOUT) scan(c, (char *)c->fbuf + off + FRAME_HDRSZ, f.len, now);
+    off += FRAME_HDRSZ + f.len;
+  }
+  c->flen -= off;
+  memmove(c->fbuf, c->fbuf + off, c->flen);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+static double pct(struct bclient *c, double p) {
+  size_t i;
+  if (!c->nlat) return 0;
+  i = p * (c->nlat - 1);
+  return c->lat[i] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+  const char *contoy = "./contoy";
+  uint64_t rate = 10*1024*1024, slow_rate = 64*1024;
+  size_t linesz = 100;
+  double secs = 5;
+  int i, opt, nclients = 4, nslow = 0, framed = 0, active;
+  char dir[] = "/tmp/contoy-bench.XXXXXX", self[PATH_MAX];
+  char sock[64], lock[64], stats[64];
+  char a_sock[80], a_lock[80], a_rate[32], a_len[32], a_secs[32];
+  struct bclient clients[MAX_CLIENTS];
+  unsigned long long sent, lines, writes, stalls, stall_ns, stall_max, elapsed;
+  double gen_cpu, contoy_cpu;
+  uint64_t fanned = 0;
+  struct rusage ru;
+  ssize_t n;
+  int status;
+  pid_t pid;
+  FILE *fp;
+
+  if (argc == 6 && !strcmp(argv[1], "-G")) {
+    /* Generate from a grandchild of contoy, so that whether contoy
+     * reaps it or not its CPU time never lands in contoy's rusage;
+     * it reports its own. */
+    pid = fork();
+    if (pid == -1) perror_msg(__LINE__,"fork");
+    if (pid) return 0;
+    return generate(strtoull(argv[2], NULL, 0), strtoul(argv[3], NULL, 0), atof(argv[4]), argv[5]);
+  }
+
+  while ((opt = getopt(argc, argv, "h?c:r:l:d:n:s:S:f")) != -1) {
+    switch (opt) {
+    case 'c': contoy = optarg; break;
+    case 'r': rate = parse_size(optarg); break;
+    case 'l': linesz = parse_size(optarg); break;
+    case 'd': secs = atof(optarg); break;
+    case 'n': nclients = atoi(optarg); break;
+    case 's': nslow = atoi(optarg); break;
+    case 'S': slow_rate = parse_size(optarg); break;
+    case 'f': framed = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (nclients < 1 || nclients > MAX_CLIENTS) {
+    fprintf(stderr,"%s: 1 to %d clients\n", argv[0], MAX_CLIENTS);
+    exit(__LINE__);
+  }
+  if (linesz < HEADSZ) linesz = HEADSZ;
+  n = readlink("/proc/self/exe", self, sizeof self - 1);
+  if (n == -1) perror_msg(__LINE__,"readlink");
+  self[n] = 0;
+  if (mkdtemp(dir) == NULL) perror_msg(__LINE__,"mkdtemp");
+  snprintf(sock, sizeof sock, "%s/sock", dir);
+  snprintf(lock, sizeof lock, "%s/lock", dir);
+  snprintf(stats, sizeof stats, "%s/stats", dir);
+  snprintf(a_sock, sizeof a_sock, "--sock=%s", sock);
+  snprintf(a_lock, sizeof a_lock, "--lock=%s", lock);
+  snprintf(a_rate, sizeof a_rate, "%llu", (unsigned long long)rate);
+  snprintf(a_len, sizeof a_len, "%zu", linesz);
+  snprintf(a_secs, sizeof a_secs, "%g", secs);
+
+  pid = fork();
+  if (pid == -1) perror_msg(__LINE__,"fork");
+  if (pid == 0) {
+    char *args[12];
+    int devnull = open("/dev/null", O_RDWR), k = 0;
+
+    args[k++] = (char *)contoy;
+    args[k++] = a_sock;
+    args[k++] = a_lock;
+    if (framed) args[k++] = "--framed";
+    args[k++] = self;
+    args[k++] = "-G";
+    args[k++] = a_rate;
+    args[k++] = a_len;
+    args[k++] = a_secs;
+    args[k++] = stats;
+    args[k] = NULL;
+    dup2(devnull, 0); dup2(devnull, 1);
+    execv(contoy, args);
+    perror_msg(__LINE__, contoy);
+  }
+
+  /* attach the clients */
+  memset(clients, 0, sizeof clients);
+  for (i = 0; i < nclients; i++) {
+    struct sockaddr_un addr;
+    int tries;
+
+    clients[i].fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (clients[i].fd == -1) perror_msg(__LINE__,"socket");
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", sock);
+    for (tries = 0; connect(clients[i].fd, (struct sockaddr *)&addr, sizeof addr) == -1; tries++) {
+      struct timespec ts = { 0, 10000000 };
+      if (tries > 500) perror_msg(__LINE__,"connect");
+      nanosleep(&ts, NULL);
+    }
+    clients[i].slow = i >= nclients - nslow;
+    clients[i].budget_ts = mono_ns();
+    if (framed) {
+      clients[i].fbuf = malloc(2 * (FRAME_HDRSZ + FRAME_MAXDATA));
+      if (clients[i].fbuf == NULL) perror_msg(__LINE__,"malloc");
+    }
+  }
+  /* start the generator */
+  if (framed) {
+    unsigned char frame[FRAME_HDRSZ+3];
+    frame_hdr(frame, CH_STDIN, 0, 3, now_usec());
+    memcpy(frame + FRAME_HDRSZ, "go\n", 3);
+    write(clients[0].fd, frame, sizeof frame);
+  } else {
+    write(clients[0].fd, "go\n", 3);
+  }
+
+  for (active = nclients; active; ) {
+    struct pollfd pfd[MAX_CLIENTS];
+    int timeout = -1;
+    uint64_t now = mono_ns();
+
+    for (i = 0; i < nclients; i++) {
+      struct bclient *c = &clients[i];
+      pfd[i].fd = c->fd;
+      pfd[i].events = POLLIN;
+      if (c->fd == -1 || !c->slow) continue;
+      c->budget += (now - c->budget_ts) * (double)slow_rate / 1e9;
+      if (c->budget > slow_rate / 10) c->budget = slow_rate / 10;
+      c->budget_ts = now;
+      if (c->budget < 1) {
+	pfd[i].fd = -1;
+	timeout = 1;
+      }
+    }
+    if (poll(pfd, nclients, timeout) == -1) {
+      if (errno == EINTR) continue;
+      perror_msg(__LINE__,"poll");
+    }
+    now = mono_ns();
+    for (i = 0; i < nclients; i++) {
+      struct bclient *c = &clients[i];
+      static char buf[FRAME_HDRSZ + FRAME_MAXDATA];
+      size_t want = framed ? FRAME_HDRSZ + FRAME_MAXDATA : sizeof buf;
+      ssize_t n;
+
+      if (pfd[i].fd == -1 || !pfd[i].revents) continue;
+      if (c->slow && c->budget < want) want = c->budget;
+      n = read(c->fd, buf, want);
+      if (n <= 0) {
+	close(c->fd);
+	c->fd = -1;
+	active--;
+	continue;
+      }
+      c->bytes += n;
+      if (c->slow) c->budget -= n;
+      if (framed)
+	unframe(c, (unsigned char *)buf, n, now);
+      else
+	scan(c, buf, n, now);
+    }
+  }
+
+  if (wait4(pid, &status, 0, &ru) == -1) perror_msg(__LINE__,"wait4");
+  fp = fopen(stats, "r");
+  if (fp == NULL || fscanf(fp, "%llu %llu %llu %llu %llu %llu %llu %lf", &sent, &lines, &writes,
+			   &stalls, &stall_ns, &stall_max, &elapsed, &gen_cpu) != 8) {
+    fprintf(stderr,"%s: generator did not report\n", argv[0]);
+    exit(__LINE__);
+  }
+  fclose(fp);
+  unlink(stats);
+  unlink(lock);
+  unlink(sock);
+  rmdir(dir);
+  /* the generator is not contoy's child, this is contoy alone */
+  contoy_cpu = cpu_secs(&ru);
+
+  if (rate)
+    printf("contoy-bench: rate %llu B/s", (unsigned long long)rate);
+  else
+    printf("contoy-bench: rate unlimited");
+  printf(", line %zu, %d clients (%d slow at %llu B/s)%s\n", linesz, nclients, nslow,
+	 (unsigned long long)slow_rate, framed ? ", framed" : "");
+  printf("generator: %llu bytes, %llu lines in %.2fs (%.2f MB/s), %.3f s cpu\n",
+	 sent, lines, elapsed / 1e9, sent / (elapsed / 1e3), gen_cpu);
+  printf("generator: %llu writes, %llu stalled >%dms, %.1f ms stalled total, %.1f ms max\n",
+	 writes, stalls, STALL_NS / 1000000, stall_ns / 1e6, stall_max / 1e6);
+  printf("%-8s %-5s %12s %10s %10s %10s %10s %10s\n",
+	 "client", "type", "bytes", "lines", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+  for (i = 0; i < nclients; i++) {
+    struct bclient *c = &clients[i];
+    qsort(c->lat, c->nlat, sizeof *c->lat, cmp_u64);
+    fanned += c->bytes;
+    printf("%-8d %-5s %12llu %10llu %10.0f %10.0f %10.0f %10.0f\n", i,
+	   c->slow ? "slow" : "fast", (unsigned long long)c->bytes, (unsigned long long)c->lines,
+	   pct(c, 0.5), pct(c, 0.99), pct(c, 0.999), pct(c, 1));
+  }
+  printf("contoy: %.3f s cpu, %.3f s per GB fanned out (%llu bytes)\n",
+	 contoy_cpu, fanned ? contoy_cpu / (fanned / 1e9) : 0, (unsigned long long)fanned);
+  return 0;
+}
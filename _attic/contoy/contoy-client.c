@@ -26,15 +26,68 @@
  * SUCH DAMAGE.
  *
  */
+/*
+ * Build: cc -o contoy-client contoy-client.c -lz
+ */
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/file.h>
-#include <sys/select.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "contoy-proto.h"
+
+#define ESCAPE_KEY	('[' ^ 0x40)	/* Control + ] */
+#define BUFSZ		(4 * FRAME_MAXDATA)
+#define SPLICESZ	65536
+
+/*
+ * Output waiting for a non-blocking fd.  Nothing is read from the
+ * other side while a buffer is full, which is what pushes back on
+ * contoy (or on the keyboard) instead of stalling the whole loop.
+ */
+struct buf {
+  size_t off, len;
+  unsigned char data[BUFSZ];
+};
+
+static volatile sig_atomic_t resized = 0;
+static volatile sig_atomic_t stop = 0;
+static struct termios saved_tio;
+static int saved_fl[2], raw_tty = 0;
+
+static void usage(char *cmd) {
+  fprintf(stderr,"Usage:\n"
+		"\t%s [-f] [-n] [-s signo] socket\n"
+		"\t%s -t from [-T to] logbase\n"
+		"\n"
+		"\t-f\tuse the framed protocol (contoy --framed)\n"
+		"\t-n\tleave the terminal in cooked mode\n"
+		"\t-s signo\tsend signal to the command and detach\n"
+		"\t-t from\tshow logged output starting at this time\n"
+		"\t-T to\tstop showing logged output at this time\n"
+		"\n"
+		"In raw terminal mode, Control+] detaches.\n"
+		"\n"
+		"Times are \"HH:MM[:SS]\" (today), \"YYYY-MM-DD HH:MM[:SS]\"\n"
+		"or \"@seconds\" since the epoch.\n"
+		"\n", cmd, cmd);
+  exit(0);
+}
 static void error_msg(int ncode, const char *msg) {
   fputs(msg,stderr);
   exit(ncode);
@@ -56,62 +109,444 @@ static ssize_t do_write (int fd, const void *buf, size_t len) {
   return len;
 }
 
+static size_t buf_room(struct buf *b) {
+  return sizeof(b->data) - b->off - b->len;
+}
+static void buf_compact(struct buf *b) {
+  memmove(b->data, b->data + b->off, b->len);
+  b->off = 0;
+}
+static void buf_put(struct buf *b, const void *data, size_t len) {
+  if (buf_room(b) < len) buf_compact(b);
+  memcpy(b->data + b->off + b->len, data, len);
+  b->len += len;
+}
+static void buf_frame(struct buf *b, int ch, int op, const void *data, size_t len) {
+  unsigned char hdr[FRAME_HDRSZ];
+  frame_hdr(hdr, ch, op, len, now_usec());
+  buf_put(b, hdr, sizeof hdr);
+  if (len) buf_put(b, data, len);
+}
+/* room for len more bytes, compacting if needed */
+static int buf_fits(struct buf *b, size_t len) {
+  if (buf_room(b) >= len) return 1;
+  return sizeof(b->data) - b->len >= len;
+}
+/* Returns -1 on a hard error */
+static int buf_flush(struct buf *b, int fd) {
+  while (b->len) {
+    ssize_t n = write(fd, b->data + b->off, b->len);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EINTR) return 0;
+      return -1;
+    }
+    b->off += n;
+    b->len -= n;
+  }
+  b->off = 0;
+  return 0;
+}
+
+static void set_nonblock(int fd) {
+  int fl = fcntl(fd, F_GETFL);
+  if (fl != -1) fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+static void restore_tty(void) {
+  if (raw_tty) tcsetattr(0, TCSADRAIN, &saved_tio);
+  fcntl(0, F_SETFL, saved_fl[0]);
+  fcntl(1, F_SETFL, saved_fl[1]);
+}
+/*
+ * Input is passed through as typed, but output processing is left
+ * alone so that newlines still display properly.
+ */
+static void setup_tty(int raw) {
+  saved_fl[0] = fcntl(0, F_GETFL);
+  saved_fl[1] = fcntl(1, F_GETFL);
+  if (raw && isatty(0) && tcgetattr(0, &saved_tio) == 0) {
+    struct termios tio = saved_tio;
+    tio.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL|IXON);
+    tio.c_lflag &= ~(ECHO|ECHONL|ICANON|ISIG|IEXTEN);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(0, TCSADRAIN, &tio) == 0) raw_tty = 1;
+  }
+  atexit(restore_tty);
+  set_nonblock(0);
+  set_nonblock(1);
+}
+
+static void send_frame(int fd, int ch, int op, const void *buf, size_t len) {
+  unsigned char frame[FRAME_HDRSZ+8192];
+  frame_hdr(frame, ch, op, len, now_usec());
+  memcpy(frame+FRAME_HDRSZ, buf, len);
+  do_write(fd, frame, FRAME_HDRSZ+len);
+}
+static void queue_resize(struct buf *b) {
+  struct winsize ws;
+  unsigned char sz[4];
+  if (ioctl(0, TIOCGWINSZ, &ws) == -1) return;
+  put_u16(sz, ws.ws_row);
+  put_u16(sz+2, ws.ws_col);
+  buf_frame(b, CH_CTRL, CTL_RESIZE, sz, sizeof sz);
+}
+static void on_winch(int sig) {
+  resized = 1;
+}
+static void on_stop(int sig) {
+  stop = 1;
+}
+
+static uint64_t parse_time(const char *str) {
+  struct tm tm;
+  time_t now = time(NULL);
+  int y, mo, d, h, mi, sec = 0;
+
+  if (str[0] == '@') return strtoull(str+1, NULL, 10) * 1000000;
+  localtime_r(&now, &tm);
+  if (sscanf(str, "%d-%d-%d%*[ T]%d:%d:%d", &y, &mo, &d, &h, &mi, &sec) >= 5) {
+    tm.tm_year = y - 1900;
+    tm.tm_mon = mo - 1;
+    tm.tm_mday = d;
+  } else if (sscanf(str, "%d:%d:%d", &h, &mi, &sec) < 2) {
+    fprintf(stderr,"%s: invalid time\n", str);
+    exit(__LINE__);
+  }
+  tm.tm_hour = h;
+  tm.tm_min = mi;
+  tm.tm_sec = sec;
+  tm.tm_isdst = -1;
+  return (uint64_t)mktime(&tm) * 1000000;
+}
+
+struct logfile {
+  char stem[PATH_MAX];
+  struct logidx *x;
+  size_t n;
+};
+
+static void load_index(struct logfile *lf, const char *idx) {
+  unsigned char rec[LOG_IDXSZ];
+  struct stat st;
+  FILE *fp;
+
+  snprintf(lf->stem, sizeof lf->stem, "%.*s", (int)(strlen(idx) - 4), idx);
+  lf->n = 0;
+  lf->x = NULL;
+  fp = fopen(idx, "r");
+  if (fp == NULL) return;
+  if (fstat(fileno(fp), &st) == 0) lf->x = malloc((st.st_size / LOG_IDXSZ + 1) * sizeof *lf->x);
+  while (lf->x && fread(rec, sizeof rec, 1, fp) == 1) logidx_get(rec, &lf->x[lf->n++]);
+  fclose(fp);
+}
+
+/* number of index records with a timestamp <= ts */
+static size_t idx_search(const struct logfile *lf, uint64_t ts) {
+  size_t lo = 0, hi = lf->n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (lf->x[mid].ts <= ts)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void dump_file(const struct logfile *lf, size_t first, size_t last) {
+  char path[PATH_MAX+8], buf[65536];
+  uint64_t pos = lf->x[first].raw;
+  uint64_t len = last < lf->n ? lf->x[last].raw - pos : UINT64_MAX;
+  gzFile gz;
+  int fd, n;
+
+  /* the plain log is only removed after the index is rewritten */
+  snprintf(path, sizeof path, "%s.log", lf->stem);
+  fd = open(path, O_RDONLY);
+  if (fd != -1) {
+    while (len && (n = pread(fd, buf, len < sizeof buf ? len : sizeof buf, pos)) > 0) {
+      do_write(1, buf, n);
+      pos += n;
+      len -= n;
+    }
+    close(fd);
+    return;
+  }
+  snprintf(path, sizeof path, "%s.log.gz", lf->stem);
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return;
+  }
+  lseek(fd, lf->x[first].off, SEEK_SET);
+  gz = gzdopen(fd, "r");
+  if (gz == NULL) perror_msg(__LINE__, path);
+  while (len && (n = gzread(gz, buf, len < sizeof buf ? len : sizeof buf)) > 0) {
+    do_write(1, buf, n);
+    len -= n;
+  }
+  gzclose(gz);
+}
+
+/*
+ * Show the logged output between two points in time.  Rotated logs
+ * sort by name, the live log comes last.
+ */
+static void log_dump(const char *base, uint64_t from, uint64_t to) {
+  char pat[PATH_MAX];
+  struct logfile *lf;
+  glob_t g;
+  size_t i, count;
+
+  snprintf(pat, sizeof pat, "%s.*.idx", base);
+  memset(&g, 0, sizeof g);
+  glob(pat, 0, NULL, &g);
+  count = g.gl_pathc + 1;
+  lf = calloc(count, sizeof *lf);
+  if (lf == NULL) perror_msg(__LINE__,"calloc");
+  for (i = 0; i < g.gl_pathc; i++) load_index(&lf[i], g.gl_pathv[i]);
+  snprintf(pat, sizeof pat, "%s.idx", base);
+  load_index(&lf[i], pat);
+  globfree(&g);
+
+  for (i = 0; i < count; i++) {
+    size_t first, last;
+
+    if (!lf[i].n) continue;
+    if (lf[i].x[0].ts > to) break;
+    if (i+1 < count && lf[i+1].n && lf[i+1].x[0].ts <= from) continue;
+    first = idx_search(&lf[i], from);
+    if (first) first--;
+    last = idx_search(&lf[i], to);
+    dump_file(&lf[i], first, last);
+  }
+}
+
+/*
+ * Demultiplex frames received from the server into the stdout and
+ * stderr buffers.  Stops early when a buffer is full.  Returns the
+ * number of bytes consumed from buf.
+ */
+static size_t demux(const unsigned char *buf, size_t len, struct buf *out[3], int *status) {
+  size_t off = 0;
+
+  while (len - off >= FRAME_HDRSZ) {
+    struct frame f;
+    const unsigned char *data = buf + off + FRAME_HDRSZ;
+
+    frame_parse(buf + off, &f);
+    if (f.len > FRAME_MAXDATA) error_msg(__LINE__,"Protocol error\n");
+    if (len - off < FRAME_HDRSZ + f.len) break;
+    switch (f.channel) {
+    case CH_STDOUT:
+    case CH_STDERR:
+      if (!buf_fits(out[f.channel], f.len)) return off;
+      buf_put(out[f.channel], data, f.len);
+      break;
+    case CH_CTRL:
+      if (f.op == CTL_EXIT && f.len >= 4) *status = get_u32(data);
+      break;
+    }
+    off += FRAME_HDRSZ + f.len;
+  }
+  return off;
+}
+
+/*
+ * Raw mode output to a pipe or file goes through splice(), so the
+ * data never has to be copied through user space.  Files need an
+ * intermediate pipe.  Returns 0 on EOF, -1 if it would block.
+ */
+static int splice_out(int sfd, int mid[2], size_t *pending) {
+  ssize_t n;
+
+  if (mid[1] == -1) {
+    n = splice(sfd, NULL, 1, NULL, SPLICESZ, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+  } else {
+    if (!*pending) {
+      n = splice(sfd, NULL, mid[1], NULL, SPLICESZ, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+      if (n <= 0) return n;
+      *pending = n;
+    }
+    n = splice(mid[0], NULL, 1, NULL, *pending, SPLICE_F_MOVE);
+    if (n > 0) *pending -= n;
+  }
+  if (n == -1 && errno != EAGAIN && errno != EINTR) perror_msg(__LINE__,"splice");
+  return n;
+}
+
 int main(int argc, char **argv) {
   struct sockaddr_un addr;
-  int sfd, nfd;
+  int sfd, nfd, i, framed = 0, sig = 0, seek = 0, raw = 1;
+  int status = -1, use_splice = 0, pipe_full = 0, mid[2] = { -1, -1 };
+  size_t pending = 0;
+  uint64_t from = 0, to = UINT64_MAX;
+  static struct buf tosock, out1, out2;
+  static unsigned char ibuf[FRAME_HDRSZ+FRAME_MAXDATA];
+  struct buf *out[3] = { NULL, &out1, &out2 };
+  size_t ilen = 0;
+  struct stat st;
+
+  for (i=1; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp("-f", argv[i])) {
+      framed = 1;
+    } else if (!strcmp("-n", argv[i])) {
+      raw = 0;
+    } else if (!strcmp("-s", argv[i]) && i+1 < argc) {
+      framed = 1;
+      sig = atoi(argv[++i]);
+    } else if (!strcmp("-t", argv[i]) && i+1 < argc) {
+      from = parse_time(argv[++i]);
+      seek = 1;
+    } else if (!strcmp("-T", argv[i]) && i+1 < argc) {
+      to = parse_time(argv[++i]);
+      seek = 1;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (i+1 != argc) error_msg(__LINE__,"Must specify socket path\n");
+  if (seek) {
+    log_dump(argv[i], from, to);
+    exit(0);
+  }
 
   sfd = socket(AF_UNIX,SOCK_STREAM,0);
   if (sfd == -1) perror_msg(__LINE__,"socket");
-  if (argc != 2) error_msg(__LINE__,"Must specify socket path\n");
 
   memset(&addr, 0, sizeof(struct sockaddr_un));
   addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+  strncpy(addr.sun_path, argv[i], sizeof(addr.sun_path) - 1);
 
   if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
     perror_msg(__LINE__,"connect");
 
+  if (sig) {
+    unsigned char sn[4];
+    put_u32(sn, sig);
+    send_frame(sfd, CH_CTRL, CTL_SIGNAL, sn, sizeof sn);
+    send_frame(sfd, CH_CTRL, CTL_DETACH, NULL, 0);
+    exit(0);
+  }
+
+  if (!framed && fstat(1, &st) == 0) {
+    if (S_ISFIFO(st.st_mode)) {
+      use_splice = 1;
+    } else if (S_ISREG(st.st_mode)) {
+      if (pipe(mid) == -1) perror_msg(__LINE__,"pipe");
+      use_splice = 1;
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, on_stop);
+  signal(SIGHUP, on_stop);
+  signal(SIGINT, on_stop);
+  setup_tty(raw);
+  set_nonblock(sfd);
+  if (framed) {
+    signal(SIGWINCH, on_winch);
+    if (isatty(0)) queue_resize(&tosock);
+  }
+
   nfd = 0;
-  while (sfd != -1) {
-    int n;
-    char buf[8192];
-    fd_set fds;
-
-    FD_ZERO(&fds); n = 0;
-    if (nfd != -1) {
-      FD_SET(nfd,&fds);
-      if (nfd > n) n = nfd;
+  while (!stop) {
+    struct pollfd pfd[4];
+    int n, out_blocked = out1.len || pending || pipe_full;
+    int out_busy = pending || pipe_full || out1.len > BUFSZ/2 || out2.len > BUFSZ/2;
+
+    if (resized) {
+      resized = 0;
+      if (buf_fits(&tosock, FRAME_HDRSZ+4)) queue_resize(&tosock);
     }
-    if (sfd != -1) {
-      FD_SET(sfd,&fds);
-      if (sfd > n) n = sfd;
+    if (sfd == -1 || status != -1) {
+      /* server is gone, finish writing what we have */
+      if (!out1.len && !out2.len) break;
     }
-    ++n;
 
-    if (select(n, &fds, NULL, NULL, NULL) == -1) perror_msg(__LINE__,"select");
+    memset(pfd, 0, sizeof pfd);
+    pfd[0].fd = nfd != -1 && buf_fits(&tosock, FRAME_HDRSZ+8192) ? nfd : -1;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sfd;
+    if (status == -1 && !out_busy && ilen < sizeof ibuf) pfd[1].events |= POLLIN;
+    if (tosock.len) pfd[1].events |= POLLOUT;
+    if (!pfd[1].events) pfd[1].fd = -1;
+    pfd[2].fd = out_blocked ? 1 : -1;
+    pfd[2].events = POLLOUT;
+    pfd[3].fd = out2.len ? 2 : -1;
+    pfd[3].events = POLLOUT;
 
+    if (poll(pfd, 4, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror_msg(__LINE__,"poll");
+    }
 
-    if (nfd != -1 && FD_ISSET(nfd, &fds)) {
-      n = read(nfd,buf, sizeof buf);
-      if (n > 0) {
-	do_write(sfd,buf,n);
-      } else if (n == 0) {
-	close(nfd);
-	nfd = -1;
+    if (pfd[2].revents) pipe_full = 0;
+    if (pfd[0].revents) {
+      /* take everything typed or pasted so far and send it in one go */
+      unsigned char buf[8192];
+      while (buf_fits(&tosock, FRAME_HDRSZ + sizeof buf)) {
+	unsigned char *esc;
+	n = read(nfd, buf, sizeof buf);
+	if (n == 0) {
+	  nfd = -1;
+	  break;
+	}
+	if (n < 0) break;
+	esc = raw_tty ? memchr(buf, ESCAPE_KEY, n) : NULL;
+	if (esc) n = esc - buf;
+	if (n) {
+	  if (framed)
+	    buf_frame(&tosock, CH_STDIN, 0, buf, n);
+	  else
+	    buf_put(&tosock, buf, n);
+	}
+	if (esc) {
+	  if (framed) buf_frame(&tosock, CH_CTRL, CTL_DETACH, NULL, 0);
+	  fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) & ~O_NONBLOCK);
+	  buf_flush(&tosock, sfd);
+	  stop = 1;
+	  break;
+	}
       }
     }
-    if (sfd != -1 && FD_ISSET(sfd, &fds)) {
-      n = read(sfd,buf, sizeof buf);
-      if (n > 0) {
-	do_write(1,buf,n);
-      } else if (n == 0) {
+    if (sfd != -1 && (pfd[1].revents & POLLOUT)) {
+      if (buf_flush(&tosock, sfd) == -1) {
 	close(sfd);
 	sfd = -1;
       }
     }
+    if (sfd != -1 && (pfd[1].revents & (POLLIN|POLLHUP|POLLERR))) {
+      if (framed) {
+	n = read(sfd, ibuf + ilen, sizeof(ibuf) - ilen);
+	if (n > 0) ilen += n;
+      } else if (use_splice) {
+	n = splice_out(sfd, mid, &pending);
+	if (n == -1) {
+	  /* either the socket is drained or stdout is full */
+	  pipe_full = mid[1] == -1 && errno == EAGAIN;
+	  n = 1;
+	}
+      } else {
+	if (buf_room(&out1) < SPLICESZ) buf_compact(&out1);
+	n = read(sfd, out1.data + out1.off + out1.len, buf_room(&out1));
+	if (n > 0) out1.len += n;
+      }
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+	close(sfd);
+	sfd = -1;
+      }
+    }
+    if (ilen) {
+      size_t used = demux(ibuf, ilen, out, &status);
+      ilen -= used;
+      memmove(ibuf, ibuf + used, ilen);
+    }
+    if (pending && mid[0] != -1) splice_out(sfd, mid, &pending);
+    if (out1.len && buf_flush(&out1, 1) == -1) break;
+    if (out2.len && buf_flush(&out2, 2) == -1) break;
   }
 
+  if (status != -1)
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
   exit(0);
 }
-
-
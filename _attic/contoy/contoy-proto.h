@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2021, Alejandro Liu
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+/*
+ * contoy framed wire protocol
+ *
+ * Used when contoy is started with --framed.  Every frame is a
+ * fixed size header (network byte order) followed by the payload:
+ *
+ *	offset	size	field
+ *	0	1	channel (CH_xxx)
+ *	1	1	control opcode (CTL_xxx, CH_CTRL only)
+ *	2	2	reserved (0)
+ *	4	4	payload length
+ *	8	8	timestamp (microseconds since the epoch)
+ *
+ * Control payloads:
+ *
+ *	CTL_HELLO	u32 protocol version (server -> client)
+ *	CTL_RESIZE	u16 rows, u16 cols (client -> server)
+ *	CTL_SIGNAL	u32 signal number (client -> server)
+ *	CTL_DETACH	empty (client -> server)
+ *	CTL_EXIT	u32 wait status (server -> client)
+ */
+#ifndef _CONTOY_PROTO_H
+#define _CONTOY_PROTO_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#define PROTO_VERSION	1
+
+#define FRAME_HDRSZ	16
+#define FRAME_MAXDATA	65536
+
+#define CH_STDIN	0
+#define CH_STDOUT	1
+#define CH_STDERR	2
+#define CH_CTRL		3
+
+#define CTL_HELLO	0
+#define CTL_RESIZE	1
+#define CTL_SIGNAL	2
+#define CTL_DETACH	3
+#define CTL_EXIT	4
+
+struct frame {
+  int channel;
+  int op;
+  uint32_t len;
+  uint64_t ts;
+};
+
+static inline void put_u16(unsigned char *p, uint16_t v) {
+  p[0] = v >> 8; p[1] = v;
+}
+static inline void put_u32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+static inline uint16_t get_u16(const unsigned char *p) {
+  return (uint16_t)p[0] << 8 | p[1];
+}
+static inline uint32_t get_u32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t now_usec(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static inline void frame_hdr(void *buf, int channel, int op, uint32_t len, uint64_t ts) {
+  unsigned char *p = buf;
+  p[0] = channel;
+  p[1] = op;
+  put_u16(p+2, 0);
+  put_u32(p+4, len);
+  put_u32(p+8, ts >> 32);
+  put_u32(p+12, ts);
+}
+
+static inline void frame_parse(const void *buf, struct frame *f) {
+  const unsigned char *p = buf;
+  f->channel = p[0];
+  f->op = p[1];
+  f->len = get_u32(p+4);
+  f->ts = (uint64_t)get_u32(p+8) << 32 | get_u32(p+12);
+}
+
+/*
+ * Output log index
+ *
+ * With --log=base the command output is appended to base.log and
+ * every second (or LOG_IDXBYTES of output) a record is appended to
+ * base.idx, so that a point in time can be found by binary search.
+ * Each record is three big-endian u64 values:
+ *
+ *	timestamp (microseconds since the epoch)
+ *	offset into the uncompressed log
+ *	offset into the data file
+ *
+ * Rotated logs are renamed to base.STAMP.log and compressed in the
+ * background to base.STAMP.log.gz, starting a new gzip member at
+ * every index record so that reading can start at any of them.  For
+ * uncompressed logs both offsets are the same.
+ */
+#define LOG_IDXSZ	24
+#define LOG_IDXUSEC	1000000
+#define LOG_IDXBYTES	65536
+
+struct logidx {
+  uint64_t ts;
+  uint64_t raw;
+  uint64_t off;
+};
+
+static inline void put_u64(unsigned char *p, uint64_t v) {
+  put_u32(p, v >> 32); put_u32(p+4, v);
+}
+static inline uint64_t get_u64(const unsigned char *p) {
+  return (uint64_t)get_u32(p) << 32 | get_u32(p+4);
+}
+static inline void logidx_put(unsigned char *p, const struct logidx *x) {
+  put_u64(p, x->ts); put_u64(p+8, x->raw); put_u64(p+16, x->off);
+}
+static inline void logidx_get(const unsigned char *p, struct logidx *x) {
+  x->ts = get_u64(p); x->raw = get_u64(p+8); x->off = get_u64(p+16);
+}
+
+#endif /* _CONTOY_PROTO_H */
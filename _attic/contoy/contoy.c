@@ -26,29 +26,137 @@
  * SUCH DAMAGE.
  *
  */
+/*
+ * Build: cc -o contoy contoy.c -lpthread -lz
+ */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
 #include <sys/file.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include "contoy-proto.h"
+
 #define MAX_CLIENTS	8
+#define MAX_EVENTS	64
+#define RESPAWN_MS	1000
+#define INPUT_MAX	(1024*1024)
+#define OUTPUT_MAX	(1024*1024)
+#define LINGER_MS	2000
 
 static const char str_sock[] = "--sock=";
 static const char str_lock[] = "--lock=";
-static const char VERSION[] = "0.1";
+static const char str_framed[] = "--framed";
+static const char str_services[] = "--services=";
+static const char str_log[] = "--log=";
+static const char str_logsize[] = "--log-size=";
+static const char VERSION[] = "0.3";
+
+/*
+ * Everything registered with epoll starts with a struct ep, so
+ * that the event loop can tell what became ready.
+ */
+#define EP_STDIN	0
+#define EP_SIGNAL	1
+#define EP_LISTEN	2
+#define EP_OUTPUT	3
+#define EP_CLIENT	4
+#define EP_INPUT	5
+
+struct service;
+
+struct outlog {
+  char *base;
+  int fd, ifd;
+  uint64_t size;			/* bytes in the current log */
+  uint64_t last_ts, last_raw;		/* last index record */
+};
+
+struct zjob {
+  struct zjob *next;
+  char stem[PATH_MAX];
+};
+
+struct ep {
+  int kind;
+  int fd;
+  int ch;				/* EP_OUTPUT: CH_STDOUT or CH_STDERR */
+  struct service *svc;
+};
+
+struct client {
+  struct ep ep;
+  struct client *next;			/* dirty or dead list */
+  int dirty;
+  int closing;				/* dropped once its output is out */
+  int events;				/* what epoll waits for */
+  size_t ilen;				/* partial frame in ibuf */
+  size_t olen, osz;			/* output queued for this loop */
+  char *obuf;
+  unsigned char *ibuf;			/* framed mode only */
+};
+
+struct service {
+  struct service *next;
+  char *name;
+  char *sock;
+  char **argv;
+  pid_t pid;
+  int status, reaped;
+  struct ep in;				/* command's stdin */
+  unsigned char *ibuf;			/* input the command has not taken yet */
+  size_t ilen, isz;
+  int paused;
+  struct ep listen;
+  struct ep out[3];			/* out[CH_STDOUT], out[CH_STDERR] */
+  struct client *clients[MAX_CLIENTS];
+  long long respawn;			/* ms timestamp, 0 if running */
+  struct outlog *log;
+};
+
+static int framed = 0;
+static int multi = 0;
+static int epfd;
+static struct service *services = NULL;
+static struct client *dirty = NULL;
+static struct client *dead = NULL;
+static struct ep *stdin_ep = NULL;
+static int lingering = 0;
+static long long exiting = 0;		/* ms deadline for lingering clients */
+static uint64_t log_max = 16*1024*1024;
+
+static pthread_t zthread;
+static pthread_mutex_t zlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zcond = PTHREAD_COND_INITIALIZER;
+static struct zjob *zjobs = NULL, **ztail = &zjobs;
+static int zrunning = 0, zquit = 0;
 
 static void usage(char *cmd) {
   fprintf(stderr,"%s v%s\n"
 		"\nUsage:\n"
-		"\t%s [-V][-h] %s[path] %s[path] cmd [args]\n"
+		"\t%s [-V][-h] %s[path] %s[path] [%s] [%s[base] [%s[size]] cmd [args]\n"
+		"\t%s [-V][-h] %s[file] %s[path] [%s] [%s[dir] [%s[size]]\n"
+		"\n"
+		"The services file has one command per line:\n"
+		"\n"
+		"\tname socket command [args]\n"
 		"\n",
 		cmd, VERSION, cmd,
-		str_sock, str_lock);
+		str_sock, str_lock, str_framed, str_log, str_logsize,
+		cmd, str_services, str_lock, str_framed, str_log, str_logsize);
   exit(0);
 }
 static void error_msg(int ncode, const char *msg) {
@@ -71,65 +179,612 @@ static ssize_t do_write (int fd, const void *buf, size_t len) {
   }
   return len;
 }
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+static int ep_watch(struct ep *ep) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = ep;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, ep->fd, &ev);
+}
+static void ep_add(struct ep *ep) {
+  if (ep_watch(ep) == -1) perror_msg(__LINE__,"epoll_ctl");
+}
+static void ep_mod(struct ep *ep, int events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = ep;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, ep->fd, &ev);
+}
+static void ep_close(struct ep *ep) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, ep->fd, NULL);
+  close(ep->fd);
+  ep->fd = -1;
+}
 
+static uint64_t parse_size(const char *str) {
+  char *end;
+  uint64_t v = strtoull(str, &end, 0);
+  switch (*end) {
+  case 'g': case 'G': v *= 1024;
+  case 'm': case 'M': v *= 1024;
+  case 'k': case 'K': v *= 1024;
+  }
+  return v;
+}
 
-int main(int argc, char **argv) {
-  const char *unix_path = NULL;
-  const char *unix_lock = NULL;
-  int i, j, lockfd, sockfd, io[3][2], clients[MAX_CLIENTS], infd;
-  struct sockaddr_un addr;
+/*
+ * Rotated logs are compressed by a background thread, so that the
+ * I/O loop only ever has to rename them.
+ */
+static int gz_member(FILE *out, int fd, uint64_t start, uint64_t end) {
+  unsigned char in[65536], zbuf[65536];
+  z_stream z;
+  int flush, ret = Z_STREAM_ERROR;
 
-  if (argc < 2) usage(argv[0]);
-  for (i=1; i < argc; i++) {
-    if (!strncmp(str_sock,argv[i],sizeof(str_sock)-1)) {
-      unix_path = argv[i]+sizeof(str_sock)-1;
-    } else if (!strncmp(str_lock,argv[i],sizeof(str_lock)-1)) {
-      unix_lock = argv[i]+sizeof(str_lock)-1;
-    } else if (!strcmp("-V", argv[i])) {
-      fprintf(stderr,"%s v%s\n", argv[0], VERSION);
-    } else if (!strcmp("-h", argv[i])) {
-      usage(argv[0]);
-    } else {
-      break;
+  memset(&z, 0, sizeof z);
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+  do {
+    ssize_t n = end - start > sizeof in ? sizeof in : end - start;
+    if (n) n = pread(fd, in, n, start);
+    if (n < 0) break;
+    start += n;
+    flush = n == 0 || start >= end ? Z_FINISH : Z_NO_FLUSH;
+    z.next_in = in;
+    z.avail_in = n;
+    do {
+      z.next_out = zbuf;
+      z.avail_out = sizeof zbuf;
+      ret = deflate(&z, flush);
+      fwrite(zbuf, 1, sizeof(zbuf) - z.avail_out, out);
+    } while (z.avail_out == 0);
+  } while (flush != Z_FINISH);
+  deflateEnd(&z);
+  return ret == Z_STREAM_END && !ferror(out) ? 0 : -1;
+}
+
+static void compress_log(const char *stem) {
+  char path[PATH_MAX+16], tmp[PATH_MAX+16];
+  unsigned char rec[LOG_IDXSZ];
+  struct logidx *x = NULL;
+  struct stat st, ist;
+  FILE *gz = NULL, *ix = NULL;
+  int fd, n = 0, i;
+
+  snprintf(path, sizeof path, "%s.log", stem);
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd == -1 || fstat(fd, &st) == -1) goto fail;
+
+  snprintf(path, sizeof path, "%s.idx", stem);
+  ix = fopen(path, "r");
+  if (ix && fstat(fileno(ix), &ist) == 0) {
+    x = malloc((ist.st_size / LOG_IDXSZ + 1) * sizeof *x);
+    while (x && fread(rec, sizeof rec, 1, ix) == 1) logidx_get(rec, &x[n++]);
+  }
+  if (ix) fclose(ix);
+  if (x == NULL) x = malloc(sizeof *x);
+  if (x == NULL) goto fail;
+  if (n == 0 || x[0].raw) {
+    /* no record for the start of the log */
+    memmove(x+1, x, n++ * sizeof *x);
+    x[0].ts = n > 1 ? x[1].ts : (uint64_t)st.st_mtime * 1000000;
+    x[0].raw = 0;
+  }
+
+  snprintf(tmp, sizeof tmp, "%s.log.gz.tmp", stem);
+  gz = fopen(tmp, "w");
+  snprintf(tmp, sizeof tmp, "%s.idx.tmp", stem);
+  ix = fopen(tmp, "w");
+  if (gz == NULL || ix == NULL) goto fail;
+
+  for (i = 0; i < n; i++) {
+    uint64_t end = i+1 < n ? x[i+1].raw : (uint64_t)st.st_size;
+    x[i].off = ftello(gz);
+    if (gz_member(gz, fd, x[i].raw, end) == -1) goto fail;
+    logidx_put(rec, &x[i]);
+    fwrite(rec, sizeof rec, 1, ix);
+  }
+  if (fclose(gz) || fclose(ix)) {
+    gz = ix = NULL;
+    goto fail;
+  }
+  gz = ix = NULL;
+
+  snprintf(tmp, sizeof tmp, "%s.log.gz.tmp", stem);
+  snprintf(path, sizeof path, "%s.log.gz", stem);
+  rename(tmp, path);
+  snprintf(tmp, sizeof tmp, "%s.idx.tmp", stem);
+  snprintf(path, sizeof path, "%s.idx", stem);
+  rename(tmp, path);
+  snprintf(path, sizeof path, "%s.log", stem);
+  unlink(path);
+  close(fd);
+  free(x);
+  return;
+
+fail:
+  fprintf(stderr,"%s: compression failed\n", stem);
+  if (gz) fclose(gz);
+  if (ix) fclose(ix);
+  snprintf(tmp, sizeof tmp, "%s.log.gz.tmp", stem);
+  unlink(tmp);
+  snprintf(tmp, sizeof tmp, "%s.idx.tmp", stem);
+  unlink(tmp);
+  if (fd != -1) close(fd);
+  free(x);
+}
+
+static void *compressor(void *arg) {
+  struct zjob *job;
+
+  for (;;) {
+    pthread_mutex_lock(&zlock);
+    while (!zjobs && !zquit) pthread_cond_wait(&zcond, &zlock);
+    job = zjobs;
+    if (job) {
+      zjobs = job->next;
+      if (!zjobs) ztail = &zjobs;
     }
+    pthread_mutex_unlock(&zlock);
+    if (!job) return NULL;
+    compress_log(job->stem);
+    free(job);
   }
-  if (unix_path == NULL) error_msg(__LINE__,"Must specify --sock\n");
-  if (unix_lock == NULL) error_msg(__LINE__,"Must specify --lock\n");
-  if (i == argc) error_msg(__LINE__,"Must specify a command to run\n");
-  if (strlen(unix_path) > sizeof(addr.sun_path)) error_msg(__LINE__,"socket path too long\n");
+}
 
-  lockfd = open(unix_lock, O_RDWR|O_CREAT, 0666);
-  if (lockfd == -1) perror_msg(__LINE__, unix_lock);
-  if (flock(lockfd, LOCK_EX | LOCK_NB) == -1) perror_msg(__LINE__,"flock (command already running)");
+static void compress_queue(const char *stem) {
+  struct zjob *job = calloc(1, sizeof *job);
+  if (job == NULL) perror_msg(__LINE__,"calloc");
+  snprintf(job->stem, sizeof job->stem, "%s", stem);
+
+  pthread_mutex_lock(&zlock);
+  if (!zrunning) {
+    sigset_t mask, old;
+    /* keep SIGCHLD and friends on the main thread */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &old);
+    if (pthread_create(&zthread, NULL, compressor, NULL)) error_msg(__LINE__,"pthread_create failed\n");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    zrunning = 1;
+  }
+  *ztail = job;
+  ztail = &job->next;
+  pthread_cond_signal(&zcond);
+  pthread_mutex_unlock(&zlock);
+}
 
-  sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-  if (sockfd == -1) perror_msg(__LINE__, "socket");
+static void compress_wait(void) {
+  if (!zrunning) return;
+  pthread_mutex_lock(&zlock);
+  zquit = 1;
+  pthread_cond_signal(&zcond);
+  pthread_mutex_unlock(&zlock);
+  pthread_join(zthread, NULL);
+}
+
+static void log_open(struct outlog *lg) {
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof path, "%s.log", lg->base);
+  lg->fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+  if (lg->fd == -1) perror_msg(__LINE__, path);
+  snprintf(path, sizeof path, "%s.idx", lg->base);
+  lg->ifd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+  if (lg->ifd == -1) perror_msg(__LINE__, path);
+  lg->size = lseek(lg->fd, 0, SEEK_END);
+  lg->last_ts = 0;
+}
+
+static void log_rotate(struct outlog *lg) {
+  char stem[PATH_MAX], from[PATH_MAX+8], to[PATH_MAX+8];
+  struct timeval tv;
+  char stamp[32];
+
+  close(lg->fd);
+  close(lg->ifd);
+  gettimeofday(&tv, NULL);
+  strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S", localtime(&tv.tv_sec));
+  snprintf(stem, sizeof stem, "%s.%s.%06ld", lg->base, stamp, (long)tv.tv_usec);
+
+  snprintf(from, sizeof from, "%s.log", lg->base);
+  snprintf(to, sizeof to, "%s.log", stem);
+  if (rename(from, to) == -1) perror(from);
+  snprintf(from, sizeof from, "%s.idx", lg->base);
+  snprintf(to, sizeof to, "%s.idx", stem);
+  if (rename(from, to) == -1) perror(from);
+  compress_queue(stem);
+  log_open(lg);
+}
+
+static void log_write(struct outlog *lg, const void *buf, size_t len) {
+  uint64_t ts = now_usec();
+
+  if (lg->size >= log_max) log_rotate(lg);
+  if (!lg->last_ts || ts - lg->last_ts >= LOG_IDXUSEC || lg->size - lg->last_raw >= LOG_IDXBYTES) {
+    struct logidx x = { ts, lg->size, lg->size };
+    unsigned char rec[LOG_IDXSZ];
+    logidx_put(rec, &x);
+    do_write(lg->ifd, rec, sizeof rec);
+    lg->last_ts = ts;
+    lg->last_raw = lg->size;
+  }
+  if (do_write(lg->fd, buf, len) != -1) lg->size += len;
+}
+
+static struct outlog *log_new(const char *dir, const char *name) {
+  struct outlog *lg = calloc(1, sizeof *lg);
+  if (lg == NULL) perror_msg(__LINE__,"calloc");
+  lg->base = malloc(strlen(dir) + (name ? strlen(name) : 0) + 2);
+  if (lg->base == NULL) perror_msg(__LINE__,"malloc");
+  if (name)
+    sprintf(lg->base, "%s/%s", dir, name);
+  else
+    strcpy(lg->base, dir);
+  log_open(lg);
+  return lg;
+}
+
+static void drop_client(struct client *c);
+
+/*
+ * Output to clients is queued and sent with a single write per
+ * client at the end of each loop pass, so that several small frames
+ * go out together.  Client sockets do not block: whatever a client
+ * does not take is left queued and sent on EPOLLOUT, and a client
+ * that lets more than OUTPUT_MAX pile up is dropped, so that one slow
+ * reader never holds up the command or the other clients.
+ */
+static void client_events(struct client *c) {
+  int events = (c->closing || c->ep.svc->paused ? 0 : EPOLLIN) | (c->olen ? EPOLLOUT : 0);
+
+  if (c->ep.fd == -1 || events == c->events) return;
+  c->events = events;
+  ep_mod(&c->ep, events);
+}
+static void queue(struct client *c, const void *buf, size_t len) {
+  if (c->ep.fd == -1) return;
+  if (c->olen + len > OUTPUT_MAX) {
+    fprintf(stderr,"%s: client too slow, dropped\n", c->ep.svc->name);
+    drop_client(c);
+    return;
+  }
+  if (c->olen + len > c->osz) {
+    size_t nsz = c->osz ? c->osz : 8192;
+    while (nsz < c->olen + len) nsz *= 2;
+    c->obuf = realloc(c->obuf, nsz);
+    if (c->obuf == NULL) perror_msg(__LINE__,"realloc");
+    c->osz = nsz;
+  }
+  memcpy(c->obuf + c->olen, buf, len);
+  c->olen += len;
+  if (!c->dirty) {
+    c->dirty = 1;
+    c->next = dirty;
+    dirty = c;
+  }
+}
+static void queue_frame(struct client *c, int ch, int op, const void *buf, size_t len) {
+  unsigned char hdr[FRAME_HDRSZ];
+  frame_hdr(hdr, ch, op, len, now_usec());
+  queue(c, hdr, sizeof hdr);
+  if (len) queue(c, buf, len);
+}
+/*
+ * Dropped clients may still have events pending in the current
+ * epoll batch, so they are only freed once the batch is done.
+ */
+static void drop_client(struct client *c) {
+  struct service *svc = c->ep.svc;
+  int i;
+
+  if (c->ep.fd == -1) return;
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    if (svc->clients[i] == c) svc->clients[i] = NULL;
+  }
+  ep_close(&c->ep);
+  c->olen = 0;
+  if (c->closing) lingering--;
+  if (!c->dirty) {
+    c->next = dead;
+    dead = c;
+  }
+}
+static void flush_client(struct client *c) {
+  size_t off = 0;
+  ssize_t n;
+
+  if (c->ep.fd == -1) return;
+  while (off < c->olen) {
+    n = write(c->ep.fd, c->obuf + off, c->olen - off);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) break;
+      drop_client(c);
+      return;
+    }
+    off += n;
+  }
+  c->olen -= off;
+  memmove(c->obuf, c->obuf + off, c->olen);
+  if (c->closing && !c->olen)
+    drop_client(c);
+  else
+    client_events(c);
+}
+/*
+ * Take a client off its service, but let it have the output that is
+ * still queued for it first.
+ */
+static void close_client(struct client *c) {
+  struct service *svc = c->ep.svc;
+  int i;
+
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    if (svc->clients[i] == c) svc->clients[i] = NULL;
+  }
+  flush_client(c);
+  if (c->ep.fd == -1) return;
+  if (!c->olen) {
+    drop_client(c);
+    return;
+  }
+  c->closing = 1;
+  lingering++;
+  client_events(c);
+}
+static void flush_all(void) {
+  struct client *c;
+
+  while ((c = dirty) != NULL) {
+    dirty = c->next;
+    /* still marked dirty, so that a drop does not list it as dead */
+    flush_client(c);
+    c->dirty = 0;
+    if (c->ep.fd == -1) {
+      c->next = dead;
+      dead = c;
+    }
+  }
+  while ((c = dead) != NULL) {
+    dead = c->next;
+    free(c->obuf);
+    free(c->ibuf);
+    free(c);
+  }
+}
+
+/*
+ * Input for the command is written without blocking.  Whatever it
+ * does not take right away is buffered, and once that buffer is over
+ * INPUT_MAX we stop reading from the clients until it drains.
+ */
+static void pause_input(struct service *svc, int paused) {
+  int i;
+
+  if (svc->paused == paused) return;
+  svc->paused = paused;
+  for (i = 0; i < MAX_CLIENTS; i++) {
+    if (svc->clients[i]) client_events(svc->clients[i]);
+  }
+  if (stdin_ep && stdin_ep->svc == svc) ep_mod(stdin_ep, paused ? 0 : EPOLLIN);
+}
+static void input_closed(struct service *svc) {
+  if (svc->in.fd != -1) ep_close(&svc->in);
+  svc->ilen = 0;
+  pause_input(svc, 0);
+}
+static void drain_input(struct service *svc) {
+  while (svc->ilen) {
+    ssize_t n = write(svc->in.fd, svc->ibuf, svc->ilen);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EINTR) break;
+      input_closed(svc);
+      return;
+    }
+    svc->ilen -= n;
+    memmove(svc->ibuf, svc->ibuf + n, svc->ilen);
+  }
+  ep_mod(&svc->in, svc->ilen ? EPOLLOUT : 0);
+  if (svc->ilen < INPUT_MAX/2) pause_input(svc, 0);
+}
+static void feed(struct service *svc, const void *buf, size_t len) {
+  if (svc->in.fd == -1) return;
+  if (!svc->ilen) {
+    ssize_t n = write(svc->in.fd, buf, len);
+    if (n == -1 && errno != EAGAIN && errno != EINTR) {
+      input_closed(svc);
+      return;
+    }
+    if (n > 0) {
+      buf += n;
+      len -= n;
+    }
+    if (!len) return;
+    ep_mod(&svc->in, EPOLLOUT);
+  }
+  if (svc->ilen + len > svc->isz) {
+    size_t nsz = svc->isz ? svc->isz : 8192;
+    while (nsz < svc->ilen + len) nsz *= 2;
+    svc->ibuf = realloc(svc->ibuf, nsz);
+    if (svc->ibuf == NULL) perror_msg(__LINE__,"realloc");
+    svc->isz = nsz;
+  }
+  memcpy(svc->ibuf + svc->ilen, buf, len);
+  svc->ilen += len;
+  if (svc->ilen > INPUT_MAX) pause_input(svc, 1);
+}
+
+/*
+ * Handle a control frame from a client.  Returns -1 if the
+ * client should be disconnected.
+ */
+static int control(struct client *c, struct frame *f, const unsigned char *data) {
+  pid_t pid = c->ep.svc->pid;
+
+  switch (f->op) {
+  case CTL_RESIZE:
+    /* The command runs on pipes, not a pty, so all we can do
+     * is tell it that the client side geometry changed */
+    if (f->len >= 4 && pid > 0) kill(-pid, SIGWINCH);
+    break;
+  case CTL_SIGNAL:
+    if (f->len >= 4 && pid > 0) kill(-pid, get_u32(data));
+    break;
+  case CTL_DETACH:
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Read from a client.  In raw mode bytes go straight to the
+ * command's stdin, in framed mode they are split into frames.
+ * Returns -1 if the client should be disconnected.
+ */
+static int client_input(struct client *c) {
+  struct service *svc = c->ep.svc;
+  size_t off;
+  ssize_t n;
+
+  if (!framed) {
+    char buf[8192];
+    n = read(c->ep.fd, buf, sizeof buf);
+    if (n <= 0) return -1;
+    feed(svc, buf, n);
+    return 0;
+  }
+  n = read(c->ep.fd, c->ibuf + c->ilen, FRAME_HDRSZ + FRAME_MAXDATA - c->ilen);
+  if (n <= 0) return -1;
+  c->ilen += n;
+
+  for (off = 0; c->ilen - off >= FRAME_HDRSZ; ) {
+    struct frame f;
+    const unsigned char *data = c->ibuf + off + FRAME_HDRSZ;
+
+    frame_parse(c->ibuf + off, &f);
+    if (f.len > FRAME_MAXDATA) return -1;
+    if (c->ilen - off < FRAME_HDRSZ + f.len) break;
+    if (f.channel == CH_STDIN) {
+      feed(svc, data, f.len);
+    } else if (f.channel == CH_CTRL) {
+      if (control(c, &f, data) == -1) return -1;
+    }
+    off += FRAME_HDRSZ + f.len;
+  }
+  c->ilen -= off;
+  memmove(c->ibuf, c->ibuf + off, c->ilen);
+  return 0;
+}
+
+static void accept_client(struct service *svc) {
+  struct client *c;
+  int cfd, j;
+
+  cfd = accept(svc->listen.fd, NULL, NULL);
+  if (cfd == -1) {
+    perror("accept");
+    return;
+  }
+  fcntl(cfd, F_SETFD, FD_CLOEXEC);
+  fcntl(cfd, F_SETFL, O_NONBLOCK);
+  for (j = 0; j < MAX_CLIENTS; j++) {
+    if (!svc->clients[j]) break;
+  }
+  if (j == MAX_CLIENTS) {
+    const char msg[] = "All Client Slots are FULL\n";
+    if (write(cfd, msg, sizeof(msg)-1) == -1) { /* gone already */ }
+    close(cfd);
+    return;
+  }
+  c = calloc(1, sizeof *c);
+  if (c == NULL) perror_msg(__LINE__,"calloc");
+  c->ep.kind = EP_CLIENT;
+  c->ep.fd = cfd;
+  c->ep.svc = svc;
+  c->events = EPOLLIN;
+  svc->clients[j] = c;
+  ep_add(&c->ep);
+  client_events(c);
+
+  if (framed) {
+    unsigned char ver[4];
+    c->ibuf = malloc(FRAME_HDRSZ + FRAME_MAXDATA);
+    if (c->ibuf == NULL) perror_msg(__LINE__,"malloc");
+    put_u32(ver, PROTO_VERSION);
+    queue_frame(c, CH_CTRL, CTL_HELLO, ver, sizeof ver);
+  } else {
+    const char msg[] = "[CONNECTED]\n";
+    queue(c, msg, sizeof(msg)-1);
+  }
+}
+
+static void output(struct service *svc, struct ep *ep) {
+  char buf[8192];
+  int i, n;
+
+  n = read(ep->fd, buf, sizeof buf);
+  if (n > 0) {
+    if (!multi) do_write(ep->ch, buf, n);
+    if (svc->log) log_write(svc->log, buf, n);
+    for (i=0; i < MAX_CLIENTS; i++) {
+      if (!svc->clients[i]) continue;
+      if (framed)
+	queue_frame(svc->clients[i], ep->ch, 0, buf, n);
+      else
+	queue(svc->clients[i], buf, n);
+    }
+  } else if (n == 0 || errno != EINTR) {
+    // channel is closed
+    ep_close(ep);
+  }
+}
+
+static void bind_service(struct service *svc) {
+  struct sockaddr_un addr;
+
+  if (strlen(svc->sock) >= sizeof(addr.sun_path)) error_msg(__LINE__,"socket path too long\n");
+
+  svc->listen.kind = EP_LISTEN;
+  svc->listen.svc = svc;
+  svc->listen.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (svc->listen.fd == -1) perror_msg(__LINE__, "socket");
 
   memset(&addr,0,sizeof(addr));
   addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path)-1);
-  unlink(unix_path);
+  strncpy(addr.sun_path, svc->sock, sizeof(addr.sun_path)-1);
+  unlink(svc->sock);
+
+  if (bind(svc->listen.fd,(struct sockaddr *)&addr, sizeof(addr)) == -1) perror_msg(__LINE__,svc->sock);
+  if (listen(svc->listen.fd,5) == -1) perror_msg(__LINE__,"listen");
+  fcntl(svc->listen.fd, F_SETFD, FD_CLOEXEC);
+  ep_add(&svc->listen);
+}
 
-  if (bind(sockfd,(struct sockaddr *)&addr, sizeof(addr)) == -1) perror_msg(__LINE__,"bind");
-  if (listen(sockfd,5) == -1) perror_msg(__LINE__,"bind");
+static void spawn(struct service *svc) {
+  int j, io[3][2];
+  sigset_t mask;
 
   for (j=0;j< 3; j++) {
     if (pipe(io[j]) == -1) perror_msg(__LINE__,"pipe");
   }
-
-  switch (fork()) {
+  switch (svc->pid = fork()) {
   case -1:
     perror_msg(__LINE__,"fork");
   case 0:
     /* Child process */
+    signal(SIGPIPE, SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
     close(0); close(1); close(2);
-    close(sockfd); close(lockfd);
     dup2(io[0][0],0); close(io[0][1]); close(io[0][0]);
     dup2(io[1][1],1); close(io[1][0]); close(io[1][1]);
     dup2(io[2][1],2); close(io[2][0]); close(io[2][1]);
     setsid();
-    execvp(argv[j],argv+j);
-    perror_msg(__LINE__, argv[j]);
+    execvp(svc->argv[0],svc->argv);
+    perror_msg(__LINE__, svc->argv[0]);
   default:
     /* Parent process */
     break;
@@ -137,96 +792,284 @@ int main(int argc, char **argv) {
   close(io[0][0]);
   close(io[1][1]);
   close(io[2][1]);
-  memset(clients, 0, sizeof(clients));
-  infd = 0;
+  fcntl(io[0][1], F_SETFD, FD_CLOEXEC);
+  fcntl(io[1][0], F_SETFD, FD_CLOEXEC);
+  fcntl(io[2][0], F_SETFD, FD_CLOEXEC);
 
-  for(;;) {
-    int n;
-    char buf[8192];
-    fd_set fds;
-
-    FD_ZERO(&fds); n = 0;
-    if (infd != -1) FD_SET(infd,&fds);
-    for (j=1; j< 3; j++) {
-      if (io[j][0] != -1) {
-	FD_SET(io[j][0],&fds);
-	if (io[j][0] > n) n = io[j][0];
-      }
+  svc->in.kind = EP_INPUT;
+  svc->in.fd = io[0][1];
+  svc->in.svc = svc;
+  fcntl(svc->in.fd, F_SETFL, O_NONBLOCK);
+  ep_add(&svc->in);
+  ep_mod(&svc->in, 0);
+  svc->reaped = 0;
+  svc->respawn = 0;
+  for (j=CH_STDOUT; j <= CH_STDERR; j++) {
+    svc->out[j].kind = EP_OUTPUT;
+    svc->out[j].fd = io[j][0];
+    svc->out[j].ch = j;
+    svc->out[j].svc = svc;
+    ep_add(&svc->out[j]);
+  }
+}
+
+/*
+ * A command is finished once both its output channels are closed
+ * and it has been reaped.  Single command mode exits at that point,
+ * in services mode clients are told and the command is restarted.
+ */
+static void check_exit(struct service *svc) {
+  unsigned char st[4];
+  int j;
+
+  if (exiting || svc->respawn || svc->out[CH_STDOUT].fd != -1 || svc->out[CH_STDERR].fd != -1) return;
+  if (!multi && !svc->reaped && framed) {
+    waitpid(svc->pid, &svc->status, 0);
+    svc->reaped = 1;
+  }
+  if (multi && !svc->reaped) return;
+
+  put_u32(st, svc->status);
+  for (j=0;j<MAX_CLIENTS;j++) {
+    struct client *c = svc->clients[j];
+    if (!c) continue;
+    if (framed) queue_frame(c, CH_CTRL, CTL_EXIT, st, sizeof st);
+    close_client(c);
+  }
+  flush_all();
+  if (!multi) {
+    /* the main loop exits once the clients have their output */
+    ep_close(&svc->listen);
+    exiting = now_ms() + LINGER_MS;
+    return;
+  }
+
+  input_closed(svc);
+  svc->pid = -1;
+  svc->respawn = now_ms() + RESPAWN_MS;
+  if (WIFSIGNALED(svc->status))
+    fprintf(stderr,"%s: killed by signal %d\n", svc->name, WTERMSIG(svc->status));
+  else
+    fprintf(stderr,"%s: exited with status %d\n", svc->name, WEXITSTATUS(svc->status));
+}
+
+static void reap(void) {
+  struct service *svc;
+  int status;
+  pid_t pid;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (svc = services; svc; svc = svc->next) {
+      if (svc->pid != pid) continue;
+      svc->status = status;
+      svc->reaped = 1;
+      check_exit(svc);
     }
-    FD_SET(sockfd,&fds); if (sockfd > n) n = sockfd;
-    for (j=0;j<MAX_CLIENTS;j++) {
-      if (clients[j]) {
-	FD_SET(clients[j],&fds);
-	if (clients[j] > n) n = clients[j];
-      }
+  }
+}
+
+static void read_services(const char *file) {
+  struct service **tail = &services;
+  char line[4096];
+  FILE *fp;
+
+  fp = fopen(file, "r");
+  if (fp == NULL) perror_msg(__LINE__, file);
+  while (fgets(line, sizeof line, fp) != NULL) {
+    char *name, *sock, *cmd;
+    struct service *svc;
+
+    line[strcspn(line, "\r\n")] = 0;
+    name = strtok(line, " \t");
+    if (name == NULL || name[0] == '#') continue;
+    sock = strtok(NULL, " \t");
+    cmd = strtok(NULL, "");
+    if (sock == NULL || cmd == NULL) {
+      fprintf(stderr,"%s: %s: missing socket or command\n", file, name);
+      exit(__LINE__);
+    }
+    svc = calloc(1, sizeof *svc);
+    if (svc == NULL) perror_msg(__LINE__,"calloc");
+    svc->name = strdup(name);
+    svc->sock = strdup(sock);
+    svc->argv = calloc(4, sizeof(char *));
+    if (svc->argv) svc->argv[2] = malloc(strlen(cmd) + 6);
+    if (!svc->name || !svc->sock || !svc->argv || !svc->argv[2]) perror_msg(__LINE__,"malloc");
+    svc->argv[0] = "/bin/sh";
+    svc->argv[1] = "-c";
+    // a simple command replaces the shell, so signals reach it; a list
+    // or a loop cannot be exec'd and goes to sh as it is
+    if (strpbrk(cmd, ";&|<>()`$\\\"'{}*?[]~#=!\n") == NULL)
+      sprintf(svc->argv[2], "exec %s", cmd);
+    else
+      strcpy(svc->argv[2], cmd);
+    *tail = svc;
+    tail = &svc->next;
+  }
+  fclose(fp);
+  if (services == NULL) error_msg(__LINE__,"No services defined\n");
+}
+
+int main(int argc, char **argv) {
+  const char *unix_path = NULL;
+  const char *unix_lock = NULL;
+  const char *services_file = NULL;
+  const char *log_path = NULL;
+  int i, lockfd;
+  struct service *svc;
+  struct ep sigep, inep;
+  sigset_t mask;
+
+  if (argc < 2) usage(argv[0]);
+  for (i=1; i < argc; i++) {
+    if (!strncmp(str_sock,argv[i],sizeof(str_sock)-1)) {
+      unix_path = argv[i]+sizeof(str_sock)-1;
+    } else if (!strncmp(str_lock,argv[i],sizeof(str_lock)-1)) {
+      unix_lock = argv[i]+sizeof(str_lock)-1;
+    } else if (!strncmp(str_services,argv[i],sizeof(str_services)-1)) {
+      services_file = argv[i]+sizeof(str_services)-1;
+    } else if (!strncmp(str_log,argv[i],sizeof(str_log)-1)) {
+      log_path = argv[i]+sizeof(str_log)-1;
+    } else if (!strncmp(str_logsize,argv[i],sizeof(str_logsize)-1)) {
+      log_max = parse_size(argv[i]+sizeof(str_logsize)-1);
+    } else if (!strcmp(str_framed, argv[i])) {
+      framed = 1;
+    } else if (!strcmp("-V", argv[i])) {
+      fprintf(stderr,"%s v%s\n", argv[0], VERSION);
+    } else if (!strcmp("-h", argv[i])) {
+      usage(argv[0]);
+    } else {
+      break;
     }
-    ++n;
+  }
+  if (unix_lock == NULL) error_msg(__LINE__,"Must specify --lock\n");
+  if (services_file) {
+    if (i != argc) error_msg(__LINE__,"Commands come from the services file\n");
+    read_services(services_file);
+    multi = 1;
+  } else {
+    if (unix_path == NULL) error_msg(__LINE__,"Must specify --sock\n");
+    if (i == argc) error_msg(__LINE__,"Must specify a command to run\n");
+    services = calloc(1, sizeof *services);
+    if (services == NULL) perror_msg(__LINE__,"calloc");
+    services->name = argv[i];
+    services->sock = (char *)unix_path;
+    services->argv = argv+i;
+  }
+
+  lockfd = open(unix_lock, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+  if (lockfd == -1) perror_msg(__LINE__, unix_lock);
+  if (flock(lockfd, LOCK_EX | LOCK_NB) == -1) perror_msg(__LINE__,"flock (command already running)");
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) perror_msg(__LINE__,"epoll_create1");
+
+  /* A client going away must not take us down with it */
+  signal(SIGPIPE, SIG_IGN);
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  sigep.kind = EP_SIGNAL;
+  sigep.fd = signalfd(-1, &mask, SFD_CLOEXEC|SFD_NONBLOCK);
+  if (sigep.fd == -1) perror_msg(__LINE__,"signalfd");
+  ep_add(&sigep);
+
+  for (svc = services; svc; svc = svc->next) {
+    if (log_path) svc->log = log_new(log_path, multi ? svc->name : NULL);
+    bind_service(svc);
+    spawn(svc);
+  }
+  if (!multi) {
+    inep.kind = EP_STDIN;
+    inep.fd = 0;
+    inep.svc = services;
+    /* epoll refuses regular files and /dev/null, treat those as EOF */
+    if (ep_watch(&inep) == 0)
+      stdin_ep = &inep;
+    else if (errno != EPERM)
+      perror_msg(__LINE__,"epoll_ctl");
+  }
 
-    if (select(n, &fds, NULL, NULL, NULL) == -1) perror_msg(__LINE__,"select");
+  for(;;) {
+    struct epoll_event evs[MAX_EVENTS];
+    long long now, next = 0;
+    int n, timeout = -1;
 
-    if (infd != -1 && FD_ISSET(infd, &fds)) {
-      n = read(infd,buf, sizeof buf);
-      if (n > 0) {
-	do_write(io[0][1],buf,n);
-      } else if (n == 0) {
-	close(infd);
-	infd = -1;
+    if (exiting) {
+      if (!lingering || now_ms() >= exiting) {
+	compress_wait();
+	exit(0);
       }
+      next = exiting;
     }
-    if (FD_ISSET(sockfd, &fds)) {
-      // OK, a new client!
-      int cfd = accept(sockfd, NULL, NULL);
-      if (cfd == -1) {
-	perror("accept");
-      } else {
-	for (j = 0; j < MAX_CLIENTS; j++) {
-	  if (!clients[j]) break;
-	}
-	if (j == MAX_CLIENTS) {
-	  const char msg[] = "All Client Slots are FULL\n";
-	  do_write(cfd, msg, sizeof(msg)-1);
-	  close(cfd);
+    for (svc = services; svc; svc = svc->next) {
+      if (svc->respawn && (!next || svc->respawn < next)) next = svc->respawn;
+    }
+    if (next) {
+      now = now_ms();
+      timeout = next > now ? next - now : 0;
+    }
+
+    n = epoll_wait(epfd, evs, MAX_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      perror_msg(__LINE__,"epoll_wait");
+    }
+
+    for (i = 0; i < n; i++) {
+      struct ep *ep = evs[i].data.ptr;
+      char buf[8192];
+      int r;
+
+      switch (ep->kind) {
+      case EP_STDIN:
+	r = read(ep->fd, buf, sizeof buf);
+	if (r > 0) {
+	  feed(ep->svc, buf, r);
 	} else {
-	  const char msg[] = "[CONNECTED]\n";
-	  do_write(cfd, msg, sizeof(msg)-1);
-	  clients[j] = cfd;
+	  /* Not closed, so that fd 0 is not handed out again */
+	  epoll_ctl(epfd, EPOLL_CTL_DEL, ep->fd, NULL);
+	  stdin_ep = NULL;
 	}
-      }
-    }
-    for (j=1; j < 3; j++) {
-      if (FD_ISSET(io[j][0], &fds)) {
-	n = read(io[j][0], buf, sizeof buf);
-	if (n > 0) {
-	  int i;
-	  do_write(j, buf, n);
-	  for (i=0; i < MAX_CLIENTS; i++) {
-	    if (!clients[i]) continue;
-	    if (do_write(clients[i], buf, n) == -1) {
-	      close(clients[i]);
-	      clients[i] = 0;
-	    }
-	  }
-	} else if (n == 0) {
-	  // channel is closed
-	  close(io[j][0]);
-	  io[j][0] = -1;
-	  if (io[1][0] == -1 && io[2][0] == -1) {
-	    // All output channels closed...
-	    exit(0);
-	  }
+	break;
+      case EP_SIGNAL:
+	while (read(ep->fd, buf, sizeof buf) > 0);
+	reap();
+	break;
+      case EP_LISTEN:
+	if (ep->fd != -1) accept_client(ep->svc);
+	break;
+      case EP_OUTPUT:
+	if (ep->fd == -1) break;
+	output(ep->svc, ep);
+	if (ep->fd == -1) check_exit(ep->svc);
+	break;
+      case EP_INPUT:
+	if (ep->fd == -1) break;
+	/* the command closed its stdin, EPOLLERR would come back forever */
+	if (evs[i].events & (EPOLLERR|EPOLLHUP))
+	  input_closed(ep->svc);
+	else
+	  drain_input(ep->svc);
+	break;
+      case EP_CLIENT:
+	if (ep->fd != -1 && evs[i].events & EPOLLOUT) flush_client((struct client *)ep);
+	if (ep->fd == -1 || !(evs[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))) break;
+	if (((struct client *)ep)->closing) {
+	  drop_client((struct client *)ep);
+	} else if (client_input((struct client *)ep) == -1) {
+	  flush_client((struct client *)ep);
+	  drop_client((struct client *)ep);
 	}
+	break;
       }
     }
-    for (j=0;j<MAX_CLIENTS;j++) {
-      if (!clients[j]) continue;
-      if (FD_ISSET(clients[j], &fds)) {
-	n = read(clients[j], buf, sizeof buf);
-	if (n > 0) {
-	  do_write(io[0][1], buf, n);
-	} else if (n == 0) {
-	  close(clients[j]);
-	  clients[j] = 0;
-	}
+    flush_all();
+
+    if (next) {
+      now = now_ms();
+      for (svc = services; svc; svc = svc->next) {
+	if (svc->respawn && svc->respawn <= now) spawn(svc);
       }
     }
   }
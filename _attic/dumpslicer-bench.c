@@ -0,0 +1,514 @@
+/*
+ * dumpslicer-bench: throughput and dedup benchmark for dumpslicer
+ *
+ * Build: cc -O2 -o dumpslicer-bench dumpslicer-bench.c  (needs dumpslicer.h)
+ *
+ * dumpslicer-bench [options] -- ./dumpslicer -c 256k
+ * dumpslicer-bench [options] -g day > day.sql
+ *
+ * Makes up a database of tables full of rows and lets it live for a
+ * number of days: every day some of the rows are changed, deleted or
+ * added (a few in between the existing ones, the rest at the end).
+ * Like in real tables the changes go mostly to the newest rows, the
+ * last -H percent of each table; -H 100 spreads them evenly, which
+ * is about the worst case for deduplication.
+ * Each day is dumped the way mysqldump does it, one row per INSERT or
+ * several with -e, and the slicer command is run on it in a directory
+ * of its own.  Everything is made up from the seed, so the same
+ * options always give the same dumps.
+ *
+ * Reports per day:
+ *  - MB/s of the slicer (wall clock) and its peak RSS.  The dump is
+ *    fed through a pipe, so that the RSS is the slicer's own; with -f
+ *    the slicer gets the file itself and may map it, then the pages
+ *    of the dump it touched count too
+ *  - how many slices it made
+ *  - how much of the day is in slices that the day before already had
+ *    (from the manifests, by hash)
+ * and over all days how much data there was against how much a store
+ * that keeps every slice only once would need.
+ *
+ * With -g it only writes the dump of one day to stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "dumpslicer.h"
+
+#define MAXPATH		1024
+#define GAP		16	/* between the ids of day 0, room for rows in between */
+
+struct row {
+  uint64_t id;
+  uint32_t version;
+};
+
+struct table {
+  struct row *rows;
+  size_t n;
+  uint64_t next_id;
+};
+
+static int ntables = 8, rowsize = 200, per_insert = 1, from_file = 0;
+static long nrows = 100000;
+static double rate = 0.01, hot = 0.1;
+static uint64_t seed = 1;
+
+static uint64_t splitmix(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static double uniform(uint64_t *x) {
+  return (splitmix(x) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xmalloc(size_t n) {
+  void *p = malloc(n);
+  if (!p) {
+    perror("malloc");
+    exit(1);
+  }
+  return p;
+}
+
+/*
+ * The database
+ */
+static struct table *db_create(void) {
+  struct table *db = calloc(ntables, sizeof *db);
+  int t;
+  long i;
+
+  if (!db) {
+    perror("calloc");
+    exit(1);
+  }
+  for (t = 0; t < ntables; t++) {
+    /* tables of very different sizes, like real ones */
+    long n = nrows * 2 / (t + 2);
+    db[t].rows = xmalloc(n * sizeof *db[t].rows);
+    for (i = 0; i < n; i++) {
+      db[t].rows[i].id = (i + 1) * GAP;
+      db[t].rows[i].version = 0;
+    }
+    db[t].n = n;
+    db[t].next_id = (n + 1) * GAP;
+  }
+  return db;
+}
+
+/*
+ * One day goes by: rate of the rows change, a quarter of those get
+ * deleted and about as many are added, all in the hot part.
+ */
+static void db_mutate(struct table *db, int day) {
+  double p = rate / hot > 1 ? 1 : rate / hot;
+  int t;
+
+  for (t = 0; t < ntables; t++) {
+    struct table *tb = &db[t];
+    uint64_t x = seed ^ (uint64_t)t << 32 ^ (uint64_t)day << 48;
+    size_t i, n = 0, size = tb->n + tb->n * rate + 16, append;
+    size_t cold = tb->n - (size_t)(tb->n * hot);
+    struct row *rows = xmalloc(size * sizeof *rows);
+
+    memcpy(rows, tb->rows, cold * sizeof *rows);
+    n = cold;
+    for (i = cold; i < tb->n; i++) {
+      struct row r = tb->rows[i];
+      double u = uniform(&x);
+      uint64_t next = i + 1 < tb->n ? tb->rows[i + 1].id : tb->next_id;
+
+      if (u < p * 0.25) continue;
+      if (u < p) r.version++;
+      rows[n++] = r;
+      if (uniform(&x) < p * 0.125 && r.id + 1 < next && n < size) {
+	rows[n].id = r.id + 1 + splitmix(&x) % (next - r.id - 1);
+	rows[n++].version = 0;
+      }
+    }
+    for (append = tb->n * rate * 0.125; append && n < size; append--) {
+      rows[n].id = tb->next_id;
+      rows[n++].version = 0;
+      tb->next_id += GAP;
+    }
+    free(tb->rows);
+    tb->rows = rows;
+    tb->n = n;
+  }
+}
+
+static void db_free(struct table *db) {
+  int t;
+  for (t = 0; t < ntables; t++) free(db[t].rows);
+  free(db);
+}
+
+/*
+ * The dump
+ */
+static void put_row(FILE *fp, int t, const struct row *r) {
+  static const char letters[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  uint64_t x = seed ^ (uint64_t)t << 56 ^ r->id * 0x100000001b3ULL ^ (uint64_t)r->version << 40;
+  int len = rowsize / 2 + splitmix(&x) % (rowsize + 1), i;
+  char text[4096];
+  int n = 0;
+
+  if (len > (int)sizeof text / 2) len = sizeof text / 2;
+  for (i = 0; i < len; i++) {
+    uint64_t v = splitmix(&x);
+    /* now and then something the scanner has to get right */
+    switch (v % 97) {
+    case 0: text[n++] = '\\'; text[n++] = '\''; break;
+    case 1: text[n++] = '('; break;
+    case 2: text[n++] = ')'; break;
+    case 3: text[n++] = ','; break;
+    default: text[n++] = letters[(v >> 8) % (sizeof letters - 1)];
+    }
+  }
+  fprintf(fp, "(%llu,'%.*s',%u,%llu)", (unsigned long long)r->id, n, text, r->version,
+	  (unsigned long long)(splitmix(&x) % 1000000));
+}
+
+static void dump(FILE *fp, struct table *db, int day) {
+  size_t i, per = per_insert;
+  int t;
+
+  fprintf(fp, "-- MySQL dump 10.13  Distrib 8.0.36, for Linux (x86_64)\n"
+	  "--\n-- Host: localhost    Database: bench\n"
+	  "-- ------------------------------------------------------\n"
+	  "-- Server version\t8.0.36\n\n"
+	  "/*!40101 SET @OLD_CHARACTER_SET_CLIENT=@@CHARACTER_SET_CLIENT */;\n"
+	  "/*!40101 SET NAMES utf8mb4 */;\n"
+	  "/*!40014 SET @OLD_UNIQUE_CHECKS=@@UNIQUE_CHECKS, UNIQUE_CHECKS=0 */;\n\n"
+	  "--\n-- Current Database: `bench`\n--\n\n"
+	  "CREATE DATABASE /*!32312 IF NOT EXISTS*/ `bench`;\n\nUSE `bench`;\n\n");
+  for (t = 0; t < ntables; t++) {
+    fprintf(fp, "--\n-- Table structure for table `t%d`\n--\n\n"
+	    "DROP TABLE IF EXISTS `t%d`;\n"
+	    "CREATE TABLE `t%d` (\n"
+	    "  `id` bigint NOT NULL,\n  `v` text,\n  `version` int NOT NULL,\n  `n` int NOT NULL,\n"
+	    "  PRIMARY KEY (`id`)\n) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;\n\n"
+	    "--\n-- Dumping data for table `t%d`\n--\n\n"
+	    "LOCK TABLES `t%d` WRITE;\n", t, t, t, t, t);
+    for (i = 0; i < db[t].n; i++) {
+      if (i % per == 0) fprintf(fp, "INSERT INTO `t%d` VALUES ", t);
+      else putc(',', fp);
+      put_row(fp, t, &db[t].rows[i]);
+      if (i % per == per - 1 || i == db[t].n - 1) fputs(";\n", fp);
+    }
+    fputs("UNLOCK TABLES;\n\n", fp);
+  }
+  fprintf(fp, "/*!40014 SET UNIQUE_CHECKS=@OLD_UNIQUE_CHECKS */;\n\n"
+	  "-- Dump completed on 2026-01-%02d  3:00:00\n", day % 28 + 1);
+}
+
+/*
+ * The harness
+ */
+struct store {
+  uint64_t *hash;	/* every slice seen so far, sorted */
+  size_t n, size;
+};
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int store_has(const struct store *st, uint64_t h) {
+  return bsearch(&h, st->hash, st->n, sizeof h, cmp_u64) != NULL;
+}
+
+static void store_add(struct store *st, uint64_t h) {
+  if (st->n == st->size) {
+    st->size = st->size ? st->size * 2 : 1024;
+    st->hash = realloc(st->hash, st->size * sizeof h);
+    if (!st->hash) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  st->hash[st->n++] = h;
+}
+
+static void store_sort(struct store *st) {
+  size_t i, n = 0;
+  qsort(st->hash, st->n, sizeof *st->hash, cmp_u64);
+  for (i = 0; i < st->n; i++)
+    if (!n || st->hash[n - 1] != st->hash[i]) st->hash[n++] = st->hash[i];
+  st->n = n;
+}
+
+static int by_hash(const void *a, const void *b) {
+  return cmp_u64(&((const struct manifest_entry *)a)->hash, &((const struct manifest_entry *)b)->hash);
+}
+
+static void rm_dir(const char *dir) {
+  char path[MAXPATH * 3];
+  struct dirent *de;
+  DIR *d = opendir(dir);
+
+  if (!d) return;
+  while ((de = readdir(d)) != NULL) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+    unlink(path);
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
+/* Copies input into the pipe p, in a child of its own */
+static pid_t feed(const char *input, const int p[2]) {
+  static char buf[256 * 1024];
+  pid_t pid = fork();
+  ssize_t n, w;
+  int in, fd = p[1];
+
+  if (pid) return pid;
+  /* with the read end open here too a slicer that is gone would leave
+     write() waiting for ever instead of failing with EPIPE */
+  close(p[0]);
+  in = open(input, O_RDONLY);
+  if (in == -1) {
+    perror(input);
+    _exit(1);
+  }
+  while ((n = read(in, buf, sizeof buf)) > 0) {
+    char *q = buf;
+    for (; n > 0; q += w, n -= w) {
+      w = write(fd, q, n);
+      /* the slicer gave up, it says why */
+      if (w == -1 && errno != EINTR) _exit(1);
+      if (w == -1) w = 0;
+    }
+  }
+  _exit(n == 0 ? 0 : 1);
+}
+
+/* Slice one day in dir, NULL if the slicer failed */
+static struct manifest_entry *run(char **cmd, const char *input, const char *dir,
+				  size_t *count, double *secs, long *maxrss) {
+  char manifest[MAXPATH * 3];
+  struct rusage ru;
+  int status, p[2] = { -1, -1 };
+  double t = now();
+  pid_t pid, feeder = -1;
+
+  if (!from_file) {
+    if (pipe(p) == -1) {
+      perror("pipe");
+      exit(1);
+    }
+    fflush(NULL);
+    feeder = feed(input, p);
+    if (feeder == -1) {
+      perror("fork");
+      exit(1);
+    }
+  }
+  pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    int fd = from_file ? open(input, O_RDONLY) : p[0];
+    if (fd == -1 || dup2(fd, 0) == -1 || chdir(dir) == -1) {
+      perror(input);
+      _exit(127);
+    }
+    if (!from_file) {
+      close(p[0]);
+      close(p[1]);
+    }
+    execvp(cmd[0], cmd);
+    perror(cmd[0]);
+    _exit(127);
+  }
+  if (!from_file) {
+    close(p[0]);
+    close(p[1]);
+  }
+  while (wait4(pid, &status, 0, &ru) == -1) {
+    if (errno != EINTR) {
+      perror("wait4");
+      exit(1);
+    }
+  }
+  *secs = now() - t;
+  if (feeder != -1) while (waitpid(feeder, NULL, 0) == -1 && errno == EINTR);
+  *maxrss = ru.ru_maxrss;
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "%s failed\n", cmd[0]);
+    return NULL;
+  }
+  snprintf(manifest, sizeof manifest, "%s/manifest", dir);
+  return manifest_load(manifest, count);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "Usage:\n"
+	  "\t%s [options] -- slicer [slicer options]\n"
+	  "\t%s [options] -g day > dump.sql\n"
+	  "\t-t tables:\tnumber of tables (%d)\n"
+	  "\t-r rows:\trows in the biggest table (%ld)\n"
+	  "\t-l bytes:\taverage row text length (%d)\n"
+	  "\t-m pct:\t\trows changed per day, percent (%.1f)\n"
+	  "\t-H pct:\t\tthe changes go to the newest pct of the rows (%.0f)\n"
+	  "\t-d days:\tdays to run (3)\n"
+	  "\t-e rows:\trows per INSERT, more than 1 for extended inserts (%d)\n"
+	  "\t-s seed:\trandom seed (%llu)\n"
+	  "\t-w dir:\t\twork directory (a new one in /tmp)\n"
+	  "\t-f:\t\tthe dump file on the slicer's stdin, not a pipe (RSS includes the mapped dump)\n"
+	  "\t-k:\t\tkeep the dumps and slices\n",
+	  argv0, argv0, ntables, nrows, rowsize, rate * 100, hot * 100, per_insert, (unsigned long long)seed);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  char work[MAXPATH] = "", input[MAXPATH * 2], dir[MAXPATH * 2];
+  struct store seen = { 0 }, prev = { 0 }, cur = { 0 };
+  int opt, days = 3, gen = -1, keep = 0, day;
+  uint64_t total = 0, unique = 0;
+  struct table *db;
+  FILE *fp;
+
+  while ((opt = getopt(argc, argv, "t:r:l:m:H:d:e:s:w:g:kf")) != -1) {
+    switch (opt) {
+    case 't': ntables = atoi(optarg); break;
+    case 'r': nrows = atol(optarg); break;
+    case 'l': rowsize = atoi(optarg); break;
+    case 'm': rate = atof(optarg) / 100; break;
+    case 'H': hot = atof(optarg) / 100; break;
+    case 'd': days = atoi(optarg); break;
+    case 'e': per_insert = atoi(optarg); break;
+    case 's': seed = strtoull(optarg, NULL, 0); break;
+    case 'w': snprintf(work, sizeof work, "%s", optarg); break;
+    case 'g': gen = atoi(optarg); break;
+    case 'k': keep = 1; break;
+    case 'f': from_file = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (ntables < 1 || nrows < 1 || rowsize < 1 || per_insert < 1 || days < 1 || hot <= 0 || hot > 1)
+    usage(argv[0]);
+
+  db = db_create();
+  if (gen >= 0) {
+    static char obuf[1 << 20];
+    setvbuf(stdout, obuf, _IOFBF, sizeof obuf);
+    for (day = 1; day <= gen; day++) db_mutate(db, day);
+    dump(stdout, db, gen);
+    db_free(db);
+    return fflush(stdout) ? 1 : 0;
+  }
+  if (optind >= argc) usage(argv[0]);
+  if (!*work) {
+    snprintf(work, sizeof work, "/tmp/dumpslicer-bench.XXXXXX");
+    if (!mkdtemp(work)) {
+      perror(work);
+      return 1;
+    }
+  } else if (mkdir(work, 0777) == -1 && errno != EEXIST) {
+    perror(work);
+    return 1;
+  }
+
+  printf("%d tables, %ld rows, %d byte rows, %.1f%% changed a day in the newest %.0f%%, %d rows per insert\n",
+	 ntables, nrows, rowsize, rate * 100, hot * 100, per_insert);
+  printf("day       MB       s     MB/s  %s  slices   same as day before\n",
+	 from_file ? "rss+map" : " rss MB");
+  for (day = 0; day < days; day++) {
+    struct manifest_entry *e;
+    uint64_t bytes = 0, same = 0;
+    size_t n, i;
+    double secs;
+    long maxrss;
+
+    if (day) db_mutate(db, day);
+    snprintf(input, sizeof input, "%s/day%d.sql", work, day);
+    snprintf(dir, sizeof dir, "%s/day%d", work, day);
+    fp = fopen(input, "w");
+    if (!fp) {
+      perror(input);
+      return 1;
+    }
+    dump(fp, db, day);
+    if (fclose(fp)) {
+      perror(input);
+      return 1;
+    }
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+      perror(dir);
+      return 1;
+    }
+    e = run(argv + optind, input, dir, &n, &secs, &maxrss);
+    if (!e) {
+      fprintf(stderr, "left in %s\n", work);
+      return 1;
+    }
+
+    cur.n = 0;
+    for (i = 0; i < n; i++) {
+      bytes += e[i].bytes;
+      if (store_has(&prev, e[i].hash)) same += e[i].bytes;
+      store_add(&cur, e[i].hash);
+    }
+    /* a slice twice in one day is stored once too */
+    qsort(e, n, sizeof *e, by_hash);
+    for (i = 0; i < n; i++) {
+      if (i && e[i].hash == e[i - 1].hash) continue;
+      if (!store_has(&seen, e[i].hash)) unique += e[i].bytes;
+    }
+    for (i = 0; i < cur.n; i++) store_add(&seen, cur.hash[i]);
+    store_sort(&seen);
+    store_sort(&cur);
+    total += bytes;
+    printf("%3d %8.1f %7.2f %8.1f %8.1f %7zu   ", day, bytes / 1048576.0, secs,
+	   secs > 0 ? bytes / 1048576.0 / secs : 0.0, maxrss / 1024.0, n);
+    if (day) printf("%5.1f%%\n", bytes ? 100.0 * same / bytes : 0.0);
+    else printf("    -\n");
+    fflush(stdout);
+
+    {
+      struct store t = prev;
+      prev = cur;
+      cur = t;
+    }
+    free(e);
+    if (!keep) {
+      unlink(input);
+      rm_dir(dir);
+    }
+  }
+  printf("%.1f MB in %d days, %.1f MB unique slices, dedup ratio %.2f\n",
+	 total / 1048576.0, days, unique / 1048576.0, unique ? (double)total / unique : 0.0);
+  if (!keep) rmdir(work);
+  else printf("kept in %s\n", work);
+  db_free(db);
+  free(seen.hash);
+  free(prev.hash);
+  free(cur.hash);
+  return 0;
+}
@@ -0,0 +1,522 @@
+/*
+ * Put a dump sliced by dumpslicer back together
+ *
+ * dumpslicer-restore manifest | mysql -uroot
+ * dumpslicer-restore -j 4 -e 'mysql -uroot' manifest
+ *
+ * Build: cc -O2 -o dumpslicer-restore dumpslicer-restore.c -lz  (needs dumpslicer.h)
+ *
+ * The slices are read in manifest order, gzipped ones (.gz) are
+ * unpacked, and each one is checked against the size and hash in the
+ * manifest before any of it is written: a missing or damaged slice
+ * stops the restore without a byte of it going out.
+ *
+ * With -T only one table is put out, named as in the manifest
+ * ("db.table"), with just the SET and USE statements of the global
+ * section in front, so it can be loaded on its own into a database
+ * that is already there.  The global slices themselves stay out: with
+ * --add-drop-database they would drop the rest of the database.
+ *
+ * With -e the global section, up to where the last table starts,
+ * goes into the command once.  Then every table goes into a command
+ * of its own, -j of them at a time, biggest tables first, with only
+ * the SET and USE statements of the global section in front.  What
+ * comes after the tables (routines, final views) goes in once all
+ * of them are loaded.  The command gets the table name in
+ * DUMPSLICER_TABLE, empty for the global section.  This needs a dump
+ * sliced with -t, by a dumpslicer that tells the databases apart: a
+ * table whose slices are under more than one USE is refused.
+ */
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#define _GNU_SOURCE	/* memmem */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#include "dumpslicer.h"
+
+#define FALSE 0
+#define TRUE (!FALSE)
+#define MAXPATH 1024
+
+const char version[] = "0.1";
+
+static char dir[MAXPATH];	/* where the manifest is, slices are relative to it */
+static int verbose = FALSE;
+static char *buf = NULL;
+static size_t bufsize = 0;
+
+/* Room for at least n bytes in buf */
+static void buf_room(size_t n) {
+  if (n <= bufsize) return;
+  while (bufsize < n) bufsize = bufsize ? bufsize * 2 : 4*1024*1024;
+  buf = realloc(buf, bufsize);
+  if (!buf) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Whole slice into buf, -1 if it can not be read */
+static ssize_t slice_load(const struct manifest_entry *e) {
+  char path[MAXPATH + MANIFEST_NAMESZ];
+  size_t len = 0, flen = strlen(e->file);
+  gzFile gz;
+  int n;
+
+  snprintf(path, sizeof path, "%s%s", dir, e->file);
+  /* one more than the manifest says, so that a longer file shows */
+  buf_room(e->bytes + 1);
+  if (flen > 3 && !strcmp(e->file + flen - 3, ".gz")) {
+    gz = gzopen(path, "rb");
+    if (!gz) {
+      perror(path);
+      return -1;
+    }
+    gzbuffer(gz, 128*1024);
+    for (;;) {
+      if (len == bufsize) buf_room(bufsize + 1);
+      n = gzread(gz, buf + len, bufsize - len > 1U<<30 ? 1U<<30 : bufsize - len);
+      if (n <= 0) break;
+      len += n;
+    }
+    if (n < 0) {
+      int err;
+      /* zlib puts the path in front itself */
+      fprintf(stderr,"%s\n", gzerror(gz, &err));
+      gzclose(gz);
+      return -1;
+    }
+    gzclose(gz);
+  } else {
+    int fd = open(path, O_RDONLY);
+    ssize_t r;
+
+    if (fd == -1) {
+      perror(path);
+      return -1;
+    }
+    for (;;) {
+      if (len == bufsize) buf_room(bufsize + 1);
+      r = read(fd, buf + len, bufsize - len);
+      if (r == -1 && errno == EINTR) continue;
+      if (r <= 0) break;
+      len += r;
+    }
+    if (r == -1) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    close(fd);
+  }
+  return len;
+}
+
+static int slice_check(const struct manifest_entry *e, size_t len) {
+  struct xxh64 x;
+  uint64_t h;
+
+  if (len != e->bytes) {
+    fprintf(stderr,"%s%s: %llu bytes, manifest says %llu\n", dir, e->file,
+	    (unsigned long long)len, (unsigned long long)e->bytes);
+    return FALSE;
+  }
+  xxh64_init(&x);
+  xxh64_update(&x, buf, len);
+  h = xxh64_digest(&x);
+  if (h != e->hash) {
+    fprintf(stderr,"%s%s: hash %016llx, manifest says %016llx\n", dir, e->file,
+	    (unsigned long long)h, (unsigned long long)e->hash);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static int write_all(int fd, const char *p, size_t n) {
+  while (n) {
+    ssize_t r = write(fd, p, n);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+/*
+ * The slices from..to-1 of table, or of every table with a NULL one,
+ * and with globals those of the global section, checked and written
+ * to fd; fd -1 only checks.
+ */
+static int restore(int fd, const struct manifest_entry *e, size_t from, size_t to,
+		   const char *table, int globals) {
+  uint64_t total = 0;
+  size_t i;
+  ssize_t len;
+
+  for (i = from; i < to; i++) {
+    if (*e[i].table ? table && strcmp(e[i].table, table) : !globals) continue;
+    len = slice_load(&e[i]);
+    if (len == -1 || !slice_check(&e[i], len)) return -1;
+    if (fd != -1 && write_all(fd, buf, len) == -1) {
+      perror("write");
+      return -1;
+    }
+    total += len;
+    if (verbose) fprintf(stderr,"dumpslicer-restore: %s ok\n", e[i].file);
+  }
+  if (verbose) fprintf(stderr,"dumpslicer-restore: %s%s%llu bytes\n", table ? table : "",
+		       table ? ": " : "", (unsigned long long)total);
+  return 0;
+}
+
+/*
+ * Parallel load
+ *
+ * The manifest is cut at the first global slice after the last table
+ * has started.  Before the cut are the tables, each a job of its own,
+ * and the global slices between them (CREATE DATABASE and USE, also
+ * of the other databases), which go in first as one.  What follows
+ * the cut goes in last as one.  mysqldump names a view twice: its
+ * stand-in table is a job like the tables, its CREATE VIEW comes
+ * after the cut.
+ */
+struct job {
+  const char *table;
+  uint64_t bytes;
+  size_t from, to;	/* the slices it takes */
+  int globals;		/* global slices too */
+  int all;		/* and every table's, for the tail */
+  char *context;	/* SET and USE statements to go first */
+  char *use;		/* the USE in it */
+  pid_t pid;
+};
+
+/*
+ * The session state the global section sets up: its SET statements
+ * (but not SET @@GLOBAL ones, those are done once) and the last USE.
+ */
+struct context {
+  char *sets;
+  size_t setslen;
+  char use[MANIFEST_NAMESZ + 16];
+};
+
+static void context_scan(struct context *c, const char *p, size_t len, int sets) {
+  const char *end = p + len, *nl;
+  size_t n;
+
+  for (; p < end; p = nl + 1) {
+    nl = memchr(p, '\n', end - p);
+    if (!nl) nl = end;
+    n = nl - p;
+    if (n > 4 && !memcmp(p, "USE ", 4) && n < sizeof c->use - 1) {
+      memcpy(c->use, p, n);
+      c->use[n] = '\n';
+      c->use[n + 1] = 0;
+    } else if (sets && ((n > 4 && !memcmp(p, "SET ", 4)) ||
+			(n > 3 && !memcmp(p, "/*!", 3) && memmem(p, n, " SET ", 5))) &&
+	       !memmem(p, n, "@@GLOBAL", 8)) {
+      c->sets = realloc(c->sets, c->setslen + n + 1);
+      if (!c->sets) {
+	perror("realloc");
+	exit(EXIT_FAILURE);
+      }
+      memcpy(c->sets + c->setslen, p, n);
+      c->sets[c->setslen + n] = '\n';
+      c->setslen += n + 1;
+    }
+  }
+}
+
+static char *context_get(const struct context *c) {
+  char *s = malloc(c->setslen + strlen(c->use) + 1);
+  if (!s) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(s, c->sets, c->setslen);
+  strcpy(s + c->setslen, c->use);
+  return s;
+}
+
+static char *xstrdup(const char *s) {
+  char *d = strdup(s);
+  if (!d) {
+    perror("strdup");
+    exit(EXIT_FAILURE);
+  }
+  return d;
+}
+
+static int by_size(const void *a, const void *b) {
+  const struct job *x = a, *y = b;
+  return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+/* The job's slices into cmd, the exit status of cmd or EXIT_FAILURE */
+static int load(const struct job *j, const struct manifest_entry *e, const char *cmd) {
+  int p[2], status, ok;
+  pid_t pid;
+
+  if (pipe(p) == -1) {
+    perror("pipe");
+    return EXIT_FAILURE;
+  }
+  fflush(NULL);
+  pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    return EXIT_FAILURE;
+  }
+  if (pid == 0) {
+    dup2(p[0], STDIN_FILENO);
+    close(p[0]);
+    close(p[1]);
+    setenv("DUMPSLICER_TABLE", j->table, 1);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    perror("/bin/sh");
+    _exit(127);
+  }
+  close(p[0]);
+  ok = (!j->context || write_all(p[1], j->context, strlen(j->context)) == 0) &&
+    restore(p[1], e, j->from, j->to, j->all ? NULL : j->table, j->globals) == 0;
+  close(p[1]);
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+  if (!ok) return EXIT_FAILURE;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+/* The head or the tail, on its own */
+static int load_global(struct job *j, const struct manifest_entry *e, const char *cmd, const char *what) {
+  if (j->from == j->to) return 0;
+  if (load(j, e, cmd)) {
+    fprintf(stderr,"dumpslicer-restore: %s of the global section failed\n", what);
+    return -1;
+  }
+  if (verbose) fprintf(stderr,"dumpslicer-restore: %s of the global section loaded\n", what);
+  return 0;
+}
+
+static int load_tables(const struct manifest_entry *e, size_t n, const char *cmd, int jobs) {
+  struct job *list = calloc(n, sizeof *list), head = { "" }, tail = { "" };
+  struct context ctx = { NULL };
+  size_t i, k, first = n, last = 0, count = 0, next = 0;
+  ssize_t len;
+  int running = 0, failed = 0, status;
+  pid_t pid;
+
+  if (!list) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  /* where the last table starts, the tail is after it */
+  for (i = 0; i < n; i++) {
+    if (!*e[i].table) continue;
+    if (first == n) first = i;
+    for (k = 0; k < count && strcmp(list[k].table, e[i].table); k++);
+    if (k == count) {
+      list[count++].table = e[i].table;
+      last = i;
+    }
+  }
+  if (!count) {
+    fputs("dumpslicer-restore: no tables in the manifest, slice with -t\n", stderr);
+    free(list);
+    return -1;
+  }
+  for (i = last; i < n && *e[i].table; i++);
+  head.to = tail.from = i;
+  tail.to = n;
+  head.globals = tail.globals = tail.all = TRUE;
+
+  /* every job gets the session state as it was where its table starts */
+  for (i = 0; i < head.to; i++) {
+    if (!*e[i].table) {
+      len = slice_load(&e[i]);
+      if (len == -1 || !slice_check(&e[i], len)) {
+	free(ctx.sets);
+	failed++;
+	goto done;
+      }
+      context_scan(&ctx, buf, len, i < first);
+      continue;
+    }
+    for (k = 0; strcmp(list[k].table, e[i].table); k++);
+    if (!list[k].context) {
+      list[k].context = context_get(&ctx);
+      list[k].use = xstrdup(ctx.use);
+      list[k].from = i;
+    } else if (strcmp(list[k].use, ctx.use)) {
+      /* one job, one USE: the rest would load into the wrong database */
+      fprintf(stderr,"dumpslicer-restore: %s: in more than one database, slice the dump again\n",
+	      list[k].table);
+      free(ctx.sets);
+      failed++;
+      goto done;
+    }
+    list[k].to = head.to;
+    list[k].bytes += e[i].bytes;
+  }
+  tail.context = context_get(&ctx);
+  free(ctx.sets);
+
+  signal(SIGPIPE, SIG_IGN);
+  if (load_global(&head, e, cmd, "head") == -1) {
+    failed++;
+    goto done;
+  }
+  /* biggest first, so the long ones do not come last */
+  qsort(list, count, sizeof *list, by_size);
+  fflush(NULL);
+  while (next < count || running) {
+    if (next < count && running < jobs) {
+      pid = fork();
+      if (pid == -1) {
+	perror("fork");
+	exit(EXIT_FAILURE);
+      }
+      if (pid == 0) _exit(load(&list[next], e, cmd));
+      list[next++].pid = pid;
+      running++;
+      continue;
+    }
+    pid = wait(&status);
+    if (pid == -1) {
+      if (errno == EINTR) continue;
+      perror("wait");
+      exit(EXIT_FAILURE);
+    }
+    for (k = 0; k < next && list[k].pid != pid; k++);
+    if (k == next) continue;
+    running--;
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr,"dumpslicer-restore: %s failed\n", list[k].table);
+      failed++;
+    } else if (verbose) {
+      fprintf(stderr,"dumpslicer-restore: %s loaded\n", list[k].table);
+    }
+  }
+  if (!failed && load_global(&tail, e, cmd, "tail") == -1) failed++;
+
+done:
+  for (k = 0; k < count; k++) {
+    free(list[k].context);
+    free(list[k].use);
+  }
+  free(tail.context);
+  free(list);
+  return failed ? -1 : 0;
+}
+
+/*
+ * -T: the slices of table, after the SET and USE statements of the
+ * global section before it; -1 if the manifest does not have it
+ */
+static int restore_table(int fd, const struct manifest_entry *e, size_t n, const char *table) {
+  struct context ctx = { NULL };
+  size_t i, first = n, start = n;
+  ssize_t len;
+  char *s;
+  int ret = 0;
+
+  for (i = 0; i < n && start == n; i++) {
+    if (!*e[i].table) continue;
+    if (first == n) first = i;
+    if (!strcmp(e[i].table, table)) start = i;
+  }
+  if (start == n) {
+    fprintf(stderr,"dumpslicer-restore: %s: no such table in the manifest\n", table);
+    return -1;
+  }
+  for (i = 0; i < start; i++) {
+    if (*e[i].table) continue;
+    len = slice_load(&e[i]);
+    if (len == -1 || !slice_check(&e[i], len)) {
+      free(ctx.sets);
+      return -1;
+    }
+    context_scan(&ctx, buf, len, i < first);
+  }
+  s = context_get(&ctx);
+  free(ctx.sets);
+  if (fd != -1 && write_all(fd, s, strlen(s)) == -1) {
+    perror("write");
+    ret = -1;
+  }
+  free(s);
+  return ret ? ret : restore(fd, e, start, n, table, FALSE);
+}
+
+int main(int argc,char **argv) {
+  struct manifest_entry *e;
+  size_t n;
+  char *table = NULL, *cmd = NULL, *slash;
+  int opt, jobs = 1, check = FALSE, ret;
+
+  while ((opt = getopt(argc,argv,"h?VvnT:e:j:")) != -1) {
+    switch(opt) {
+    case 'h':
+    case '?':
+      fprintf(stderr,"Usage:\n\t%s [-h?] [-v] [-V] [-n] [-T table] [-e cmd [-j jobs]] manifest\n",argv[0]);
+      fputs("\t-h|-?:\tshow help\n", stderr);
+      fputs("\t-v:\tverbose\n", stderr);
+      fputs("\t-V:\tprint version info\n", stderr);
+      fputs("\t-n:\tOnly check the slices, write nothing\n", stderr);
+      fputs("\t-T table:\tOnly this table (db.table, as in the manifest)\n", stderr);
+      fputs("\t-e cmd:\tFeed every table to a cmd of its own (sh -c)\n", stderr);
+      fputs("\t-j jobs:\tRun this many cmds at a time\n", stderr);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'V':
+      printf("%s v%s\n", argv[0], version);
+      exit(EXIT_SUCCESS);
+      break;
+    case 'v':
+      verbose = TRUE;
+      break;
+    case 'n':
+      check = TRUE;
+      break;
+    case 'T':
+      table = optarg;
+      break;
+    case 'e':
+      cmd = optarg;
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      if (jobs < 1) jobs = 1;
+      break;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr,"Usage: %s [options] manifest\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  e = manifest_load(argv[optind], &n);
+  if (!e) {
+    perror(argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  slash = strrchr(argv[optind], '/');
+  if (slash) snprintf(dir, sizeof dir, "%.*s", (int)(slash + 1 - argv[optind]), argv[optind]);
+
+  if (cmd && !check) ret = load_tables(e, n, cmd, jobs);
+  else if (table) ret = restore_table(check ? -1 : STDOUT_FILENO, e, n, table);
+  else ret = restore(check ? -1 : STDOUT_FILENO, e, 0, n, NULL, TRUE);
+  free(e);
+  exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -2,40 +2,893 @@
  * Slice a mysqldump file so that it can be more easily
  * handled by de-duplication
  *
- * mysqldump -uroot --skip-extended-insert --databases $dbname > out.txt 
+ * mysqldump -uroot --skip-extended-insert --databases $dbname > out.txt
+ *
+ * or, with -r, straight from a dump with extended inserts, see
+ * "Extended inserts" below.
+ *
+ * Every slice is hashed as it goes by and listed in <prefix>manifest
+ * (format in dumpslicer.h).  With -i the manifest of the last run is
+ * checked and slices that came out the same are not written again.
+ * With -t every table gets a series of slices of its own, see "Per
+ * table slices" below.  With -z slices are gzipped on the way out by
+ * a pool of threads, see "Compression".
+ *
+ * Build: cc -O2 -o dumpslicer dumpslicer.c -lpthread -lz  (needs dumpslicer.h)
  */
 /* These are to handle 64 bit file sizes... i.e. more than 4GB...
- * However we really don't need these as we are not really going
- * to create 4GB+ segment files...
+ * The input is read with plain read()/mmap() and the slices are
+ * counted by hand, but the dump itself can well be bigger than 4GB.
  */
-//~ #ifndef _FILE_OFFSET_BITS
-//~ #define _FILE_OFFSET_BITS 64
-//~ #endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#define _GNU_SOURCE	/* memmem */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dumpslicer.h"
 
 #define FALSE 0
 #define TRUE (!FALSE)
-#define LINESZ	4096
 #define MAXPATH 1024
+#define READSZ	(4*1024*1024)	/* input block, grows for longer lines */
+#define OUTSZ	(1024*1024)	/* output block, written aligned */
+#define ALIGN	4096
+#define NAMESZ	256	/* table names, MySQL allows 64 characters */
+
+const char version[] = "0.6";
+
+/*
+ * Input
+ *
+ * Regular files are mapped whole and lines are handed out straight
+ * from the map.  Pipes are read in READSZ blocks; a line that does
+ * not fit grows the buffer, so there is no limit on line length.
+ * Newlines are found with memchr(), which the C library implements
+ * with vector instructions.
+ */
+struct input {
+  int fd;
+  char *buf;
+  size_t size;		/* allocated (or mapped) */
+  size_t start, end;	/* unconsumed data */
+  int eof, mapped;
+};
+
+static void input_open(struct input *in, int fd) {
+  struct stat st;
+
+  memset(in, 0, sizeof *in);
+  in->fd = fd;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    in->buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (in->buf != MAP_FAILED) {
+      madvise(in->buf, st.st_size, MADV_SEQUENTIAL);
+      in->size = in->end = st.st_size;
+      in->eof = in->mapped = TRUE;
+      return;
+    }
+  }
+  in->size = READSZ;
+  in->buf = malloc(in->size);
+  if (!in->buf) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int input_fill(struct input *in) {
+  ssize_t n;
+
+  if (in->eof) return FALSE;
+  if (in->start) {
+    memmove(in->buf, in->buf + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+  }
+  if (in->end == in->size) {
+    in->size *= 2;
+    in->buf = realloc(in->buf, in->size);
+    if (!in->buf) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  do {
+    n = read(in->fd, in->buf + in->end, in->size - in->end);
+  } while (n == -1 && errno == EINTR);
+  if (n == -1) {
+    perror("read");
+    exit(EXIT_FAILURE);
+  }
+  if (n == 0) in->eof = TRUE;
+  in->end += n;
+  return n > 0;
+}
+
+/* Next line, newline included (except maybe the last one) */
+static char *input_line(struct input *in, size_t *len) {
+  size_t scanned = 0;
+  char *line, *nl;
+
+  for (;;) {
+    nl = memchr(in->buf + in->start + scanned, '\n', in->end - in->start - scanned);
+    if (nl) break;
+    scanned = in->end - in->start;
+    if (!input_fill(in)) {
+      if (in->start == in->end) return NULL;
+      nl = in->buf + in->end - 1;
+      break;
+    }
+  }
+  line = in->buf + in->start;
+  *len = nl + 1 - line;
+  in->start += *len;
+  return line;
+}
+
+static void input_close(struct input *in) {
+  if (in->mapped) munmap(in->buf, in->size);
+  else free(in->buf);
+}
+
+/*
+ * Output
+ *
+ * Slices are collected in an aligned OUTSZ buffer and written a full
+ * block at a time.  size counts what went into the slice, so there is
+ * no need to ask the file where it is.
+ *
+ * With keep set the whole slice stays in memory (the buffer grows to
+ * the slice size) and the file is only created when it is closed, so
+ * the caller can still decide not to write it at all.
+ */
+struct slice {
+  int fd;
+  char name[MAXPATH];
+  off_t size;
+  char *buf;
+  size_t len, bufsize;
+  int active, keep;
+  struct xxh64 hash;
+};
+
+static void slice_flush(struct slice *s) {
+  size_t done = 0;
+
+  while (done < s->len) {
+    ssize_t n = write(s->fd, s->buf + done, s->len - done);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      perror(s->name);
+      exit(EXIT_FAILURE);
+    }
+    done += n;
+  }
+  s->len = 0;
+}
+
+static void slice_create(struct slice *s) {
+  s->fd = open(s->name, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (s->fd == -1) {
+    perror(s->name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void slice_open(struct slice *s, const char *name) {
+  snprintf(s->name, sizeof s->name, "%s", name);
+  if (!s->keep) slice_create(s);
+  if (!s->buf) {
+    if (posix_memalign((void **)&s->buf, ALIGN, OUTSZ)) {
+      perror("posix_memalign");
+      exit(EXIT_FAILURE);
+    }
+    s->bufsize = OUTSZ;
+  }
+  s->size = 0;
+  s->len = 0;
+  s->active = TRUE;
+  xxh64_init(&s->hash);
+}
+
+static void slice_put(struct slice *s, const char *p, size_t n) {
+  s->size += n;
+  xxh64_update(&s->hash, p, n);
+  if (s->keep) {
+    if (s->len + n > s->bufsize) {
+      while (s->len + n > s->bufsize) s->bufsize *= 2;
+      s->buf = realloc(s->buf, s->bufsize);
+      if (!s->buf) {
+	perror("realloc");
+	exit(EXIT_FAILURE);
+      }
+    }
+    memcpy(s->buf + s->len, p, n);
+    s->len += n;
+    return;
+  }
+  while (n) {
+    size_t room = OUTSZ - s->len;
+    if (room > n) room = n;
+    memcpy(s->buf + s->len, p, room);
+    s->len += room;
+    p += room;
+    n -= room;
+    if (s->len == OUTSZ) slice_flush(s);
+  }
+}
+
+/*
+ * Compression
+ *
+ * With -z the slices are kept in memory (see struct slice) and a
+ * finished one is handed over, buffer and all, to a pool of threads
+ * that gzip it into <name>.gz.  Every slice is a file of its own, so
+ * the order they are done in does not matter; the manifest is still
+ * written by the main thread in dump order, with the hash and size
+ * of the uncompressed data.  At most ZQUEUE slices per thread wait
+ * for a compressor, after that the reader waits, which bounds memory
+ * to a few slices per thread.
+ */
+#define ZQUEUE	2
+
+struct zjob {
+  char name[MAXPATH];
+  char *buf;
+  size_t len;
+  struct zjob *next;
+};
+
+static pthread_t *zthreads;
+static pthread_mutex_t zlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t zroom = PTHREAD_COND_INITIALIZER;
+static struct zjob *zjobs = NULL, **ztail = &zjobs;
+static int zlevel = 0, zcount = 0, zqueued = 0, zquit = 0;
+
+static void gz_write(z_stream *z, struct zjob *job) {
+  uLong size = deflateBound(z, job->len);
+  unsigned char *out = malloc(size);
+  struct slice s = { .fd = -1 };
+  int ret;
+
+  if (!out) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  z->next_in = (unsigned char *)job->buf;
+  z->avail_in = job->len;
+  z->next_out = out;
+  z->avail_out = size;
+  ret = deflate(z, Z_FINISH);
+  if (ret != Z_STREAM_END) {
+    fprintf(stderr,"%s: deflate failed (%d)\n", job->name, ret);
+    exit(EXIT_FAILURE);
+  }
+  snprintf(s.name, sizeof s.name, "%s", job->name);
+  slice_create(&s);
+  s.buf = (char *)out;
+  s.len = size - z->avail_out;
+  slice_flush(&s);
+  if (close(s.fd) == -1) {
+    perror(s.name);
+    exit(EXIT_FAILURE);
+  }
+  deflateReset(z);
+  free(out);
+}
+
+static void *compressor(void *arg) {
+  struct zjob *job;
+  z_stream z;
+
+  memset(&z, 0, sizeof z);
+  if (deflateInit2(&z, zlevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    fputs("deflateInit2 failed\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+  for (;;) {
+    pthread_mutex_lock(&zlock);
+    while (!zjobs && !zquit) pthread_cond_wait(&zcond, &zlock);
+    job = zjobs;
+    if (job) {
+      zjobs = job->next;
+      if (!zjobs) ztail = &zjobs;
+      zqueued--;
+      pthread_cond_signal(&zroom);
+    }
+    pthread_mutex_unlock(&zlock);
+    if (!job) break;
+    gz_write(&z, job);
+    free(job->buf);
+    free(job);
+  }
+  deflateEnd(&z);
+  return NULL;
+}
+
+static void compress_start(int level, int threads) {
+  int i;
+
+  zlevel = level;
+  zcount = threads;
+  zthreads = calloc(threads, sizeof *zthreads);
+  if (!zthreads) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&zthreads[i], NULL, compressor, NULL)) {
+      fputs("pthread_create failed\n", stderr);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/* Takes over buf */
+static void compress_queue(const char *name, char *buf, size_t len) {
+  struct zjob *job = calloc(1, sizeof *job);
+
+  if (!job) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(job->name, sizeof job->name, "%s", name);
+  job->buf = buf;
+  job->len = len;
+  pthread_mutex_lock(&zlock);
+  while (zqueued >= zcount * ZQUEUE) pthread_cond_wait(&zroom, &zlock);
+  *ztail = job;
+  ztail = &job->next;
+  zqueued++;
+  pthread_cond_signal(&zcond);
+  pthread_mutex_unlock(&zlock);
+}
+
+static void compress_wait(void) {
+  int i;
+
+  if (!zcount) return;
+  pthread_mutex_lock(&zlock);
+  zquit = 1;
+  pthread_cond_broadcast(&zcond);
+  pthread_mutex_unlock(&zlock);
+  for (i = 0; i < zcount; i++) pthread_join(zthreads[i], NULL);
+  free(zthreads);
+  zcount = 0;
+}
+
+/* skip: (keep only) leave the file as it is */
+static void slice_close(struct slice *s, int skip) {
+  if (!s->active) return;
+  s->active = FALSE;
+  if (skip) return;
+  if (zcount) {
+    /* the next slice gets a buffer of its own */
+    compress_queue(s->name, s->buf, s->len);
+    s->buf = NULL;
+    return;
+  }
+  if (s->keep) slice_create(s);
+  slice_flush(s);
+  if (close(s->fd) == -1) {
+    perror(s->name);
+    exit(EXIT_FAILURE);
+  }
+  s->fd = -1;
+}
+
+/*
+ * Content defined chunking
+ *
+ * With -c the slice boundaries follow the content (FastCDC): a Gear
+ * rolling hash runs over the data and a slice may end where its top
+ * bits are all zero.  The mask is harder to hit before the average
+ * size and easier after it, which keeps the sizes close to average.
+ * Slices still only end at the end of a line, the line where the
+ * hash hits.  An inserted row then only changes the slice it lands
+ * in, later boundaries stay where they were.
+ */
+struct cdc {
+  off_t min, avg, max;
+  uint64_t mask_s, mask_l;
+  uint64_t hash;
+};
+
+static uint64_t gear[256];
+
+static uint64_t top_bits(int n) {
+  return n <= 0 ? 0 : n >= 64 ? ~(uint64_t)0 : ~(uint64_t)0 << (64 - n);
+}
+
+static void cdc_init(struct cdc *c, off_t min, off_t avg, off_t max) {
+  uint64_t x = 0x2545f4914f6cdd1dULL;
+  int i, bits = 0;
+
+  /* fixed table: the same input must always cut in the same places */
+  for (i = 0; i < 256; i++) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+  while (((off_t)1 << (bits + 1)) <= avg) bits++;
+  c->min = min;
+  c->avg = avg;
+  c->max = max;
+  c->mask_s = top_bits(bits + 2);
+  c->mask_l = top_bits(bits - 2);
+  c->hash = 0;
+}
+
+/* size is what the slice had before this line; TRUE to end it after */
+static int cdc_line(struct cdc *c, const char *line, size_t len, off_t size) {
+  const unsigned char *p = (const unsigned char *)line;
+  size_t i = 0;
+
+  if (size + (off_t)len >= c->max) return TRUE;
+  if (size + (off_t)len < c->min) return FALSE;
+  /* the hash only sees the last 64 bytes, skip what comes before */
+  if (size + 64 < c->min) i = c->min - 64 - size;
+  for (; i < len; i++) {
+    off_t pos = size + i;
+    c->hash = (c->hash << 1) + gear[p[i]];
+    if (pos >= c->min && !(c->hash & (pos < c->avg ? c->mask_s : c->mask_l))) return TRUE;
+  }
+  return FALSE;
+}
+
+/*
+ * bytes, with an optional k/m/g suffix; -1 for anything else.  A
+ * comma ends a size too, -c takes a list of them.
+ */
+static off_t parse_size(const char *s) {
+  char *end;
+  off_t n = strtoull(s, &end, 0);
+  if (end == s || *s == '-') return -1;
+  switch (*end) {
+  case 'g': case 'G': n *= 1024;
+    /* FALLTHROUGH */
+  case 'm': case 'M': n *= 1024;
+    /* FALLTHROUGH */
+  case 'k': case 'K': n *= 1024;
+    end++;
+  }
+  return *end && *end != ',' ? -1 : n;
+}
+
+/*
+ * Per table slices
+ *
+ * The dump is followed statement by statement: a comment block that
+ * says "for table `x`" (or view), or a CREATE TABLE, DROP TABLE,
+ * LOCK TABLES or INSERT naming `x` switches to table x.  Everything
+ * up to the next switch belongs to it, triggers included.  "-- Dump"
+ * and "-- Current Database" blocks go back to the global section,
+ * which is also where the dump starts.  The latter also says which
+ * database the tables after it are in: a --databases dump can have a
+ * `t` in each, and every one of them gets a series of its own.
+ *
+ * Table x of database d is written to <prefix>d.x.000.sql,
+ * d.x.001.sql, ... (x.000.sql if the dump never names a database);
+ * the global section to <prefix>000.sql, ...  The manifest names the
+ * table of every slice the same way, "-" for the global section.  The
+ * names are escaped (see manifest_escape()), so that two tables never
+ * share a file.
+ */
+struct table {
+  char name[NAMESZ];
+  char db[NAMESZ];
+  char key[MAXPATH];	/* escaped "db.name", for files and the manifest */
+  int counter;
+};
+
+struct slicer {
+  const char *fmt, *prefix;
+  off_t maxsize;
+  int verbose, chunking, per_table, rows;
+  struct cdc cdc;
+  struct cdc stmt;	/* -r: where extended inserts are split */
+  const char **tuples;	/* ends of the tuples of the current insert */
+  size_t ntuples, tuples_size;
+  char *sbuf;		/* statement being put together */
+  size_t sbuf_size;
+  struct slice out;
+  FILE *manifest;
+  struct manifest_entry *old;	/* last run, sorted by file */
+  size_t nold;
+  unsigned long long slices, skipped;
+  struct table *tables;	/* [0] is the global section */
+  int ntables, cur;
+  char db[NAMESZ];	/* the last "-- Current Database" */
+  char *hold;		/* comment block waiting for the next statement */
+  size_t hold_len, hold_size;
+};
+
+#define NO_TABLE	-1
+
+/* table name in the current database */
+static int table_find(struct slicer *s, const char *name) {
+  struct table *t;
+  size_t n;
+  int i;
+
+  for (i = 0; i < s->ntables; i++)
+    if (!strcmp(s->tables[i].name, name) && !strcmp(s->tables[i].db, s->db)) return i;
+  if (!(s->ntables & (s->ntables - 1))) {
+    s->tables = realloc(s->tables, (s->ntables ? s->ntables * 2 : 1) * sizeof *s->tables);
+    if (!s->tables) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  t = &s->tables[i];
+  snprintf(t->name, NAMESZ, "%s", name);
+  snprintf(t->db, NAMESZ, "%s", s->db);
+  n = 0;
+  if (*t->db) {
+    manifest_escape(t->key, sizeof t->key - 1, t->db);
+    n = strlen(t->key);
+    t->key[n++] = '.';
+  }
+  manifest_escape(t->key + n, sizeof t->key - n, t->name);
+  t->counter = 0;
+  return s->ntables++;
+}
+
+/* `name` at p into name[NAMESZ], with `` for a backquote; FALSE if there is none */
+static int quoted_name(char *name, const char *p, const char *end) {
+  size_t n = 0;
+
+  if (p >= end || *p++ != '`') return FALSE;
+  while (p < end) {
+    if (*p == '`') {
+      if (p + 1 >= end || p[1] != '`') break;
+      p++;
+    }
+    if (n < NAMESZ - 1) name[n++] = *p;
+    p++;
+  }
+  if (p >= end || !n) return FALSE;
+  name[n] = '\0';
+  return TRUE;
+}
+
+/* `name` at p; NO_TABLE if there is none */
+static int quoted_table(struct slicer *s, const char *p, const char *end) {
+  char name[NAMESZ];
+
+  return quoted_name(name, p, end) ? table_find(s, name) : NO_TABLE;
+}
+
+static const char *table_stmts[] = {
+  "INSERT INTO ", "LOCK TABLES ", "CREATE TABLE ", "DROP TABLE IF EXISTS ",
+  "CREATE TABLE IF NOT EXISTS ", "INSERT IGNORE INTO ", "REPLACE INTO ", NULL
+};
+
+static int stmt_table(struct slicer *s, const char *line, size_t len) {
+  const char **st;
+
+  if (!strchr("CDILR", line[0])) return NO_TABLE;
+  for (st = table_stmts; *st; st++) {
+    size_t n = strlen(*st);
+    if (len > n && !memcmp(line, *st, n)) return quoted_table(s, line + n, line + len);
+  }
+  return NO_TABLE;
+}
+
+static int comment_table(struct slicer *s, const char *line, size_t len) {
+  static const char *marks[] = { " for table ", " for view ", NULL };
+  static const char db[] = "-- Current Database: ";
+  const char **m, *p;
+
+  for (m = marks; *m; m++) {
+    p = memmem(line, len, *m, strlen(*m));
+    if (p) return quoted_table(s, p + strlen(*m), line + len);
+  }
+  if (len > sizeof db - 1 && !memcmp(line, db, sizeof db - 1)) {
+    if (!quoted_name(s->db, line + sizeof db - 1, line + len)) s->db[0] = '\0';
+    return 0;
+  }
+  if (len > 7 && !memcmp(line, "-- Dump", 7)) return 0;
+  return NO_TABLE;
+}
+
+static int by_file(const void *a, const void *b) {
+  return strcmp(((const struct manifest_entry *)a)->file, ((const struct manifest_entry *)b)->file);
+}
+
+/* Same file, hash and size in the last run, and the file is still there */
+static int unchanged(struct slicer *s, const struct manifest_entry *e) {
+  struct manifest_entry *old;
+  struct stat st;
+
+  if (!s->old) return FALSE;
+  old = bsearch(e, s->old, s->nold, sizeof *old, by_file);
+  if (!old) return FALSE;
+  old->seen = TRUE;
+  return old->hash == e->hash && old->bytes == e->bytes &&
+    stat(s->out.name, &st) == 0 && (zcount || (uint64_t)st.st_size == e->bytes);
+}
+
+static void slicer_close(struct slicer *s) {
+  struct manifest_entry e;
+  const char *file = strrchr(s->out.name, '/');
+  int skip;
+
+  if (!s->out.active) return;
+  e.hash = xxh64_digest(&s->out.hash);
+  e.bytes = s->out.size;
+  snprintf(e.table, sizeof e.table, "%s", s->per_table ? s->tables[s->cur].key : "");
+  snprintf(e.file, sizeof e.file, "%s", file ? file + 1 : s->out.name);
+  skip = unchanged(s, &e);
+  if (skip && s->verbose) fprintf(stderr,"dumpslicer: %s unchanged\n", s->out.name);
+  slice_close(&s->out, skip);
+  manifest_put(s->manifest, &e);
+  s->slices++;
+  s->skipped += skip;
+}
+
+/* Slices of the last run that this one did not make any more */
+static void slicer_prune(struct slicer *s) {
+  char path[MAXPATH];
+  const char *dir = strrchr(s->prefix, '/');
+  int dirlen = dir ? dir + 1 - s->prefix : 0;
+  size_t i;
+
+  for (i = 0; i < s->nold; i++) {
+    if (s->old[i].seen) continue;
+    if (snprintf(path, sizeof path, "%.*s%s", dirlen, s->prefix, s->old[i].file) >= (int)sizeof path) continue;
+    if (s->verbose) fprintf(stderr,"dumpslicer: removing %s\n", path);
+    if (unlink(path) == -1 && errno != ENOENT) perror(path);
+  }
+}
+
+static void slicer_open(struct slicer *s) {
+  struct table *t = &s->tables[s->cur];
+  char tprefix[MAXPATH], fname[MAXPATH];
+
+  /* the key is escaped, it makes a file name as it is */
+  if (snprintf(tprefix, sizeof tprefix, "%s%s%s", s->prefix, t->key, *t->key ? "." : "") >= (int)sizeof tprefix) {
+    fprintf(stderr,"dumpslicer: %s%s: name too long\n", s->prefix, t->key);
+    exit(EXIT_FAILURE);
+  }
+  snprintf(fname, sizeof fname, s->fmt, tprefix, t->counter++);
+  if (zcount) strncat(fname, ".gz", sizeof fname - strlen(fname) - 1);
+  if (s->verbose) fprintf(stderr,"dumpslicer: writing %s\n", fname);
+  slice_open(&s->out, fname);
+  s->cdc.hash = 0;
+}
+
+static void slicer_put(struct slicer *s, const char *line, size_t len) {
+  int cut;
+
+  if (!s->out.active) slicer_open(s);
+  cut = s->chunking ? cdc_line(&s->cdc, line, len, s->out.size) : FALSE;
+  slice_put(&s->out, line, len);
+  if (cut || (!s->chunking && s->out.size > s->maxsize)) slicer_close(s);
+}
+
+static void slicer_hold(struct slicer *s, const char *line, size_t len) {
+  if (s->hold_len + len > s->hold_size) {
+    s->hold_size = (s->hold_len + len) * 2;
+    s->hold = realloc(s->hold, s->hold_size);
+    if (!s->hold) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memcpy(s->hold + s->hold_len, line, len);
+  s->hold_len += len;
+}
+
+/*
+ * Extended inserts
+ *
+ * mysqldump puts many rows in one INSERT, often a megabyte of them on
+ * one line.  With -r such a statement is taken apart at the tuples
+ * and put out again as several INSERTs with the same head.  Where a
+ * statement ends is decided the way -c decides where a slice ends,
+ * on the content of the tuples, so a new row only changes the
+ * statement it is in.  Every statement is a line of its own, and
+ * slices can then end in what was one long line.
+ *
+ * The tuples are found by a scanner that knows about quoted strings
+ * and backslash escapes and looks for the interesting bytes sixteen at
+ * a time with SSE2 where it can.  Anything it does not understand is
+ * put out as it came.
+ */
+static const char *find4(const char *p, const char *end, char a, char b, char c, char d) {
+#ifdef __SSE2__
+  __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+  __m128i vc = _mm_set1_epi8(c), vd = _mm_set1_epi8(d);
+
+  for (; p + 16 <= end; p += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    int m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)),
+					   _mm_or_si128(_mm_cmpeq_epi8(x, vc), _mm_cmpeq_epi8(x, vd))));
+    if (m) return p + __builtin_ctz(m);
+  }
+#endif
+  for (; p < end; p++)
+    if (*p == a || *p == b || *p == c || *p == d) return p;
+  return end;
+}
+
+/* p is at the '(' of a tuple: just past its ')', NULL if there is none */
+static const char *tuple_end(const char *p, const char *end) {
+  int depth = 0;
+  char q;
+
+  while ((p = find4(p, end, '(', ')', '\'', '"')) < end) {
+    switch (*p++) {
+    case '(':
+      depth++;
+      break;
+    case ')':
+      if (--depth == 0) return p;
+      break;
+    default:
+      q = p[-1];
+      for (;;) {
+	p = find4(p, end, q, '\\', q, '\\');
+	if (p >= end) return NULL;
+	if (*p++ == '\\') {
+	  p++;
+	} else if (p < end && *p == q) {
+	  p++;			/* '' is a quote too */
+	} else {
+	  break;
+	}
+      }
+    }
+  }
+  return NULL;
+}
+
+static void tuple_add(struct slicer *s, const char *end) {
+  if (s->ntuples == s->tuples_size) {
+    s->tuples_size = s->tuples_size ? s->tuples_size * 2 : 1024;
+    s->tuples = realloc(s->tuples, s->tuples_size * sizeof *s->tuples);
+    if (!s->tuples) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  s->tuples[s->ntuples++] = end;
+}
+
+static void stmt_room(struct slicer *s, size_t n) {
+  if (n <= s->sbuf_size) return;
+  s->sbuf_size = n * 2;
+  s->sbuf = realloc(s->sbuf, s->sbuf_size);
+  if (!s->sbuf) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void slicer_insert(struct slicer *s, const char *line, size_t len) {
+  const char *end = line + len, *p, *values, *tail, *start;
+  size_t head, i, n = 0;
+
+  if (len < 32 || (memcmp(line, "INSERT ", 7) && memcmp(line, "REPLACE ", 8)) ||
+      !(values = memmem(line, len, " VALUES (", 9))) goto asis;
+  /* where the tuples are, and that the line is nothing else */
+  p = values + 8;
+  head = p - line;
+  s->ntuples = 0;
+  for (;;) {
+    p = tuple_end(p, end);
+    if (!p) goto asis;
+    tuple_add(s, p);
+    if (p < end && *p == ',' && p + 1 < end && p[1] == '(') {
+      p++;
+      continue;
+    }
+    break;
+  }
+  if (p >= end || *p != ';') goto asis;
+  tail = p;
+  while (++p < end && (*p == '\r' || *p == '\n'));
+  if (p != end || s->ntuples == 1) goto asis;
 
-const char version[] = "0.0";
+  /* head (tuple,)... tuple tail */
+  start = line + head;
+  for (i = 0; i < s->ntuples; i++) {
+    size_t tlen = s->tuples[i] - start;
+    int cut;
+
+    if (!n) {
+      s->stmt.hash = 0;
+      stmt_room(s, head + tlen + (end - tail));
+      memcpy(s->sbuf, line, head);
+      n = head;
+    } else {
+      stmt_room(s, n + 1 + tlen + (end - tail));
+      s->sbuf[n++] = ',';
+    }
+    cut = cdc_line(&s->stmt, start, tlen, n - head);
+    memcpy(s->sbuf + n, start, tlen);
+    n += tlen;
+    if (cut || i == s->ntuples - 1) {
+      memcpy(s->sbuf + n, tail, end - tail);
+      slicer_put(s, s->sbuf, n + (end - tail));
+      n = 0;
+    }
+    start = s->tuples[i] + 1;
+  }
+  return;
+asis:
+  slicer_put(s, line, len);
+}
+
+/*
+ * A statement, with the comment block before it if there was one.
+ * Comment blocks start a new slice (above the minimum, with -c), or
+ * the series of the table they are about.
+ */
+static void slicer_stmt(struct slicer *s, const char *line, size_t len) {
+  const char *p = s->hold, *end = s->hold + s->hold_len, *nl;
+  int t = NO_TABLE;
+
+  if (s->per_table) {
+    for (; p < end && t == NO_TABLE; p = nl + 1) {
+      nl = memchr(p, '\n', end - p);
+      if (!nl) nl = end - 1;
+      t = comment_table(s, p, nl + 1 - p);
+    }
+    if (t == NO_TABLE && line) t = stmt_table(s, line, len);
+  }
+  if (t != NO_TABLE && t != s->cur) {
+    slicer_close(s);
+    s->cur = t;
+  } else if (s->hold_len && (!s->chunking || s->out.size >= s->cdc.min)) {
+    slicer_close(s);
+  }
+  for (p = s->hold; p < end; p = nl + 1) {
+    nl = memchr(p, '\n', end - p);
+    if (!nl) nl = end - 1;
+    slicer_put(s, p, nl + 1 - p);
+  }
+  s->hold_len = 0;
+  if (!line) return;
+  if (s->rows) slicer_insert(s, line, len);
+  else slicer_put(s, line, len);
+}
 
 int main(int argc,char **argv) {
-  off_t maxsize = 4*1024*1024;
-  int counter = 0;
-  char *fmt = "%s%03d.sql", *prefix = "";
-  int opt, verbose = FALSE, in_hdr = FALSE;
-  FILE *fp = NULL;
-  char buffer[LINESZ], fname[MAXPATH];
-
-  while ((opt = getopt(argc,argv,"h?Vvf:p:s:m:k:")) != -1) {
+  struct slicer s = {
+    .maxsize = 4*1024*1024,
+    .out = { .fd = -1 },
+  };
+  char *fmt = "%s%03d.sql", *prefix = "", *incremental = NULL, manifest[MAXPATH], tmp[MAXPATH + 4];
+  int opt, level = 0, threads = sysconf(_SC_NPROCESSORS_ONLN);
+  off_t cmin = 0, cavg = 0, cmax = 0, ravg = 0;
+  struct input in;
+  char *line;
+  size_t len;
+
+  while ((opt = getopt(argc,argv,"h?Vvf:p:s:m:k:c:ti:z:j:r:")) != -1) {
     switch(opt) {
     case 'h':
     case '?':
-      fprintf(stderr,"Usage:\n\t%s [-h?] [-v] [-V] [-f fmt] [-s size] [-k kb] [-m mb] [prefix]\n",argv[0]);
+      fprintf(stderr,"Usage:\n\t%s [-h?] [-v] [-V] [-f fmt] [-s size] [-k kb] [-m mb] [-c avg[,min,max]] [-t] [-i manifest] [-z level] [-j threads] [-r avg] [prefix]\n",argv[0]);
       fputs("\t-h|-?:\tshow help\n", stderr);
       fputs("\t-v:\tverbose\n", stderr);
       fputs("\t-V:\tprint version info\n", stderr);
@@ -43,6 +896,14 @@ int main(int argc,char **argv) {
       fputs("\t-s bytes:\tLimit segments to this size in bytes\n",stderr);
       fputs("\t-k kb:\tLimit segments to this size in KB\n",stderr);
       fputs("\t-m mb:\tLimit segments to this size in MB\n",stderr);
+      fputs("\t-c avg[,min,max]:\tContent defined slices of about avg bytes (k/m suffixes)\n",stderr);
+      fputs("\t\t\tmin defaults to avg/4, max to avg*4\n",stderr);
+      fputs("\t-t:\tSlice every table on its own series\n",stderr);
+      fputs("\t-i manifest:\tDo not rewrite slices that are the same as in this manifest\n",stderr);
+      fputs("\t\t\t(the last run's), and remove the ones that are gone\n",stderr);
+      fputs("\t-z level:\tgzip slices (level 1-9) to <name>.gz\n",stderr);
+      fputs("\t-j threads:\tCompress with this many threads (default: one per CPU)\n",stderr);
+      fputs("\t-r avg:\tSplit extended inserts into statements of about avg bytes\n",stderr);
       exit(EXIT_SUCCESS);
       break;
     case 'V':
@@ -50,19 +911,63 @@ int main(int argc,char **argv) {
       exit(EXIT_SUCCESS);
       break;
     case 'v':
-      verbose = TRUE;
+      s.verbose = TRUE;
       break;
     case 'f':
       fmt = optarg;
       break;
     case 's':
-      maxsize = (off_t)(strtoull(optarg,NULL,0));
+      s.maxsize = (off_t)(strtoull(optarg,NULL,0));
       break;
     case 'm':
-      maxsize = (off_t)(strtoull(optarg,NULL,0) * 1024 * 1024);
+      s.maxsize = (off_t)(strtoull(optarg,NULL,0) * 1024 * 1024);
       break;
     case 'k':
-      maxsize = (off_t)(strtoull(optarg,NULL,0) * 1024);
+      s.maxsize = (off_t)(strtoull(optarg,NULL,0) * 1024);
+      break;
+    case 'c': {
+      char *min = strchr(optarg, ','), *max = min ? strchr(min + 1, ',') : NULL;
+      s.chunking = TRUE;
+      cavg = parse_size(optarg);
+      cmin = min ? parse_size(min + 1) : cavg / 4;
+      cmax = max ? parse_size(max + 1) : cavg * 4;
+      if (cavg < 0 || cmin < 0 || cmax < 0) {
+	fprintf(stderr,"%s: bad size in -c %s\n", argv[0], optarg);
+	exit(EXIT_FAILURE);
+      }
+      if (cavg < 256 || cmin > cavg || cmax < cavg) {
+	fprintf(stderr,"%s: -c needs min <= avg <= max, avg at least 256\n", argv[0]);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case 't':
+      s.per_table = TRUE;
+      break;
+    case 'i':
+      incremental = optarg;
+      break;
+    case 'z':
+      level = atoi(optarg);
+      if (level < 1 || level > 9) {
+	fprintf(stderr,"%s: -z takes a level from 1 to 9\n", argv[0]);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'r':
+      s.rows = TRUE;
+      ravg = parse_size(optarg);
+      if (ravg < 0) {
+	fprintf(stderr,"%s: bad size in -r %s\n", argv[0], optarg);
+	exit(EXIT_FAILURE);
+      }
+      if (ravg < 256) {
+	fprintf(stderr,"%s: -r needs at least 256 bytes\n", argv[0]);
+	exit(EXIT_FAILURE);
+      }
       break;
     default:
       fprintf(stderr,"Usage: %s [options] [prefix]\n", argv[0]);
@@ -70,36 +975,55 @@ int main(int argc,char **argv) {
     }
   }
   if (optind < argc) prefix = argv[optind];
-  if (verbose) {
-    fprintf(stderr,"%s: Prefix: %s, Fmt: %s, MaxSize: %llu\n", argv[0], prefix, fmt,(long long unsigned int) maxsize);
-  }
-  while ((fgets(buffer,sizeof buffer,stdin)) != NULL) {
-    if (buffer[0] == '-' && buffer[1] == '-' && buffer[2]) {
-      if (!in_hdr) {
-	if (fp) {
-	  fclose(fp);
-	  fp = NULL;
-	}
-	in_hdr = TRUE;
-      }
-    } else {
-      in_hdr = FALSE;
-    }
-    if (!fp) {
-      snprintf(fname, sizeof fname, fmt, prefix, counter++);
-      if (verbose) fprintf(stderr,"%s: writing %s\n", argv[0], fname);
-      fp = fopen(fname,"w");
-      if (fp == NULL) {
-	perror(fname);
-	exit(EXIT_FAILURE);
-      }
-    }
-    fputs(buffer,fp);
-    if (ftello(fp) > maxsize) {
-      fclose(fp);
-      fp = NULL;
+  s.fmt = fmt;
+  s.prefix = prefix;
+  if (s.verbose) {
+    fprintf(stderr,"%s: Prefix: %s, Fmt: %s, MaxSize: %llu\n", argv[0], prefix, fmt,(long long unsigned int) s.maxsize);
+    if (s.chunking)
+      fprintf(stderr,"%s: Chunks: min %llu avg %llu max %llu\n", argv[0],
+	      (long long unsigned int) cmin, (long long unsigned int) cavg, (long long unsigned int) cmax);
+  }
+  if (s.chunking) cdc_init(&s.cdc, cmin, cavg, cmax);
+  if (s.rows) cdc_init(&s.stmt, ravg / 4, ravg, ravg * 4);
+  table_find(&s, "");
+  if (incremental) {
+    s.old = manifest_load(incremental, &s.nold);
+    if (!s.old) {
+      perror(incremental);
+      exit(EXIT_FAILURE);
     }
+    qsort(s.old, s.nold, sizeof *s.old, by_file);
+    s.out.keep = TRUE;
+  }
+  if (level) {
+    if (threads < 1) threads = 1;
+    s.out.keep = TRUE;
+    compress_start(level, threads);
+  }
+  /* written aside and renamed at the end, -i may be reading the old one */
+  snprintf(manifest, sizeof manifest, "%smanifest", prefix);
+  snprintf(tmp, sizeof tmp, "%s.new", manifest);
+  s.manifest = fopen(tmp, "w");
+  if (!s.manifest) {
+    perror(tmp);
+    exit(EXIT_FAILURE);
+  }
+  fputs(MANIFEST_MAGIC MANIFEST_HDR, s.manifest);
+  input_open(&in, STDIN_FILENO);
+  while ((line = input_line(&in, &len)) != NULL) {
+    if (line[0] == '-' && len > 2 && line[1] == '-') slicer_hold(&s, line, len);
+    else slicer_stmt(&s, line, len);
+  }
+  if (s.hold_len) slicer_stmt(&s, NULL, 0);
+  slicer_close(&s);
+  compress_wait();
+  if (fclose(s.manifest) == EOF || rename(tmp, manifest) == -1) {
+    perror(manifest);
+    exit(EXIT_FAILURE);
   }
-  if (fp) fclose(fp);
+  if (s.old) slicer_prune(&s);
+  if (s.verbose && s.old)
+    fprintf(stderr,"%s: %llu slices, %llu unchanged\n", argv[0], s.slices, s.skipped);
+  input_close(&in);
   exit(EXIT_SUCCESS);
 }
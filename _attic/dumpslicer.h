@@ -0,0 +1,220 @@
+/*
+ * Shared by dumpslicer and the tools around it: the slice hash and
+ * the manifest.
+ *
+ * The manifest is a text file, one line per slice in dump order,
+ * tab separated:
+ *
+ *   # dumpslicer manifest 1
+ *   # xxh64	bytes	table	file
+ *   5f8e9c0d3a1b2c47	1190	-	000.sql
+ *   0b7d1e2f3c4a5968	4194390	t0	t0.000.sql
+ *
+ * table is "-" for slices that belong to no table (the global section
+ * with -t, every slice without), else "db.table", or just "table" in
+ * a dump that never says which database it is in; both names are
+ * escaped with manifest_escape().  file is relative to the directory
+ * the manifest is in.  Catting the files in order gives the dump.
+ *
+ * The hash is XXH64 with seed 0: fast enough to run as the data
+ * streams by, good enough to tell a changed slice from an unchanged
+ * one.  It is not meant to stand up to someone forging slices.
+ */
+#ifndef _DUMPSLICER_H
+#define _DUMPSLICER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#define MANIFEST_MAGIC	"# dumpslicer manifest 1\n"
+#define MANIFEST_HDR	"# xxh64\tbytes\ttable\tfile\n"
+#define MANIFEST_NAMESZ	1024
+
+/*
+ * XXH64, streaming
+ */
+#define XXH_P1	11400714785074694791ULL
+#define XXH_P2	14029467366897019727ULL
+#define XXH_P3	1609587929392839161ULL
+#define XXH_P4	9650029242287828579ULL
+#define XXH_P5	2870177450012600261ULL
+
+struct xxh64 {
+  uint64_t v[4];
+  uint64_t total;
+  unsigned char mem[32];
+  size_t memsize;
+};
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+  return x << r | x >> (64 - r);
+}
+static inline uint64_t xxh_get64(const unsigned char *p) {
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+    (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+static inline uint32_t xxh_get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in) {
+  return xxh_rotl(acc + in * XXH_P2, 31) * XXH_P1;
+}
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+  return (acc ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static inline void xxh64_init(struct xxh64 *x) {
+  memset(x, 0, sizeof *x);
+  x->v[0] = XXH_P1 + XXH_P2;
+  x->v[1] = XXH_P2;
+  x->v[2] = 0;
+  x->v[3] = -XXH_P1;
+}
+
+static inline void xxh64_stripe(struct xxh64 *x, const unsigned char *p) {
+  x->v[0] = xxh_round(x->v[0], xxh_get64(p));
+  x->v[1] = xxh_round(x->v[1], xxh_get64(p + 8));
+  x->v[2] = xxh_round(x->v[2], xxh_get64(p + 16));
+  x->v[3] = xxh_round(x->v[3], xxh_get64(p + 24));
+}
+
+static inline void xxh64_update(struct xxh64 *x, const void *data, size_t len) {
+  const unsigned char *p = data, *end = p + len;
+
+  x->total += len;
+  if (x->memsize + len < 32) {
+    memcpy(x->mem + x->memsize, p, len);
+    x->memsize += len;
+    return;
+  }
+  if (x->memsize) {
+    memcpy(x->mem + x->memsize, p, 32 - x->memsize);
+    p += 32 - x->memsize;
+    xxh64_stripe(x, x->mem);
+    x->memsize = 0;
+  }
+  for (; p + 32 <= end; p += 32) xxh64_stripe(x, p);
+  memcpy(x->mem, p, end - p);
+  x->memsize = end - p;
+}
+
+static inline uint64_t xxh64_digest(const struct xxh64 *x) {
+  const unsigned char *p = x->mem, *end = p + x->memsize;
+  uint64_t h;
+
+  if (x->total >= 32) {
+    h = xxh_rotl(x->v[0], 1) + xxh_rotl(x->v[1], 7) + xxh_rotl(x->v[2], 12) + xxh_rotl(x->v[3], 18);
+    h = xxh_merge(h, x->v[0]);
+    h = xxh_merge(h, x->v[1]);
+    h = xxh_merge(h, x->v[2]);
+    h = xxh_merge(h, x->v[3]);
+  } else {
+    h = x->v[2] + XXH_P5;
+  }
+  h += x->total;
+  for (; p + 8 <= end; p += 8) h = xxh_rotl(h ^ xxh_round(0, xxh_get64(p)), 27) * XXH_P1 + XXH_P4;
+  if (p + 4 <= end) {
+    h = xxh_rotl(h ^ (uint64_t)xxh_get32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++) h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+/*
+ * Manifest
+ */
+struct manifest_entry {
+  uint64_t hash;
+  uint64_t bytes;
+  char table[MANIFEST_NAMESZ];
+  char file[MANIFEST_NAMESZ];
+  int seen;		/* free for the caller */
+};
+
+static inline void manifest_put(FILE *fp, const struct manifest_entry *e) {
+  fprintf(fp, "%016llx\t%llu\t%s\t%s\n", (unsigned long long)e->hash,
+	  (unsigned long long)e->bytes, *e->table ? e->table : "-", e->file);
+}
+
+/*
+ * A database or table name the way it goes into the manifest and
+ * into file names: '%', '/', '.' and control characters (tabs and
+ * newlines among them) become %XX, and so does a name that is just
+ * "-".  Two names never come out the same, and "db.table" can still
+ * be taken apart at its '.'.
+ */
+static inline void manifest_escape(char *dst, size_t size, const char *src) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t n = 0;
+
+  for (; *src && n + 4 <= size; src++) {
+    unsigned char c = *src;
+
+    if (c == '%' || c == '/' || c == '.' || c < ' ' || c == 0x7f || (c == '-' && !n && !src[1])) {
+      dst[n++] = '%';
+      dst[n++] = hex[c >> 4];
+      dst[n++] = hex[c & 15];
+    } else {
+      dst[n++] = c;
+    }
+  }
+  if (size) dst[n] = '\0';
+}
+
+/* Entries in dump order, NULL with errno set if the file is no good */
+static inline struct manifest_entry *manifest_load(const char *path, size_t *count) {
+  struct manifest_entry *list = NULL, *e;
+  char line[3 * MANIFEST_NAMESZ];
+  size_t n = 0, size = 0;
+  FILE *fp = fopen(path, "r");
+
+  if (!fp) return NULL;
+  if (!fgets(line, sizeof line, fp) || strcmp(line, MANIFEST_MAGIC)) goto bad;
+  while (fgets(line, sizeof line, fp)) {
+    char *hash, *bytes, *table, *file, *end;
+
+    if (line[0] == '#') continue;
+    line[strcspn(line, "\n")] = '\0';
+    hash = strtok(line, "\t");
+    bytes = strtok(NULL, "\t");
+    table = strtok(NULL, "\t");
+    file = strtok(NULL, "");
+    if (!hash || !bytes || !table || !file) goto bad;
+    if (n == size) {
+      size = size ? size * 2 : 64;
+      e = realloc(list, size * sizeof *list);
+      if (!e) goto fail;
+      list = e;
+    }
+    e = &list[n];
+    e->hash = strtoull(hash, &end, 16);
+    if (*end) goto bad;
+    e->bytes = strtoull(bytes, &end, 10);
+    if (*end) goto bad;
+    snprintf(e->table, sizeof e->table, "%s", strcmp(table, "-") ? table : "");
+    snprintf(e->file, sizeof e->file, "%s", file);
+    e->seen = 0;
+    n++;
+  }
+  if (ferror(fp)) goto fail;
+  fclose(fp);
+  *count = n;
+  return list ? list : calloc(1, sizeof *list);
+bad:
+  errno = EINVAL;
+fail:
+  free(list);
+  fclose(fp);
+  return NULL;
+}
+
+#endif /* _DUMPSLICER_H */
@@ -1,13 +1,599 @@
 #define _GNU_SOURCE
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
 #include <sys/mount.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #define e(n,f) if (-1 == (f)) {perror(n);return(1);}
 #define SRC "/glibc"
+#define PIDFILE "/run/glibc.pid"
+
+/*
+ * The mount namespace is set up once and kept alive by a holder, a
+ * process that does nothing but sleep in it.  Later calls find the
+ * holder in PIDFILE and join its namespace with setns(), which costs
+ * about as much as an open(), instead of unshare() and two bind mounts
+ * each.  A holder that is gone, or left over from a glibc binary that
+ * has since been replaced, is replaced; if none can be started the
+ * namespace is made for this call only, like it always was.
+ *
+ * The holder's namespace is a copy of the one it was started from,
+ * so PIDFILE also says which one that was (the device and inode of
+ * /proc/self/ns/mnt there).  Callers in any other (a container, a
+ * service with PrivateTmp, ...) make their own rather than get
+ * someone else's view of the system.
+ */
+#define HOLDER_NONE 0	// not a holder, or not there
+#define HOLDER_OK 1
+#define HOLDER_OLD 2	// ours, but its program was replaced
+
+struct holder {
+  pid_t pid;
+  unsigned long long dev, ino;	// where its namespace was copied from
+};
+
+// the bind mounts, in a new namespace
+static int setup_ns(void) {
+  if (unshare(CLONE_NEWNS) == -1) {
+    perror("unshare");
+    return -1;
+  }
+  // mounts made outside later on show up here, ours do not leak out
+  mount(NULL, "/", NULL, MS_REC|MS_SLAVE, NULL);
+  if (mount(SRC "/usr", "/usr", NULL, MS_BIND, NULL) == -1 ||
+      mount(SRC "/var/db/xbps", "/var/db/xbps", NULL, MS_BIND, NULL) == -1) {
+    perror("mount");
+    return -1;
+  }
+  return 0;
+}
+
+// the mount namespace we are in
+static int own_ns(struct holder *h) {
+  struct stat st;
+
+  if (stat("/proc/self/ns/mnt", &st) == -1) return -1;
+  h->dev = st.st_dev;
+  h->ino = st.st_ino;
+  return 0;
+}
+
+// a root process running this same program, not whatever got the pid
+static int holder_ok(pid_t pid) {
+  static const char deleted[] = " (deleted)";
+  char path[64], exe[PATH_MAX], self[PATH_MAX];
+  struct stat st;
+  ssize_t n, m;
+
+  if (pid <= 0) return HOLDER_NONE;
+  snprintf(path, sizeof path, "/proc/%d", (int)pid);
+  if (stat(path, &st) == -1 || st.st_uid != 0) return HOLDER_NONE;
+  snprintf(path, sizeof path, "/proc/%d/exe", (int)pid);
+  n = readlink(path, exe, sizeof exe);
+  m = readlink("/proc/self/exe", self, sizeof self);
+  if (n <= 0 || m <= 0 || memcmp(exe, self, m)) return HOLDER_NONE;
+  if (n == m) return HOLDER_OK;
+  // the binary was upgraded under it
+  if (n == m + (ssize_t)sizeof deleted - 1 && !memcmp(exe + m, deleted, n - m))
+    return HOLDER_OLD;
+  return HOLDER_NONE;
+}
+
+/*
+ * A pidfd for pid, so that what was checked about it stays true: a
+ * pidfd keeps naming the same process even if the pid is reused.  -1
+ * on kernels before 5.3.
+ */
+static int pid_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+// pidfd's process is still alive, so the pid is still its own
+static int pid_alive(int pidfd, int sig) {
+#ifdef SYS_pidfd_send_signal
+  return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0) == 0;
+#else
+  (void)pidfd;
+  (void)sig;
+  return 0;
+#endif
+}
+
+static int join_ns(pid_t pid) {
+  char path[64], *cwd;
+  int pidfd, fd, ret;
+
+  pidfd = pid_open(pid);
+  if (holder_ok(pid) != HOLDER_OK) {
+    if (pidfd != -1) close(pidfd);
+    return -1;
+  }
+  snprintf(path, sizeof path, "/proc/%d/ns/mnt", (int)pid);
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  // the holder may have died and its pid gone to another process
+  // after the check: make sure the namespace is still the holder's
+  ret = fd != -1 && (pidfd != -1 ? pid_alive(pidfd, 0) : holder_ok(pid) == HOLDER_OK);
+  if (pidfd != -1) close(pidfd);
+  if (!ret) {
+    if (fd != -1) close(fd);
+    return -1;
+  }
+  // setns() leaves us in /, come back to where we were
+  cwd = get_current_dir_name();
+  ret = setns(fd, CLONE_NEWNS);
+  close(fd);
+  if (ret == 0 && cwd && chdir(cwd) == -1) perror(cwd);
+  free(cwd);
+  return ret;
+}
+
+// a holder of an older glibc keeps a namespace nobody joins any more
+static void retire(pid_t pid) {
+  int pidfd = pid_open(pid);
+
+  if (holder_ok(pid) == HOLDER_NONE) {
+    if (pidfd != -1) close(pidfd);
+    return;
+  }
+  if (pidfd != -1) {
+    pid_alive(pidfd, SIGKILL);
+    close(pidfd);
+  } else {
+    kill(pid, SIGKILL);
+  }
+}
+
+// "PID DEV INO", a pid of -1 if there is none
+static void read_holder(int fd, struct holder *h) {
+  char buf[96];
+  ssize_t n = pread(fd, buf, sizeof buf - 1, 0);
+  int pid;
+
+  h->pid = -1;
+  h->dev = h->ino = 0;
+  if (n <= 0) return;
+  buf[n] = '\0';
+  if (sscanf(buf, "%d %llu %llu", &pid, &h->dev, &h->ino) >= 1) h->pid = pid;
+}
+
+// the holder must not keep the caller's files (or PIDFILE's lock) open
+static void close_all(int keep) {
+  DIR *d = opendir("/proc/self/fd");
+  struct dirent *de;
+  int fd;
+
+  if (!d) return;
+  while ((de = readdir(d)) != NULL) {
+    fd = atoi(de->d_name);
+    if (fd > 2 && fd != keep && fd != dirfd(d)) close(fd);
+  }
+  closedir(d);
+}
+
+// fork twice so that the holder is nobody's child, -1 on failure
+static pid_t start_holder(void) {
+  int p[2], fd;
+  pid_t pid = -1, child;
+
+  if (pipe2(p, O_CLOEXEC) == -1) return -1;
+  switch (child = fork()) {
+  case -1:
+    close(p[0]);
+    close(p[1]);
+    return -1;
+  case 0:
+    close_all(p[1]);
+    if (fork() != 0) _exit(0);
+    if (setup_ns() == -1) _exit(1);
+    setsid();
+    // all root, so that only root can stop it
+    if (setregid(0, 0) == -1 || setreuid(0, 0) == -1 || chdir("/") == -1) _exit(1);
+    fd = open("/dev/null", O_RDWR);
+    if (fd != -1) {
+      dup2(fd, 0);
+      dup2(fd, 1);
+      dup2(fd, 2);
+      if (fd > 2) close(fd);
+    }
+    pid = getpid();
+    if (write(p[1], &pid, sizeof pid) != sizeof pid) _exit(1);
+    close(p[1]);
+    for (;;) pause();
+  }
+  close(p[1]);
+  waitpid(child, NULL, 0);
+  if (read(p[0], &pid, sizeof pid) != sizeof pid) pid = -1;
+  close(p[0]);
+  return pid;
+}
+
+// join the holder's namespace, starting a holder if needed
+static int use_holder(void) {
+  struct holder h, me;
+  char buf[96];
+  int fd, n, state, ret = -1;
+
+  if (own_ns(&me) == -1) return -1;
+  fd = open(PIDFILE, O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0644);
+  if (fd == -1) return -1;
+  read_holder(fd, &h);
+  if (h.dev == me.dev && h.ino == me.ino && join_ns(h.pid) == 0) {
+    close(fd);
+    return 0;
+  }
+  // one caller starts it, the others wait and join
+  flock(fd, LOCK_EX);
+  read_holder(fd, &h);
+  state = holder_ok(h.pid);
+  // one that does not say where it came from is from an older glibc
+  if (state == HOLDER_OK && !h.ino) state = HOLDER_OLD;
+  if (state == HOLDER_OK) {
+    // not ours to replace if it came from another namespace
+    if (h.dev == me.dev && h.ino == me.ino) ret = join_ns(h.pid);
+  } else {
+    if (state == HOLDER_OLD) retire(h.pid);
+    if ((me.pid = start_holder()) != -1) {
+      n = snprintf(buf, sizeof buf, "%d %llu %llu\n", (int)me.pid, me.dev, me.ino);
+      if (ftruncate(fd, 0) == -1 || pwrite(fd, buf, n, 0) != n) perror(PIDFILE);
+      ret = join_ns(me.pid);
+    }
+  }
+  close(fd);
+  return ret;
+}
+
+/*
+ * Server mode: "glibc --server SOCKET" gets into the environment once
+ * and then runs commands in it for callers that find it in
+ * GLIBC_SOCKET, so that a compiler wrapper run a thousand times does
+ * not set up (or join) the namespace a thousand times.  The client
+ * sends its argv, environment, cwd, umask and stdio over the socket
+ * and waits; signals it gets are passed on to the command, whose wait
+ * status comes back.  The server runs as the user who started it and
+ * only takes that user's commands, so it needs no root once it is up.
+ * The command has no controlling terminal: it can read and write the
+ * client's tty, but ^Z and /dev/tty do not work, so a shell started
+ * without a command on a tty does not go through the server.
+ */
+#define ZMAGIC 0x676c6962	// "glib"
+#define ZMAXREQ (4 << 20)
+
+struct zreq {
+  uint32_t magic;
+  uint32_t umask;
+  uint32_t argc, envc;	// strings after cwd
+  uint32_t len;		// cwd, argv and environment, each with its '\0'
+};
+
+// what a client passes on to its command
+static const int zsigs[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2, SIGWINCH };
+#define NZSIGS (int)(sizeof zsigs / sizeof zsigs[0])
+
+static int send_all(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  ssize_t r;
+
+  while (n) {
+    r = send(fd, p, n, MSG_NOSIGNAL);
+    if (r == -1 && errno == EINTR) continue;
+    if (r <= 0) return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t n) {
+  char *p = buf;
+  ssize_t r;
+
+  while (n) {
+    r = recv(fd, p, n, 0);
+    if (r == -1 && errno == EINTR) continue;
+    if (r <= 0) return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+static int zaddr(struct sockaddr_un *sa, const char *path) {
+  memset(sa, 0, sizeof *sa);
+  sa->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof sa->sun_path) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(sa->sun_path, path);
+  return 0;
+}
+
+// runs in a child of the server, one per client
+static void zsession(int c) {
+  struct zreq rq;
+  struct iovec iov = { &rq, sizeof rq };
+  union { char buf[CMSG_SPACE(3 * sizeof(int))]; struct cmsghdr align; } cbuf;
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cbuf.buf, .msg_controllen = sizeof cbuf.buf };
+  struct cmsghdr *cm;
+  struct signalfd_siginfo si;
+  struct pollfd pf[2];
+  sigset_t set, old;
+  int fds[3] = { -1, -1, -1 }, sfd, st, i;
+  int32_t sig;
+  char *buf, *p, *end, *cwd, **argv, **envp;
+  pid_t pid;
+  static char in_glibc[] = "IN_GLIBC=1";
+
+  signal(SIGCHLD, SIG_DFL);
+  if (recvmsg(c, &msg, MSG_WAITALL|MSG_CMSG_CLOEXEC) != sizeof rq) _exit(1);
+  for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+	cm->cmsg_len == CMSG_LEN(sizeof fds))
+      memcpy(fds, CMSG_DATA(cm), sizeof fds);
+  if (rq.magic != ZMAGIC || fds[2] == -1 || rq.len > ZMAXREQ ||
+      rq.argc == 0 || rq.argc > rq.len || rq.envc > rq.len) _exit(1);
+
+  // cwd, then argv, then the environment, every string ends in '\0'
+  buf = malloc(rq.len + 1);
+  argv = calloc(rq.argc + 1, sizeof *argv);
+  envp = calloc(rq.envc + 1, sizeof *envp);
+  if (!buf || !argv || !envp || recv_all(c, buf, rq.len) == -1) _exit(1);
+  buf[rq.len] = '\0';
+  end = buf + rq.len;
+  cwd = p = buf;
+  p += strlen(p) + 1;
+  for (i = 0; i < (int)rq.argc && p < end; i++, p += strlen(p) + 1) argv[i] = p;
+  if (i != (int)rq.argc) _exit(1);
+  for (i = 0; i < (int)rq.envc && p < end; i++, p += strlen(p) + 1) envp[i] = p;
+  if (i != (int)rq.envc || p != end) _exit(1);
+
+  // SIGCHLD comes in through sfd, next to the client's signals
+  sigemptyset(&set);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, &old);
+  sfd = signalfd(-1, &set, SFD_CLOEXEC);
+  if (sfd == -1) _exit(1);
+
+  // this process is the client's now, execvp() looks in its PATH
+  environ = envp;
+  putenv(in_glibc);
+  // the child only makes system calls until it execs, vfork() will do
+  switch (pid = vfork()) {
+  case -1:
+    perror("vfork");
+    _exit(1);
+  case 0:
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    /*
+     * A session of its own, so that a ^C on the client reaches all of
+     * it.  Only a group would be a background one on the server's
+     * terminal, and the command would stop on the first read of the
+     * client's tty.  The tty is not its controlling terminal this way.
+     */
+    setsid();
+    for (i = 0; i < 3; i++) dup2(fds[i], i);
+    umask(rq.umask);
+    if (chdir(cwd) == -1) {
+      perror(cwd);
+      _exit(127);
+    }
+    execvp(argv[0], argv);
+    i = errno;
+    perror(argv[0]);
+    _exit(i == ENOENT ? 127 : 126);
+  }
+  for (i = 0; i < 3; i++) close(fds[i]);
+
+  pf[0].fd = c;
+  pf[0].events = POLLIN;
+  pf[1].fd = sfd;
+  pf[1].events = POLLIN;
+  while (waitpid(pid, &st, WNOHANG) != pid) {
+    if (poll(pf, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      waitpid(pid, &st, 0);
+      break;
+    }
+    if (pf[1].revents && read(sfd, &si, sizeof si) == -1) continue;
+    if (!pf[0].revents) continue;
+    if (recv_all(c, &sig, sizeof sig) == -1) {
+      // the client is gone, and with it whoever wanted the command
+      kill(-pid, SIGHUP);
+      pf[0].fd = -1;
+      continue;
+    }
+    for (i = 0; i < NZSIGS; i++) {
+      if (zsigs[i] == sig) kill(-pid, sig);
+    }
+  }
+  sig = st;
+  send_all(c, &sig, sizeof sig);
+  _exit(0);
+}
+
+// a socket nobody listens on is left over from an earlier server;
+// anything else there (a connect() to a plain file is refused too)
+// is not ours to remove
+static int zstale(const struct sockaddr_un *sa) {
+  struct stat st;
+  int fd, ret = -1;
+
+  if (lstat(sa->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode)) {
+    errno = EADDRINUSE;
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+  if (connect(fd, (void *)sa, sizeof *sa) == -1 && errno == ECONNREFUSED)
+    ret = unlink(sa->sun_path);
+  close(fd);
+  if (ret == -1) errno = EADDRINUSE;
+  return ret;
+}
+
+static int zserver(const char *path) {
+  struct sockaddr_un sa;
+  struct ucred cr;
+  socklen_t len;
+  mode_t mask;
+  int fd, c, ret;
+
+  if (zaddr(&sa, path) == -1) {
+    perror(path);
+    return 1;
+  }
+  e("socket", fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0));
+  // only the user gets to connect
+  mask = umask(077);
+  ret = bind(fd, (void *)&sa, sizeof sa);
+  if (ret == -1 && errno == EADDRINUSE && zstale(&sa) == 0)
+    ret = bind(fd, (void *)&sa, sizeof sa);
+  umask(mask);
+  if (ret == -1 || listen(fd, SOMAXCONN) == -1) {
+    perror(path);
+    return 1;
+  }
+  // the sessions are nobody's business once they are done
+  signal(SIGCHLD, SIG_IGN);
+  for (;;) {
+    c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (c == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      return 1;
+    }
+    len = sizeof cr;
+    if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cr, &len) == 0 && cr.uid == getuid()) {
+      switch (fork()) {
+      case -1:
+	perror("fork");
+	break;
+      case 0:
+	close(fd);
+	zsession(c);
+      }
+    }
+    close(c);
+  }
+}
+
+// run argv in the server behind path, -1 if there is none to talk to
+static int zclient(const char *path, char * const *argv) {
+  struct sockaddr_un sa;
+  struct zreq rq = { ZMAGIC, 0, 0, 0, 0 };
+  struct iovec iov = { &rq, sizeof rq };
+  union { char buf[CMSG_SPACE(3 * sizeof(int))]; struct cmsghdr align; } cbuf;
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = cbuf.buf, .msg_controllen = sizeof cbuf.buf };
+  struct cmsghdr *cm;
+  struct signalfd_siginfo si;
+  struct pollfd pf[2];
+  static const int fds[3] = { 0, 1, 2 };
+  sigset_t set;
+  char *cwd, *buf, *p, * const *s;
+  size_t n;
+  int fd, sfd, ret, i;
+  int32_t sig, st;
+
+  if (zaddr(&sa, path) == -1 || !(cwd = get_current_dir_name())) return -1;
+  n = strlen(cwd) + 1;
+  for (s = argv; *s; s++, rq.argc++) n += strlen(*s) + 1;
+  for (s = environ; *s; s++, rq.envc++) n += strlen(*s) + 1;
+  if (n > ZMAXREQ || !(buf = malloc(n))) {
+    free(cwd);
+    return -1;
+  }
+  p = stpcpy(buf, cwd) + 1;
+  free(cwd);
+  for (s = argv; *s; s++) p = stpcpy(p, *s) + 1;
+  for (s = environ; *s; s++) p = stpcpy(p, *s) + 1;
+  rq.len = n;
+  rq.umask = umask(0);
+  umask(rq.umask);
+
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof fds);
+  memcpy(CMSG_DATA(cm), fds, sizeof fds);
+
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    free(buf);
+    return -1;
+  }
+  // connect as the user: it is their socket, and the server checks
+  ret = seteuid(getuid());
+  if (ret == 0) ret = connect(fd, (void *)&sa, sizeof sa);
+  if (ret == 0 && sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof rq) ret = -1;
+  if (ret == 0) ret = send_all(fd, buf, n);
+  free(buf);
+  if (ret == -1) {
+    // back to the way it was, the caller goes on without us
+    if (seteuid(0) == -1) perror("seteuid");
+    close(fd);
+    return -1;
+  }
+  // the command is the server's now, nothing here needs root
+  e("setuid",setreuid(getuid(),getuid()));
+  e("setgid",setregid(getgid(),getgid()));
+
+  sigemptyset(&set);
+  for (i = 0; i < NZSIGS; i++) sigaddset(&set, zsigs[i]);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+  sfd = signalfd(-1, &set, SFD_CLOEXEC);
+  pf[0].fd = fd;
+  pf[0].events = POLLIN;
+  pf[1].fd = sfd;
+  pf[1].events = POLLIN;
+  for (;;) {
+    if (poll(pf, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      return 1;
+    }
+    if (pf[1].revents && read(sfd, &si, sizeof si) == sizeof si) {
+      sig = si.ssi_signo;
+      send_all(fd, &sig, sizeof sig);
+    }
+    if (pf[0].revents) break;
+  }
+  if (recv_all(fd, &st, sizeof st) == -1) {
+    fprintf(stderr,"%s: no answer from the server\n", path);
+    return 1;
+  }
+  if (WIFSIGNALED(st)) {
+    // die the same way, like a shell would have it
+    signal(WTERMSIG(st), SIG_DFL);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    raise(WTERMSIG(st));
+    return 128 + WTERMSIG(st);
+  }
+  return WIFEXITED(st) ? WEXITSTATUS(st) : 1;
+}
 
 int main(int argc,  char  * const *argv) {
 
@@ -18,13 +604,27 @@ int main(int argc,  char  * const *argv) {
 
   const char IN_GLIBC_ENV[] = "IN_GLIBC";
   char *env_value = getenv(IN_GLIBC_ENV);
+  char *server = NULL, *sock = getenv("GLIBC_SOCKET");
+  int ret;
+
+  if (argv[1] && !strcmp(argv[1], "--server")) {
+    server = argv[2];
+    if (!server) {
+      fprintf(stderr,"usage: %s --server SOCKET\n", argv[0]);
+      return(2);
+    }
+  } else if (!env_value && sock && *sock && (argv[1] || !isatty(0))) {
+    // a server already in the environment does it all for us
+    static const char *shell[] = { "/bin/sh", NULL };
+    ret = zclient(sock, argv[1] ? argv + 1 : (void *)shell);
+    if (ret != -1) return ret;
+  }
+
   if (!env_value) {
     static char IN_GLIBC_TRUE[] = "IN_GLIBC=1";
     putenv(IN_GLIBC_TRUE);
     // move glibc stuff in place
-    e("unshare",unshare(CLONE_NEWNS));
-    e("mount",mount(SRC "/usr", "/usr", NULL, MS_BIND, NULL));
-    e("mount",mount(SRC "/var/db/xbps", "/var/db/xbps", NULL, MS_BIND, NULL));
+    if (use_holder() == -1 && setup_ns() == -1) return(1);
 
     // drop the rights suid gave us
     e("setuid",setreuid(getuid(),getuid()));
@@ -32,6 +632,7 @@ int main(int argc,  char  * const *argv) {
   } else {
     fprintf(stderr,"%s: already in \"glibc\" environment\n", argv[0]);
   }
+  if (server) return zserver(server);
   argv++;
   if (!argv[0]) {
     static const char *shell[] = { "/bin/sh", NULL };
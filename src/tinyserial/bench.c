@@ -0,0 +1,225 @@
+/*
+ * com-bench: throughput and correctness benchmark for com
+ *
+ * Part of the swlib tinyserial fork, see com.c for the license.
+ *
+ * Build: make com-bench, run: make bench
+ *
+ * No serial hardware needed: com gets a pty as its port and another
+ * one as its terminal, and the benchmark sits on the master side of
+ * both.  A pseudo random stream is pushed through com in each
+ * direction, at full speed or at a fixed rate, and checked byte by
+ * byte on the way out.
+ *
+ * Reports per direction the throughput, whether the stream arrived
+ * byte-exact (and where it first went wrong if not) and how many
+ * bytes never arrived, then com's CPU time per MB moved.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define CHUNK		4096
+#define QUIET_MS	1000	/* nothing arriving for this long ends a run */
+#define EXIT_KEY	1	/* com's default exit key, never generated */
+#define EXIT_WAIT	5	/* seconds com gets to exit after the key */
+
+struct stream {
+	uint32_t x;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift32, skipping the exit key so the keyboard side can use it */
+static void gen(struct stream *s, unsigned char *buf, int len) {
+	int i;
+	for(i = 0; i < len; i++) {
+		do {
+			s->x ^= s->x << 13;
+			s->x ^= s->x >> 17;
+			s->x ^= s->x << 5;
+		} while((s->x & 0xff) == EXIT_KEY);
+		buf[i] = s->x;
+	}
+}
+
+static int open_pty(char *name, size_t size) {
+	struct termios tio;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if(fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1) {
+		perror("posix_openpt");
+		exit(1);
+	}
+	snprintf(name, size, "%s", ptsname(fd));
+	/* raw until com sets it up itself */
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(fd, TCSANOW, &tio);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+static void drain(int fd, int ms) {
+	unsigned char buf[CHUNK];
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	while(poll(&pfd, 1, ms) > 0 && read(fd, buf, sizeof buf) > 0);
+}
+
+/*
+ * Push size bytes into src, read them back from dst.  rate is in
+ * bytes per second, 0 for as fast as com takes them.
+ */
+static void run(const char *what, int src, int dst, long long size, long long rate, uint32_t seed) {
+	struct stream in = { seed }, out = { seed };
+	unsigned char wbuf[CHUNK], rbuf[CHUNK], expect[CHUNK];
+	long long sent = 0, got = 0, bad_at = -1;
+	int wlen = 0, woff = 0;
+	double start = now(), last = start, busy = start, t;
+
+	while(got < sent || sent < size) {
+		struct pollfd pfd[2] = { { dst, POLLIN, 0 }, { src, 0, 0 } };
+		int timeout = QUIET_MS;
+
+		if(sent < size) {
+			double due = rate ? start + (double)sent / rate : 0;
+			t = now();
+			if(t >= due) pfd[1].events = POLLOUT;
+			else timeout = (int)((due - t) * 1000) + 1;
+		}
+		if(poll(pfd, 2, timeout) == 0 && now() - busy > QUIET_MS / 1000.0) break;
+
+		if(pfd[1].revents & POLLOUT) {
+			int n;
+			if(woff == wlen) {
+				wlen = size - sent < CHUNK ? size - sent : CHUNK;
+				if(rate && wlen > rate / 100 + 1) wlen = rate / 100 + 1;
+				gen(&in, wbuf, wlen);
+				woff = 0;
+			}
+			n = write(src, wbuf + woff, wlen - woff);
+			if(n > 0) {
+				woff += n;
+				sent += n;
+				busy = now();
+			}
+		}
+		if(pfd[0].revents & POLLIN) {
+			int n = read(dst, rbuf, sizeof rbuf);
+			if(n > 0) {
+				if(bad_at == -1) {
+					gen(&out, expect, n);
+					if(memcmp(rbuf, expect, n)) {
+						int i;
+						for(i = 0; rbuf[i] == expect[i]; i++);
+						bad_at = got + i;
+					}
+				}
+				got += n;
+				last = busy = now();
+			}
+		}
+	}
+	t = last - start;
+	printf("%-10s %8.2f MB in %6.2f s, %8.2f MB/s, ", what, got / 1048576.0, t,
+	       t > 0 ? got / 1048576.0 / t : 0.0);
+	if(bad_at == -1 && got == sent) printf("byte-exact");
+	else if(bad_at == -1) printf("exact so far");
+	else printf("CORRUPT at byte %lld", bad_at);
+	if(got > sent) printf(", %lld bytes too many\n", got - sent);
+	else printf(", %lld dropped\n", sent - got);
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-s MB] [-r KB/s] [-- com options] com\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	char port[64], term[64], key = EXIT_KEY;
+	long long size = 64LL << 20, rate = 0;
+	int portfd, termfd, opt, status;
+	struct rusage ru;
+	pid_t pid, done;
+	double cpu, deadline;
+
+	while((opt = getopt(argc, argv, "s:r:")) != -1) {
+		switch(opt) {
+		case 's': size = atof(optarg) * 1048576; break;
+		case 'r': rate = atof(optarg) * 1024; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind >= argc) usage(argv[0]);
+
+	portfd = open_pty(port, sizeof port);
+	termfd = open_pty(term, sizeof term);
+	signal(SIGPIPE, SIG_IGN);
+
+	pid = fork();
+	if(pid == 0) {
+		char **args = calloc(argc - optind + 5, sizeof *args);
+		int fd, i, n = 0;
+
+		setsid();
+		fd = open(term, O_RDWR);
+		if(fd == -1) _exit(127);
+		dup2(fd, 0);
+		dup2(fd, 1);
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 2);
+		/* only the exit key, the data may contain anything else */
+		args[n++] = argv[argc - 1];
+		for(i = optind; i < argc - 1; i++) args[n++] = argv[i];
+		args[n++] = "-x-";
+		args[n++] = "-y-";
+		args[n++] = port;
+		execv(args[0], args);
+		_exit(127);
+	}
+	/* let com set up both ends, whatever it says first is not data */
+	usleep(300000);
+	drain(termfd, 100);
+	drain(portfd, 100);
+
+	printf("%.0f MB each way, %s\n", size / 1048576.0,
+	       rate ? "rate limited" : "unthrottled");
+	run("port->tty", portfd, termfd, size, rate, 0x12345678);
+	run("tty->port", termfd, portfd, size, rate, 0x87654321);
+
+	/*
+	 * Keep reading, com may still be busy writing to its terminal.
+	 * Once it has closed it, drain() returns at once on the hangup,
+	 * so the wait is timed rather than counted.
+	 */
+	if(write(termfd, &key, 1) != 1) kill(pid, SIGTERM);
+	deadline = now() + EXIT_WAIT;
+	while((done = wait4(pid, &status, WNOHANG, &ru)) == 0 && now() < deadline) {
+		drain(termfd, 100);
+		usleep(10000);
+	}
+	if(done == 0) {
+		fprintf(stderr, "com did not exit, killed\n");
+		kill(pid, SIGKILL);
+		wait4(pid, &status, 0, &ru);
+	}
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	printf("com cpu    %8.2f s, %.2f ms per MB\n", cpu, cpu * 1000 / (2 * size / 1048576.0));
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
@@ -0,0 +1,203 @@
+/*
+ * Capture received data to a file
+ *
+ * Part of the swlib tinyserial fork, see com.c for the license.
+ *
+ * The interactive loop must never wait for the disk, so received
+ * data goes into a single producer/single consumer ring and a writer
+ * thread drains it to the file in large batches.  If the disk falls
+ * so far behind that the ring fills up, data is dropped from the
+ * capture (never from the terminal) and the loss is reported.
+ *
+ * Each chunk in the ring carries the CLOCK_MONOTONIC time it was
+ * received, so the writer can optionally prefix every line with the
+ * time since the capture started.
+ *
+ * Every capture has its own ring and thread, so that the multi-port
+ * monitor can log each port to its own file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "com.h"
+
+#define RINGSZ		(1 << 20)	/* must be a power of 2 */
+#define OUTSZ		(256 * 1024)
+#define STAMPSZ		32		/* "[ssssss.uuuuuu] ", seconds can grow */
+#define IDLE_NS		20000000	/* writer poll interval when idle */
+
+struct chunk {
+	uint64_t ts;
+	uint32_t len;
+};
+
+struct capture {
+	struct {
+		unsigned char data[RINGSZ];
+		atomic_size_t head;	/* written by the main loop */
+		atomic_size_t tail;	/* written by the writer thread */
+	} ring;
+
+	int fd;
+	int stamps;
+	atomic_int done;
+	unsigned long long dropped;
+	uint64_t start;
+	pthread_t writer;
+	const char *path;
+
+	/* writer side */
+	char out[OUTSZ + BUFSIZ];
+	size_t olen;
+	int at_bol;
+};
+
+static uint64_t mono_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ring_in(struct capture *cap, size_t pos, const void *src, size_t len) {
+	size_t off = pos & (RINGSZ - 1);
+	size_t n = len < RINGSZ - off ? len : RINGSZ - off;
+	memcpy(cap->ring.data + off, src, n);
+	memcpy(cap->ring.data, (const char *)src + n, len - n);
+}
+
+static void ring_out(struct capture *cap, size_t pos, void *dst, size_t len) {
+	size_t off = pos & (RINGSZ - 1);
+	size_t n = len < RINGSZ - off ? len : RINGSZ - off;
+	memcpy(dst, cap->ring.data + off, n);
+	memcpy((char *)dst + n, cap->ring.data, len - n);
+}
+
+/* Called from the main loop, never blocks.  cap may be NULL. */
+void capture_put(struct capture *cap, const void *buf, size_t len) {
+	struct chunk c;
+	size_t head, tail;
+
+	if(!cap) return;
+	head = atomic_load_explicit(&cap->ring.head, memory_order_relaxed);
+	tail = atomic_load_explicit(&cap->ring.tail, memory_order_acquire);
+	if(RINGSZ - (head - tail) < sizeof c + len) {
+		cap->dropped += len;
+		return;
+	}
+	c.ts = mono_ns();
+	c.len = len;
+	ring_in(cap, head, &c, sizeof c);
+	ring_in(cap, head + sizeof c, buf, len);
+	atomic_store_explicit(&cap->ring.head, head + sizeof c + len, memory_order_release);
+}
+
+static void flush_out(struct capture *cap) {
+	if(cap->olen && write_all(cap->fd, cap->out, cap->olen) == -1) {
+		/* keep going, the terminal matters more than the log */
+	}
+	cap->olen = 0;
+}
+
+static void format(struct capture *cap, const unsigned char *p, size_t len, uint64_t ts) {
+	while(len) {
+		const unsigned char *nl;
+		size_t n;
+
+		if(cap->stamps && cap->at_bol) {
+			uint64_t t = ts - cap->start;
+			/* the data below must still have room after the stamp */
+			if(cap->olen + STAMPSZ > OUTSZ) flush_out(cap);
+			cap->olen += sprintf(cap->out + cap->olen, "[%6llu.%06llu] ",
+					(unsigned long long)(t / 1000000000),
+					(unsigned long long)(t % 1000000000 / 1000));
+			cap->at_bol = 0;
+		}
+		nl = cap->stamps ? memchr(p, '\n', len) : NULL;
+		n = nl ? (size_t)(nl - p) + 1 : len;
+		if(n > OUTSZ - cap->olen) n = OUTSZ - cap->olen;
+		memcpy(cap->out + cap->olen, p, n);
+		cap->olen += n;
+		if(nl && p + n == nl + 1) cap->at_bol = 1;
+		p += n;
+		len -= n;
+		if(cap->olen >= OUTSZ) flush_out(cap);
+	}
+}
+
+static void *capture_writer(void *arg) {
+	struct capture *cap = arg;
+	unsigned char buf[BUFSIZ];
+
+	for(;;) {
+		size_t tail = atomic_load_explicit(&cap->ring.tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&cap->ring.head, memory_order_acquire);
+
+		if(head == tail) {
+			struct timespec ts = { 0, IDLE_NS };
+			flush_out(cap);
+			if(atomic_load(&cap->done)) break;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		while(tail != head) {
+			struct chunk c;
+			size_t done;
+
+			ring_out(cap, tail, &c, sizeof c);
+			tail += sizeof c;
+			for(done = 0; done < c.len; ) {
+				size_t n = c.len - done < sizeof buf ? c.len - done : sizeof buf;
+				ring_out(cap, tail + done, buf, n);
+				format(cap, buf, n, c.ts);
+				done += n;
+			}
+			tail += c.len;
+		}
+		atomic_store_explicit(&cap->ring.tail, tail, memory_order_release);
+	}
+	return NULL;
+}
+
+struct capture *capture_open(const char *path, int stamps) {
+	struct capture *cap = calloc(1, sizeof *cap);
+
+	if(!cap) {
+		perror("capture");
+		return NULL;
+	}
+	cap->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(cap->fd == -1) {
+		perror(path);
+		free(cap);
+		return NULL;
+	}
+	cap->path = path;
+	cap->stamps = stamps;
+	cap->at_bol = 1;
+	cap->start = mono_ns();
+	if(pthread_create(&cap->writer, NULL, capture_writer, cap)) {
+		fprintf(stderr, "%s: can not start writer thread\n", path);
+		close(cap->fd);
+		free(cap);
+		return NULL;
+	}
+	return cap;
+}
+
+void capture_close(struct capture *cap) {
+	if(!cap) return;
+	atomic_store(&cap->done, 1);
+	pthread_join(cap->writer, NULL);
+	close(cap->fd);
+	if(cap->dropped) {
+		fprintf(stderr, "%s: %llu bytes dropped (disk too slow)\r\n", cap->path, cap->dropped);
+	}
+	free(cap);
+}
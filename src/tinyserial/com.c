@@ -2,7 +2,8 @@
  * Building: cc -o com com.c
  * Usage   : ./com /dev/device [speed]
  * Example : ./com /dev/ttyS0 [115200]
- * Keys    : Ctrl-A - exit, Ctrl-X - display control lines status
+ * Keys    : Ctrl-A - exit, Ctrl-X - display control lines status,
+ *           Ctrl-Y - XMODEM/YMODEM/ZMODEM file transfer
  * Darcs   : darcs get http://tinyserial.sf.net/
  * Homepage: http://tinyserial.sourceforge.net
  * Version : 2009-03-05
@@ -47,13 +48,39 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <poll.h>
 
-int transfer_byte(int from, int to, int is_control);
+#include "com.h"
+
+#define BUFSZ	4096
+
+/*
+ * Arbitrary baud rates need the Linux termios2 interface, which
+ * can not be included together with <termios.h>.
+ */
+#if defined(__linux__) && defined(TCGETS2)
+#define HAVE_TERMIOS2
+#ifndef BOTHER
+#define BOTHER	0010000
+#endif
+struct termios2 {
+	tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed, c_ospeed;
+};
+#endif
+
+int transfer(int from, int to, int is_control);
 
 typedef struct {char *name; int flag; } speed_spec;
 int akey = ('a' & 0x1f);	// Control + A
 int xkey = ('x' & 0x1f);	// Control + X
+int ykey = ('y' & 0x1f);	// Control + Y
+int skey = ('t' & 0x1f);	// Control + T, monitor port select
 #define UNDEFINED_KEY	256
+struct capture *capture;	// -l, written from transfer()
+int hexview;			// -X, received data shown as a hex dump
 
 char *printable(int ascii) {
   switch (ascii) {
@@ -96,33 +123,270 @@ void print_status(int fd) {
 	fprintf(stderr, "\r\n");
 }
 
+/*
+ * Set a rate that has no Bxxx constant.  The driver picks the
+ * closest divisor it can, report_speed() shows what it ended up with.
+ */
+int set_custom_speed(int fd, unsigned long rate) {
+#ifdef HAVE_TERMIOS2
+	struct termios2 tio;
+	if(ioctl(fd, TCGETS2, &tio) == -1) return -1;
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = tio.c_ospeed = rate;
+	return ioctl(fd, TCSETS2, &tio);
+#else
+	errno = EINVAL;
+	return -1;
+#endif
+}
+
+/* The rate the port really runs at, 0 if that can not be known */
+unsigned long port_speed(int fd) {
+#ifdef HAVE_TERMIOS2
+	struct termios2 tio;
+	if(ioctl(fd, TCGETS2, &tio) == 0) return tio.c_ospeed;
+#endif
+	return 0;
+}
+
+void report_speed(int fd) {
+	unsigned long rate = port_speed(fd);
+	if(rate) fprintf(stderr, "port speed %lu baud\r\n", rate);
+}
+
+speed_spec speeds[] =
+{
+	{"50", B50},
+	{"75", B75},
+	{"110", B110},
+	{"134", B134},
+	{"150", B150},
+	{"200", B200},
+	{"300", B300},
+	{"600", B600},
+	{"1200", B1200},
+	{"1800", B1800},
+	{"2400", B2400},
+	{"4800", B4800},
+	{"9600", B9600},
+	{"19200", B19200},
+	{"38400", B38400},
+	{"57600", B57600},
+	{"115200", B115200},
+#ifdef B230400
+	{"230400", B230400},
+#endif
+#ifdef B460800
+	{"460800", B460800},
+#endif
+#ifdef B500000
+	{"500000", B500000},
+#endif
+#ifdef B576000
+	{"576000", B576000},
+#endif
+#ifdef B921600
+	{"921600", B921600},
+#endif
+#ifdef B1000000
+	{"1000000", B1000000},
+#endif
+#ifdef B1152000
+	{"1152000", B1152000},
+#endif
+#ifdef B1500000
+	{"1500000", B1500000},
+#endif
+#ifdef B2000000
+	{"2000000", B2000000},
+#endif
+#ifdef B2500000
+	{"2500000", B2500000},
+#endif
+#ifdef B3000000
+	{"3000000", B3000000},
+#endif
+#ifdef B3500000
+	{"3500000", B3500000},
+#endif
+#ifdef B4000000
+	{"4000000", B4000000},
+#endif
+	{NULL, 0}
+};
+/*
+ * Look up a speed by name.  Rates without a Bxxx constant go in
+ * *custom and are set with set_custom_speed() where possible.
+ */
+int parse_speed(const char *name, int *speed, unsigned long *custom) {
+	speed_spec *s;
+	char *end;
+
+	*custom = 0;
+	for(s = speeds; s->name; s++) {
+		if(strcmp(s->name, name) == 0) {
+			*speed = s->flag;
+			fprintf(stderr, "setting speed %s\n", s->name);
+			return 0;
+		}
+	}
+	*custom = strtoul(name, &end, 10);
+	if(*end || !*custom) {
+		fprintf(stderr, "%s: invalid speed\n", name);
+		return -1;
+	}
+#ifndef HAVE_TERMIOS2
+	fprintf(stderr, "%s: unsupported speed\n", name);
+	return -1;
+#endif
+	fprintf(stderr, "setting custom speed %lu\n", *custom);
+	return 0;
+}
+
+/*
+ * Put a port in raw mode, saving the old settings in *oldtio.
+ * flow is 'n' (none), 'h' (RTS/CTS) or 's' (XON/XOFF).
+ */
+int setup_port(int fd, int speed, unsigned long custom_speed, int flow, struct termios *oldtio) {
+	struct termios newtio;
+
+	tcgetattr(fd,oldtio); // save current port settings
+	memset(&newtio, 0, sizeof newtio);
+	newtio.c_cflag = speed | CS8 | CLOCAL | CREAD;
+	newtio.c_iflag = IGNPAR;
+	newtio.c_oflag = 0;
+	newtio.c_lflag = 0;
+	newtio.c_cc[VMIN]=1;
+	newtio.c_cc[VTIME]=0;
+	if(flow == 'h') {
+		newtio.c_cflag |= CRTSCTS;
+	} else if(flow == 's') {
+		newtio.c_iflag |= IXON | IXOFF;
+		newtio.c_cc[VSTART] = 0x11;
+		newtio.c_cc[VSTOP] = 0x13;
+	}
+	tcflush(fd, TCIFLUSH);
+	tcsetattr(fd,TCSANOW,&newtio);
+	if(custom_speed && set_custom_speed(fd, custom_speed) == -1) {
+		perror("TCSETS2");
+		tcsetattr(fd,TCSANOW,oldtio);
+		return -1;
+	}
+	return 0;
+}
+
+/* Change the rate of a port that is already set up */
+int set_speed(int fd, unsigned long rate) {
+	struct termios tio;
+	speed_spec *s;
+
+	for(s = speeds; s->name; s++) {
+		if(strtoul(s->name, NULL, 10) == rate) {
+			if(tcgetattr(fd, &tio) == -1) return -1;
+			cfsetispeed(&tio, s->flag);
+			cfsetospeed(&tio, s->flag);
+			return tcsetattr(fd, TCSADRAIN, &tio);
+		}
+	}
+	return set_custom_speed(fd, rate);
+}
+
 int parse_key(char *inp, int defval) {
   if (inp[0] == 0) return defval;
   if (inp[0] == '-') return UNDEFINED_KEY;
   return atoi(inp);
 }
 
+int parse_proto(const char *inp) {
+  if (inp[0] && !inp[1] && strchr("xkygz", inp[0])) return inp[0];
+  return -1;
+}
+
+/*
+ * Read a line from the (raw) keyboard, echoing it as it is typed.
+ * Returns -1 if the user gives up with Escape or Control+C.
+ */
+int read_line(const char *prompt, char *line, int size) {
+	unsigned char c;
+	int len = 0;
+
+	fprintf(stderr, "%s", prompt);
+	while(read(STDIN_FILENO, &c, 1) == 1) {
+		if(c == '\r' || c == '\n') {
+			fprintf(stderr, "\r\n");
+			line[len] = 0;
+			return len;
+		} else if(c == 27 || c == 3) {
+			fprintf(stderr, " (cancelled)\r\n");
+			return -1;
+		} else if(c == 8 || c == 127) {
+			if(len) {
+				len--;
+				fprintf(stderr, "\b \b");
+			}
+		} else if(isprint(c) && len < size - 1) {
+			line[len++] = c;
+			fputc(c, stderr);
+		}
+	}
+	return -1;
+}
+
+/*
+ * Interactive file transfer, started with the transfer key:
+ *   s PROTO FILE...	send files
+ *   r PROTO [PATH]	receive to PATH (a file for XMODEM, a
+ *			directory for YMODEM and ZMODEM, default .)
+ */
+void xfer_menu(int comfd) {
+	char line[1024], *dir, *word, *files[64];
+	int nfiles = 0, proto, ret;
+
+	fprintf(stderr, "\r\n[TRANSFER] protocols: x XMODEM, k XMODEM-1K, y YMODEM, g YMODEM-g, z ZMODEM\r\n");
+	if(read_line("s PROTO FILE... | r PROTO [PATH]: ", line, sizeof line) <= 0) return;
+	dir = strtok(line, " \t");
+	word = strtok(NULL, " \t");
+	while(nfiles < 64 && (files[nfiles] = strtok(NULL, " \t"))) nfiles++;
+	if(!word || (proto = parse_proto(word)) == -1 || strlen(dir) != 1) {
+		fprintf(stderr, "[TRANSFER] bad command\r\n");
+		return;
+	}
+	if(dir[0] == 's' && nfiles) {
+		ret = xfer_send(comfd, proto, files, nfiles);
+	} else if(dir[0] == 'r' && (nfiles || (proto != XFER_XMODEM && proto != XFER_XMODEM_1K))) {
+		ret = xfer_recv(comfd, proto, nfiles ? files[0] : ".");
+	} else {
+		fprintf(stderr, "[TRANSFER] bad command\r\n");
+		return;
+	}
+	fprintf(stderr, "[TRANSFER] %s\r\n", ret ? "failed" : "done");
+}
+
 int main(int argc, char *argv[])
 {
 	int comfd;
-	struct termios oldtio, newtio;       //place for old and new port settings for serial port
+	struct termios oldtio;               //place for old port settings for serial port
 	struct termios oldkey, newkey;       //place tor old and new port settings for keyboard teletype
 	char *devicename;
 	int need_exit = 0;
-	speed_spec speeds[] =
-	{
-		{"1200", B1200},
-		{"2400", B2400},
-		{"4800", B4800},
-		{"9600", B9600},
-		{"19200", B19200},
-		{"38400", B38400},
-		{"57600", B57600},
-		{"115200", B115200},
-		{NULL, 0}
-	};
+	speed_spec *s;
 	char *argv0;
 	int speed = B115200;	// Default speed
+	unsigned long custom_speed = 0;
+	char *capture_path = NULL;
+	int capture_stamps = 0;
+	int xfer_mode = 0, xfer_proto = 0;
+	char *speedname, **xfer_files;
+	int xfer_nfiles;
+	int flow = 'n';
+	char *send_path = NULL;
+	int pace_ms = 0, pace_bytes = 64;
+	int monitor_mode = 0;
+	char *listen_spec = NULL;
+	int telnet = 0;
+	int hex_gap = 10;
+	int lowlat = 0, ping_count = 0, ping_size = 1, ping_ms = 0;
 
 	argv0 = argv[0];
 	while (argc > 1) {
@@ -130,6 +394,50 @@ int main(int argc, char *argv[])
 	    akey = parse_key(argv[1]+2, 'a' & 0x1f);
 	  } else if (argv[1][0] == '-' && argv[1][1] == 'x') {
 	    xkey = parse_key(argv[1]+2, 'x' & 0x1f);
+	  } else if (argv[1][0] == '-' && argv[1][1] == 'y') {
+	    ykey = parse_key(argv[1]+2, 'y' & 0x1f);
+	  } else if (argv[1][0] == '-' && (argv[1][1] == 'S' || argv[1][1] == 'R')) {
+	    xfer_mode = argv[1][1];
+	    if ((xfer_proto = parse_proto(argv[1]+2)) == -1) {
+	      fprintf(stderr, "%s: protocol must be x, k, y, g or z\n", argv[1]);
+	      exit(1);
+	    }
+	  } else if (argv[1][0] == '-' && argv[1][1] == 'f') {
+	    flow = argv[1][2];
+	    if (!flow || argv[1][3] || !strchr("nhs", flow)) {
+	      fprintf(stderr, "%s: flow control must be n, h or s\n", argv[1]);
+	      exit(1);
+	    }
+	  } else if (argv[1][0] == '-' && argv[1][1] == 'w' && argv[1][2]) {
+	    send_path = argv[1]+2;
+	  } else if (argv[1][0] == '-' && argv[1][1] == 'p') {
+	    if (sscanf(argv[1]+2, "%d,%d", &pace_ms, &pace_bytes) < 1 || pace_ms < 0 || pace_bytes <= 0) {
+	      fprintf(stderr, "%s: pacing must be MS[,BYTES]\n", argv[1]);
+	      exit(1);
+	    }
+	  } else if (argv[1][0] == '-' && argv[1][1] == 'l' && argv[1][2]) {
+	    capture_path = argv[1]+2;
+	  } else if (argv[1][0] == '-' && argv[1][1] == 'k') {
+	    skey = parse_key(argv[1]+2, 't' & 0x1f);
+	  } else if (argv[1][0] == '-' && argv[1][1] == 'L' && argv[1][2]) {
+	    listen_spec = argv[1]+2;
+	  } else if (argv[1][0] == '-' && argv[1][1] == 'X') {
+	    hexview = 1;
+	    if (argv[1][2]) hex_gap = atoi(argv[1]+2);
+	  } else if (!strcmp(argv[1], "-z")) {
+	    lowlat = 1;
+	  } else if (argv[1][0] == '-' && argv[1][1] == 'P') {
+	    ping_count = 100;
+	    if (argv[1][2] && sscanf(argv[1]+2, "%d,%d,%d", &ping_count, &ping_size, &ping_ms) < 1) {
+	      fprintf(stderr, "%s: ping must be COUNT[,SIZE[,MS]]\n", argv[1]);
+	      exit(1);
+	    }
+	  } else if (!strcmp(argv[1], "-T")) {
+	    telnet = 1;
+	  } else if (!strcmp(argv[1], "-m")) {
+	    monitor_mode = 1;
+	  } else if (!strcmp(argv[1], "-t")) {
+	    capture_stamps = 1;
 	  } else {
 	    break;
 	  }
@@ -138,7 +446,18 @@ int main(int argc, char *argv[])
 	}
 	if(argc < 2) {
 		fprintf(stderr, "example: %s [options] /dev/ttyS0 [115200]\n", argv0);
-		fprintf(stderr, "  Speeds: 1200 2400 4800 9600 19200 38400 57600 115200\n");
+		fprintf(stderr, "         %s -SPROTO /dev/ttyS0 [115200] FILE...\n", argv0);
+		fprintf(stderr, "         %s -RPROTO /dev/ttyS0 [115200] [PATH]\n", argv0);
+		fprintf(stderr, "         %s -wFILE [-fh|-fs] [-pMS[,BYTES]] /dev/ttyS0 [115200]\n", argv0);
+		fprintf(stderr, "         %s -L[HOST:]PORT [-T] /dev/ttyS0 [115200]\n", argv0);
+		fprintf(stderr, "         %s -P[COUNT[,SIZE[,MS]]] [-z] /dev/ttyS0 [115200]\n", argv0);
+		fprintf(stderr, "         %s -m [-lDIR] /dev/ttyS0[@115200] /dev/ttyUSB0[@9600]...\n", argv0);
+		fprintf(stderr, "  Speeds:");
+		for(s = speeds; s->name; s++) fprintf(stderr, " %s", s->name);
+		fprintf(stderr, "\n");
+#ifdef HAVE_TERMIOS2
+		fprintf(stderr, "  Any other rate is set with termios2/BOTHER\n");
+#endif
 		fprintf(stderr, "\nOptions:\n");
 		fprintf(stderr, "- -a : set exit key to default\n");
 		fprintf(stderr, "- -a- : Disable exit key\n");
@@ -146,9 +465,67 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "- -x : set status key to default\n");
 		fprintf(stderr, "- -x- : Disable statujs key\n");
 		fprintf(stderr, "- -xNN : Where NN is an integer, set status key to the ascii value NN\n");
+		fprintf(stderr, "- -y : set transfer key to default\n");
+		fprintf(stderr, "- -y- : Disable transfer key\n");
+		fprintf(stderr, "- -yNN : Where NN is an integer, set transfer key to the ascii value NN\n");
+		fprintf(stderr, "- -SPROTO : Send the FILEs and exit, PROTO is x (XMODEM), k (XMODEM-1K), y (YMODEM), g (YMODEM-g) or z (ZMODEM)\n");
+		fprintf(stderr, "- -RPROTO : Receive to PATH (a file for XMODEM, a directory for YMODEM and ZMODEM) and exit\n");
+		fprintf(stderr, "- -fh : RTS/CTS (hardware) flow control\n");
+		fprintf(stderr, "- -fs : XON/XOFF (software) flow control, not for binary data the device sends back\n");
+		fprintf(stderr, "- -fn : No flow control (default)\n");
+		fprintf(stderr, "- -wFILE : Send FILE (- for stdin) as is and exit, printing what the device answers\n");
+		fprintf(stderr, "- -pMS[,BYTES] : With -w, pause MS milliseconds after every BYTES (default 64)\n");
+		fprintf(stderr, "- -lFILE : Capture received data to FILE\n");
+		fprintf(stderr, "- -t : Prefix captured lines with a timestamp\n");
+		fprintf(stderr, "- -X[MS] : Show received data as a timestamped hex dump, marking gaps of MS (default 10) or more\n");
+		fprintf(stderr, "- -L[HOST:]PORT : Serve the port over TCP, the first client is the writer; only local clients without HOST, HOST * for all interfaces\n");
+		fprintf(stderr, "- -T : With -L, speak telnet with RFC 2217 port control\n");
+		fprintf(stderr, "- -z : Low latency: driver ASYNC_LOW_LATENCY, 1 ms USB latency timer, flushed queues\n");
+		fprintf(stderr, "- -P[COUNT[,SIZE[,MS]]] : Measure round trips on a looped back port and exit\n");
+		fprintf(stderr, "- -m : Monitor all the given ports, -lDIR logs each one to DIR/NAME.log\n");
+		fprintf(stderr, "- -k : set monitor port select key to default\n");
+		fprintf(stderr, "- -k- : Disable port select key\n");
+		fprintf(stderr, "- -kNN : Where NN is an integer, set port select key to the ascii value NN\n");
 		exit(1);
 	}
+
+	tcgetattr(STDIN_FILENO,&oldkey);
+	memset(&newkey, 0, sizeof newkey);
+	newkey.c_cflag = B9600 | CS8 | CLOCAL | CREAD;
+	newkey.c_iflag = IGNPAR;
+	newkey.c_oflag = 0;
+	newkey.c_lflag = 0;
+	newkey.c_cc[VMIN]=1;
+	newkey.c_cc[VTIME]=0;
+	if(monitor_mode) {
+		int ret;
+		fprintf(stderr, "%s exit, ", printable(akey));
+		fprintf(stderr, "%s modem lines status, ", printable(xkey));
+		fprintf(stderr, "%s and a port number selects the port\n", printable(skey));
+		tcflush(STDIN_FILENO, TCIFLUSH);
+		tcsetattr(STDIN_FILENO,TCSANOW,&newkey);
+		ret = monitor(argv+1, argc-1, flow, capture_path, capture_stamps, skey);
+		tcsetattr(STDIN_FILENO,TCSANOW,&oldkey);
+		return ret ? 1 : 0;
+	}
+
 	devicename = argv[1];
+	speedname = argc > 2 ? argv[2] : NULL;
+	xfer_files = argv + 2;
+	xfer_nfiles = argc - 2;
+	if(xfer_mode) {
+		/* here the speed is optional, file names follow it */
+		if(speedname && !isdigit((unsigned char)speedname[0])) {
+			speedname = NULL;
+		} else if(speedname) {
+			xfer_files++;
+			xfer_nfiles--;
+		}
+		if(!xfer_nfiles && (xfer_mode == 'S' || xfer_proto == XFER_XMODEM || xfer_proto == XFER_XMODEM_1K)) {
+			fprintf(stderr, "%s: missing file name\n", argv0);
+			exit(1);
+		}
+	}
 
 	comfd = open(devicename, O_RDWR | O_NOCTTY | O_NONBLOCK);
 	if (comfd < 0)
@@ -158,41 +535,61 @@ int main(int argc, char *argv[])
 	}
 
 
-	if(argc > 2) {
-		speed_spec *s;
-		for(s = speeds; s->name; s++) {
-			if(strcmp(s->name, argv[2]) == 0) {
-				speed = s->flag;
-				fprintf(stderr, "setting speed %s\n", s->name);
-				break;
-			}
-		}
-	}
+	if(speedname && parse_speed(speedname, &speed, &custom_speed) == -1) exit(1);
 
-	fprintf(stderr, "%s exit, ", printable(akey));
-	fprintf(stderr, "%s modem lines status\n", printable(xkey));
+	if(!xfer_mode && !send_path && !listen_spec && !ping_count) {
+		fprintf(stderr, "%s exit, ", printable(akey));
+		fprintf(stderr, "%s modem lines status, ", printable(xkey));
+		fprintf(stderr, "%s file transfer\n", printable(ykey));
+		tcflush(STDIN_FILENO, TCIFLUSH);
+		tcsetattr(STDIN_FILENO,TCSANOW,&newkey);
+	}
 
-	tcgetattr(STDIN_FILENO,&oldkey);
-	newkey.c_cflag = B9600 | CRTSCTS | CS8 | CLOCAL | CREAD;
-	newkey.c_iflag = IGNPAR;
-	newkey.c_oflag = 0;
-	newkey.c_lflag = 0;
-	newkey.c_cc[VMIN]=1;
-	newkey.c_cc[VTIME]=0;
-	tcflush(STDIN_FILENO, TCIFLUSH);
-	tcsetattr(STDIN_FILENO,TCSANOW,&newkey);
+	if(setup_port(comfd, speed, custom_speed, flow, &oldtio) == -1) {
+		tcsetattr(STDIN_FILENO,TCSANOW,&oldkey);
+		exit(1);
+	}
+	report_speed(comfd);
+	if(lowlat) low_latency(comfd, devicename);
 
-	tcgetattr(comfd,&oldtio); // save current port settings
-	newtio.c_cflag = speed | CS8 | CLOCAL | CREAD;
-	newtio.c_iflag = IGNPAR;
-	newtio.c_oflag = 0;
-	newtio.c_lflag = 0;
-	newtio.c_cc[VMIN]=1;
-	newtio.c_cc[VTIME]=0;
-	tcflush(comfd, TCIFLUSH);
-	tcsetattr(comfd,TCSANOW,&newtio);
+	if(xfer_mode) {
+		int ret;
+		if(xfer_mode == 'S') {
+			ret = xfer_send(comfd, xfer_proto, xfer_files, xfer_nfiles);
+		} else {
+			ret = xfer_recv(comfd, xfer_proto, xfer_nfiles ? xfer_files[0] : ".");
+		}
+		tcsetattr(comfd,TCSANOW,&oldtio);
+		close(comfd);
+		return ret ? 1 : 0;
+	}
+	if(ping_count) {
+		int ret = ping(comfd, ping_count, ping_size, ping_ms, port_speed(comfd));
+		tcsetattr(comfd,TCSANOW,&oldtio);
+		close(comfd);
+		return ret ? 1 : 0;
+	}
+	if(listen_spec) {
+		int ret = serve(comfd, listen_spec, telnet);
+		tcsetattr(comfd,TCSANOW,&oldtio);
+		close(comfd);
+		return ret ? 1 : 0;
+	}
+	if(send_path) {
+		int ret;
+		if(capture_path && !(capture = capture_open(capture_path, capture_stamps))) exit(1);
+		ret = raw_send(comfd, send_path, pace_ms, pace_bytes, port_speed(comfd), capture);
+		capture_close(capture);
+		tcsetattr(comfd,TCSANOW,&oldtio);
+		close(comfd);
+		return ret ? 1 : 0;
+	}
 
 	print_status(comfd);
+	if(hexview) hexdump_init(hex_gap);
+	if(capture_path && !(capture = capture_open(capture_path, capture_stamps))) {
+		need_exit = 1;
+	}
 
 	while(!need_exit) {
 		fd_set fds;
@@ -208,14 +605,15 @@ int main(int argc, char *argv[])
 			perror("select");
 		} else if (ret > 0) {
 			if(FD_ISSET(STDIN_FILENO, &fds)) {
-				need_exit = transfer_byte(STDIN_FILENO, comfd, 1);
+				need_exit = transfer(STDIN_FILENO, comfd, 1);
 			}
 			if(FD_ISSET(comfd, &fds)) {
-				need_exit = transfer_byte(comfd, STDIN_FILENO, 0);
+				need_exit = transfer(comfd, STDIN_FILENO, 0);
 			}
 		}
 	}
 
+	capture_close(capture);
 	tcsetattr(comfd,TCSANOW,&oldtio);
 	tcsetattr(STDIN_FILENO,TCSANOW,&oldkey);
 	close(comfd);
@@ -224,29 +622,69 @@ int main(int argc, char *argv[])
 }
 
 
-int transfer_byte(int from, int to, int is_control) {
-	char c;
-	int ret;
-	do {
-		ret = read(from, &c, 1);
-	} while (ret < 0 && errno == EINTR);
-	if(ret == 1) {
-		if(is_control) {
-			if(c == akey) {
-				return -1;
-			} else if(c == xkey) {
-				print_status(to);
-				return 0;
+/*
+ * Write everything, waiting for room when the (non-blocking)
+ * descriptor can not take it all at once.
+ */
+int write_all(int fd, const void *data, int len) {
+	const char *buf = data;
+	while(len > 0) {
+		int ret = write(fd, buf, len);
+		if(ret == -1) {
+			if(errno == EAGAIN) {
+				struct pollfd pfd = { fd, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
 			}
+			if(errno == EINTR) continue;
+			perror("write failed");
+			return -1;
 		}
-		while(write(to, &c, 1) == -1) {
-			if(errno!=EAGAIN && errno!=EINTR) { perror("write failed"); break; }
-		}
-	} else {
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Move whatever is available in one go.  Keyboard input is scanned
+ * for the hot keys, everything around them is passed on.
+ */
+int transfer(int from, int to, int is_control) {
+	unsigned char buf[BUFSZ];
+	int ret, i, start;
+	do {
+		ret = read(from, buf, sizeof buf);
+	} while (ret < 0 && errno == EINTR);
+	if(ret < 0 && errno == EAGAIN) return 0;
+	if(ret <= 0) {
 		fprintf(stderr, "\nnothing to read. probably port disconnected.\n");
 		return -2;
 	}
+	if(!is_control) {
+		if(hexview) {
+			static char hex[HEXDUMP_SIZE(BUFSZ)];
+			write_all(to, hex, hexdump(hex, buf, ret));
+		} else {
+			write_all(to, buf, ret);
+		}
+		capture_put(capture, buf, ret);
+		return 0;
+	}
+	for(i = start = 0; i < ret; i++) {
+		if(buf[i] == akey) {
+			write_all(to, buf+start, i-start);
+			return -1;
+		} else if(buf[i] == xkey) {
+			write_all(to, buf+start, i-start);
+			print_status(to);
+			start = i+1;
+		} else if(buf[i] == ykey) {
+			write_all(to, buf+start, i-start);
+			xfer_menu(to);
+			start = i+1;
+		}
+	}
+	write_all(to, buf+start, ret-start);
 	return 0;
 }
-
-
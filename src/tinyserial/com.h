@@ -0,0 +1,55 @@
+/*
+ * Shared declarations for com (tinyserial)
+ *
+ * Part of the swlib tinyserial fork, see com.c for the license.
+ */
+#ifndef _COM_H
+#define _COM_H
+
+#include <stddef.h>
+#include <termios.h>
+
+/* com.c */
+extern int akey, xkey;
+int write_all(int fd, const void *data, int len);
+int parse_speed(const char *name, int *speed, unsigned long *custom);
+int setup_port(int fd, int speed, unsigned long custom_speed, int flow, struct termios *oldtio);
+int set_speed(int fd, unsigned long rate);
+unsigned long port_speed(int fd);
+void print_status(int fd);
+
+/* capture.c */
+struct capture;
+struct capture *capture_open(const char *path, int stamps);
+void capture_put(struct capture *cap, const void *buf, size_t len);
+void capture_close(struct capture *cap);
+
+/* xfer.c */
+#define XFER_XMODEM	'x'
+#define XFER_XMODEM_1K	'k'
+#define XFER_YMODEM	'y'
+#define XFER_YMODEM_G	'g'
+#define XFER_ZMODEM	'z'
+int xfer_send(int fd, int proto, char **files, int nfiles);
+int xfer_recv(int fd, int proto, const char *path);
+
+/* send.c */
+int raw_send(int fd, const char *path, int pace_ms, int pace_bytes, unsigned long baud,
+	     struct capture *cap);
+
+/* monitor.c */
+int monitor(char **devs, int ndevs, int flow, const char *logdir, int stamps, int skey);
+
+/* server.c */
+int serve(int fd, const char *spec, int telnet);
+
+/* latency.c */
+int low_latency(int fd, const char *dev);
+int ping(int fd, int count, int size, int interval_ms, unsigned long baud);
+
+/* hexdump.c, 96 bytes per line of 16 plus a gap marker */
+#define HEXDUMP_SIZE(len)	(((len) + 15) / 16 * 96 + 64)
+void hexdump_init(int gap_ms);
+size_t hexdump(char *out, const unsigned char *buf, size_t len);
+
+#endif /* _COM_H */
@@ -0,0 +1,93 @@
+/*
+ * Hex dump view of received data
+ *
+ * Part of the swlib tinyserial fork, see com.c for the license.
+ *
+ * Every chunk the port hands over starts a new line, stamped with the
+ * time since the start, so the framing of the data on the wire stays
+ * visible; a gap longer than the threshold gets a marker of its own.
+ * Lines are put together from tables with fixed size copies, no
+ * printf per byte, so this keeps up with multi-megabaud ports.
+ *
+ *   [     1.250013] 00000000  48 65 6c 6c 6f 0d 0a 00  ff              |Hello....|
+ */
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "com.h"
+
+#define STAMPW	16	/* "[%6u.%06u] " */
+
+static char hex[256][3];	/* "xx " */
+static char text[256];		/* printable or '.' */
+static long long start, last, gap;
+static unsigned long long offset;
+
+static long long mono_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void hexdump_init(int gap_ms) {
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for(i = 0; i < 256; i++) {
+		hex[i][0] = digits[i >> 4];
+		hex[i][1] = digits[i & 15];
+		hex[i][2] = ' ';
+		text[i] = i < 128 && isprint(i) ? i : '.';
+	}
+	gap = (long long)gap_ms * 1000000;
+	start = mono_ns();
+	last = 0;
+	offset = 0;
+}
+
+/* out must have room for HEXDUMP_SIZE(len) */
+size_t hexdump(char *out, const unsigned char *p, size_t len) {
+	long long now = mono_ns(), t = now - start;
+	char *o = out;
+	int first = 1;
+
+	if(last && now - last >= gap) {
+		o += sprintf(o, "%*s-- %lld.%03lld ms --\r\n", STAMPW, "",
+			     (now - last) / 1000000, (now - last) / 1000 % 1000);
+	}
+	last = now;
+	while(len) {
+		int n = len < 16 ? len : 16, i;
+
+		if(first) {
+			o += sprintf(o, "[%6lld.%06lld] ", t / 1000000000, t / 1000 % 1000000);
+			first = 0;
+		} else {
+			memset(o, ' ', STAMPW);
+			o += STAMPW;
+		}
+		for(i = 24; i >= 0; i -= 8) {
+			memcpy(o, hex[offset >> i & 0xff], 2);
+			o += 2;
+		}
+		*o++ = ' ';
+		*o++ = ' ';
+		for(i = 0; i < 16; i++) {
+			memcpy(o, i < n ? hex[p[i]] : "   ", 3);
+			o += 3;
+			if(i == 7) *o++ = ' ';
+		}
+		*o++ = ' ';
+		*o++ = '|';
+		for(i = 0; i < n; i++) *o++ = text[p[i]];
+		*o++ = '|';
+		*o++ = '\r';
+		*o++ = '\n';
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return o - out;
+}
@@ -0,0 +1,176 @@
+/*
+ * Low latency mode and round trip measurement
+ *
+ * Part of the swlib tinyserial fork, see com.c for the license.
+ *
+ * Most of the turnaround time of a serial link is not the wire but the
+ * buffering around it: UARTs and the tty layer batch received bytes,
+ * USB adapters hold them back for their latency timer (16 ms on FTDI
+ * chips).  low_latency() asks the driver to push every byte straight
+ * up, and ping() measures what that buys on a looped back port (TX
+ * wired to RX, or a device that echoes).
+ *
+ * VMIN/VTIME do not come into it: com reads non-blocking ports as
+ * soon as poll says there is data, which is what VMIN=1, VTIME=0 asks
+ * for on a blocking one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#include "com.h"
+
+#define PING_TIMEOUT_MS	1000
+#define PING_MAXSIZE	4096
+
+/*
+ * USB serial adapters have their own timer in sysfs, the FTDI driver
+ * calls it latency_timer.  1 ms is the lowest it goes.
+ */
+static void usb_latency_timer(const char *dev) {
+	char real[PATH_MAX], path[PATH_MAX + 64];
+	const char *name;
+	int fd;
+
+	if(!realpath(dev, real)) return;
+	name = strrchr(real, '/');
+	name = name ? name + 1 : real;
+	snprintf(path, sizeof path, "/sys/class/tty/%s/device/latency_timer", name);
+	fd = open(path, O_WRONLY);
+	if(fd == -1) return;
+	if(write(fd, "1", 1) == 1) fprintf(stderr, "%s: latency timer set to 1 ms\n", name);
+	close(fd);
+}
+
+/* Make the driver hand over received bytes at once, and start clean */
+int low_latency(int fd, const char *dev) {
+	int ret = 0;
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+	struct serial_struct ss;
+	if(ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+		if(ioctl(fd, TIOCSSERIAL, &ss) == -1) {
+			perror("TIOCSSERIAL");
+			ret = -1;
+		}
+	} else {
+		fprintf(stderr, "%s: driver has no low latency setting\n", dev);
+	}
+#endif
+	usb_latency_timer(dev);
+	tcflush(fd, TCIOFLUSH);
+	return ret;
+}
+
+static long long mono_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Read exactly len bytes or give up after ms */
+static int read_for(int fd, unsigned char *buf, int len, int ms) {
+	long long end = mono_ns() + (long long)ms * 1000000;
+	int got = 0;
+
+	while(got < len) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		long long left = (end - mono_ns()) / 1000000;
+		int n;
+
+		if(left < 0 || poll(&pfd, 1, (int)left) <= 0) break;
+		n = read(fd, buf + got, len - got);
+		if(n == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+		if(n <= 0) return -1;
+		got += n;
+	}
+	return got;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(long long *v, int n, double p) {
+	return v[(int)(p * (n - 1) + 0.5)] / 1000.0;
+}
+
+/*
+ * Send count probes of size bytes, one at a time, each after the
+ * previous one came back (plus interval_ms), and report the round
+ * trip times in microseconds.
+ */
+int ping(int fd, int count, int size, int interval_ms, unsigned long baud) {
+	unsigned char out[PING_MAXSIZE], in[PING_MAXSIZE];
+	long long *rtt, sum = 0;
+	int i, k, n = 0, lost = 0, bad = 0;
+	int hist[32] = { 0 };
+
+	if(size < 1 || size > PING_MAXSIZE || count < 1) {
+		fprintf(stderr, "ping: 1 to %d bytes, at least one probe\n", PING_MAXSIZE);
+		return -1;
+	}
+	rtt = malloc(count * sizeof *rtt);
+	if(!rtt) return -1;
+	if(baud) {
+		fprintf(stderr, "%d byte probes, %.1f us on the wire each way at %lu baud\n",
+			size, size * 10e6 / baud, baud);
+	}
+	tcflush(fd, TCIOFLUSH);
+	for(i = 0; i < count; i++) {
+		long long t;
+		int got;
+
+		for(k = 0; k < size; k++) out[k] = i + k * 7;
+		t = mono_ns();
+		if(write_all(fd, out, size) == -1) break;
+		got = read_for(fd, in, size, PING_TIMEOUT_MS);
+		t = mono_ns() - t;
+		if(got == -1) break;
+		if(got < size) {
+			lost++;
+			/* whatever straggles in must not count for the next one */
+			while(read_for(fd, in, sizeof in, 100) > 0);
+		} else if(memcmp(in, out, size)) {
+			bad++;
+			tcflush(fd, TCIFLUSH);
+		} else {
+			rtt[n++] = t;
+			sum += t;
+			for(k = 0; k < 31 && t / 1000 >= 1LL << (k + 1); k++);
+			hist[k]++;
+		}
+		if(interval_ms) {
+			struct timespec ts = { interval_ms / 1000, interval_ms % 1000 * 1000000 };
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	fprintf(stderr, "%d probes, %d answered, %d lost, %d corrupted\n", i, n, lost, bad);
+	if(n) {
+		int max = 0;
+		qsort(rtt, n, sizeof *rtt, cmp_ll);
+		fprintf(stderr, "rtt us: min %.1f avg %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+			rtt[0] / 1000.0, sum / 1000.0 / n, pct(rtt, n, 0.5), pct(rtt, n, 0.9),
+			pct(rtt, n, 0.99), rtt[n-1] / 1000.0);
+		for(k = 0; k < 32; k++) if(hist[k] > max) max = hist[k];
+		for(k = 0; k < 32; k++) {
+			if(!hist[k]) continue;
+			fprintf(stderr, "%8lld us %6d |%.*s\n", k ? 1LL << k : 0, hist[k],
+				(hist[k] * 50 + max - 1) / max, "##################################################");
+		}
+	}
+	free(rtt);
+	return lost || bad || n == 0 ? -1 : 0;
+}
@@ -0,0 +1,355 @@
+/*
+ * Multi-port monitor
+ *
+ * Part of the swlib tinyserial fork, see com.c for the license.
+ *
+ * Watches many ports from a single epoll loop.  Received data is
+ * shown a line at a time with the port's tag in front, so output from
+ * different ports never gets mixed within a line.  A line that stays
+ * incomplete (a prompt, say) is shown after PARTIAL_MS, straight away
+ * for the port the keyboard talks to, and is continued in place if
+ * nothing else was printed in between.
+ *
+ * The keyboard goes to one port at a time.  The select key followed
+ * by the port's number (0-9, then a-z) switches to another one, the
+ * select key twice sends it to the port.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "com.h"
+
+#define MAXPORTS	36
+#define LINESZ		4096
+#define READSZ		16384
+#define OUTSZ		(256 * 1024)
+#define PARTIAL_MS	200
+
+static const char port_ids[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+struct port {
+	const char *dev;
+	char tag[48];
+	int fd;
+	struct termios oldtio;
+	struct capture *log;
+	char line[LINESZ];	/* received, not shown yet */
+	int len;
+	long long since;	/* when line[] got its first byte */
+};
+
+static struct port ports[MAXPORTS];
+static int nports, alive, sel;
+static struct port *open_line;	/* whose line the cursor is on */
+static char out[OUTSZ];
+static int olen;
+
+static long long mono_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Terminal output is collected and written once per loop */
+static void flush_out(void) {
+	if(olen) write_all(STDOUT_FILENO, out, olen);
+	olen = 0;
+}
+
+static void put(const void *data, int len) {
+	if(len > OUTSZ - olen) flush_out();
+	memcpy(out + olen, data, len);
+	olen += len;
+}
+
+static void break_line(void) {
+	if(open_line) put("\r\n", 2);
+	open_line = NULL;
+}
+
+/* Show part of a port's line, complete says whether it ends it */
+static void show(struct port *p, const char *data, int len, int complete) {
+	if(open_line != p) {
+		break_line();
+		put(p->tag, strlen(p->tag));
+	}
+	if(complete) {
+		while(len && data[len-1] == '\r') len--;
+		put(data, len);
+		put("\r\n", 2);
+		open_line = NULL;
+	} else {
+		put(data, len);
+		open_line = p;
+	}
+}
+
+/* A message of our own, on a line of its own */
+static void note(const char *fmt, ...) {
+	char buf[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof buf - 2, fmt, ap);
+	va_end(ap);
+	if(n > (int)sizeof buf - 3) n = sizeof buf - 3;
+	memcpy(buf + n, "\r\n", 2);
+	break_line();
+	put(buf, n + 2);
+}
+
+static void show_partial(struct port *p) {
+	if(!p->len) return;
+	show(p, p->line, p->len, 0);
+	p->len = 0;
+}
+
+static void port_data(struct port *p, const char *buf, int n) {
+	while(n > 0) {
+		const char *nl = memchr(buf, '\n', n);
+		int take = nl ? nl - buf : n;
+
+		if(take > LINESZ - p->len) take = LINESZ - p->len;
+		if(!p->len && take) p->since = mono_ms();
+		memcpy(p->line + p->len, buf, take);
+		p->len += take;
+		buf += take;
+		n -= take;
+		if(p->len == LINESZ) {
+			show_partial(p);
+		} else if(nl && buf == nl) {
+			show(p, p->line, p->len, 1);
+			p->len = 0;
+			buf++;
+			n--;
+		}
+	}
+}
+
+static void port_close(struct port *p, int epfd) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+	close(p->fd);
+	p->fd = -1;
+	alive--;
+}
+
+static void port_input(struct port *p, int epfd) {
+	char buf[READSZ];
+	int n;
+
+	n = read(p->fd, buf, sizeof buf);
+	if(n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+	if(n <= 0) {
+		show_partial(p);
+		note("%sdisconnected", p->tag);
+		port_close(p, epfd);
+		return;
+	}
+	capture_put(p->log, buf, n);
+	port_data(p, buf, n);
+	if(p == &ports[sel]) show_partial(p);
+}
+
+static int port_index(int c) {
+	const char *id = c ? strchr(port_ids, c) : NULL;
+	return id ? id - port_ids : -1;
+}
+
+static void send_keys(const unsigned char *buf, int len) {
+	if(len > 0 && ports[sel].fd != -1) write_all(ports[sel].fd, buf, len);
+}
+
+/* Returns 1 when it is time to go */
+static int key_input(int skey) {
+	static int selecting;
+	unsigned char buf[BUFSIZ];
+	int n, i, start;
+
+	n = read(STDIN_FILENO, buf, sizeof buf);
+	if(n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+	if(n <= 0) return 1;
+	for(i = start = 0; i < n; i++) {
+		if(selecting) {
+			int idx = port_index(buf[i]);
+
+			selecting = 0;
+			if(buf[i] == skey) {
+				/* sent along with what follows */
+				start = i;
+				continue;
+			}
+			start = i+1;
+			if(idx >= 0 && idx < nports && ports[idx].fd != -1) {
+				sel = idx;
+				note("[keyboard -> %s]", ports[sel].dev);
+				show_partial(&ports[sel]);
+			} else {
+				note("[no port %c]", buf[i]);
+			}
+		} else if(buf[i] == akey) {
+			send_keys(buf+start, i-start);
+			return 1;
+		} else if(buf[i] == xkey) {
+			send_keys(buf+start, i-start);
+			start = i+1;
+			if(ports[sel].fd != -1) {
+				note("%s", ports[sel].tag);
+				flush_out();
+				print_status(ports[sel].fd);
+			}
+		} else if(buf[i] == skey) {
+			send_keys(buf+start, i-start);
+			start = i+1;
+			selecting = 1;
+		}
+	}
+	send_keys(buf+start, n-start);
+	return 0;
+}
+
+/* Time left until the oldest hidden partial line is due */
+static int partial_timeout(void) {
+	long long now = mono_ms(), due = -1;
+	int i;
+
+	for(i = 0; i < nports; i++) {
+		struct port *p = &ports[i];
+		if(!p->len) continue;
+		if(now - p->since >= PARTIAL_MS) {
+			show_partial(p);
+		} else if(due == -1 || p->since + PARTIAL_MS < due) {
+			due = p->since + PARTIAL_MS;
+		}
+	}
+	return due == -1 ? -1 : (int)(due - now);
+}
+
+static int port_open(struct port *p, char *spec, int flow, const char *logdir, int stamps, int width) {
+	char *at = strrchr(spec, '@'), *name;
+	int speed = B115200;
+	unsigned long custom_speed = 0;
+
+	if(at && at[1] && strspn(at+1, "0123456789") == strlen(at+1)) {
+		*at = 0;
+		if(parse_speed(at+1, &speed, &custom_speed) == -1) return -1;
+	}
+	p->dev = spec;
+	name = strrchr(spec, '/');
+	name = name ? name+1 : spec;
+	snprintf(p->tag, sizeof p->tag, "[%c %-*s] ", port_ids[p - ports], width, name);
+
+	p->fd = open(spec, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(p->fd == -1) {
+		perror(spec);
+		return -1;
+	}
+	if(setup_port(p->fd, speed, custom_speed, flow, &p->oldtio) == -1) {
+		close(p->fd);
+		p->fd = -1;
+		return -1;
+	}
+	if(logdir) {
+		char *path = malloc(strlen(logdir) + strlen(name) + 6);
+		sprintf(path, "%s/%s.log", logdir, name);
+		/* path stays around, the capture refers to it */
+		p->log = capture_open(path, stamps);
+		if(!p->log) {
+			free(path);
+			return -1;
+		}
+	}
+	alive++;
+	return 0;
+}
+
+/*
+ * devs are DEVICE[@SPEED], logdir gets one DEVICE.log per port.
+ * The keyboard is expected to be in raw mode already.
+ */
+int monitor(char **devs, int ndevs, int flow, const char *logdir, int stamps, int skey) {
+	struct epoll_event ev, events[MAXPORTS + 1];
+	int epfd, i, n, timeout, width = 0, ret = 0;
+
+	if(ndevs > MAXPORTS) {
+		fprintf(stderr, "at most %d ports\n", MAXPORTS);
+		return -1;
+	}
+	for(i = 0; i < ndevs; i++) {
+		char *name = strrchr(devs[i], '/'), *at;
+		name = name ? name+1 : devs[i];
+		at = strrchr(name, '@');
+		n = at ? at - name : strlen(name);
+		if(n > width) width = n;
+	}
+	if(width > 24) width = 24;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+	for(nports = 0; nports < ndevs; nports++) {
+		struct port *p = &ports[nports];
+		p->fd = -1;
+		if(port_open(p, devs[nports], flow, logdir, stamps, width) == -1) {
+			nports++;
+			ret = -1;
+			goto done;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u32 = nports;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev);
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = MAXPORTS;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1) {
+		perror("stdin");
+		ret = -1;
+		goto done;
+	}
+
+	note("monitoring %d ports, keyboard -> %s", nports, ports[0].dev);
+	while(alive) {
+		/* partial lines that came due are shown before the wait */
+		timeout = partial_timeout();
+		flush_out();
+		n = epoll_wait(epfd, events, MAXPORTS + 1, timeout);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			perror("epoll_wait");
+			ret = -1;
+			break;
+		}
+		for(i = 0; i < n; i++) {
+			if(events[i].data.u32 == MAXPORTS) {
+				if(key_input(skey)) goto done;
+			} else if(ports[events[i].data.u32].fd != -1) {
+				port_input(&ports[events[i].data.u32], epfd);
+			}
+		}
+	}
+	note("all ports gone");
+
+done:
+	for(i = 0; i < nports; i++) {
+		struct port *p = &ports[i];
+		show_partial(p);
+		if(p->fd != -1) {
+			tcsetattr(p->fd, TCSANOW, &p->oldtio);
+			close(p->fd);
+		}
+		capture_close(p->log);
+	}
+	break_line();
+	flush_out();
+	close(epfd);
+	return ret;
+}
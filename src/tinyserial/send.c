@@ -0,0 +1,141 @@
+/*
+ * Raw send: stream a file (or stdin) to the port
+ *
+ * Part of the swlib tinyserial fork, see com.c for the license.
+ *
+ * The data goes out untouched, as fast as the port (and its flow
+ * control) takes it.  Devices without flow control can be paced: the
+ * data is then sent in small chunks and the line is left idle for a
+ * while after each one.  Whatever the device answers is passed to
+ * stdout (and the capture file) while sending.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "com.h"
+
+#define CHUNKSZ	65536
+
+static double mono_secs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stats(long long sent, long long size, double secs, int done) {
+	fprintf(stderr, "\rsent %lld", sent);
+	if(size >= 0) fprintf(stderr, "/%lld", size);
+	fprintf(stderr, " bytes, %.1f KB/s%s", secs > 0 ? sent / secs / 1024 : 0.0, done ? "" : "  ");
+}
+
+/* Pass on what the device says, so that it does not pile up unread */
+static void echo_input(int fd, struct capture *cap) {
+	unsigned char buf[4096];
+	int n;
+	while((n = read(fd, buf, sizeof buf)) > 0) {
+		write_all(STDOUT_FILENO, buf, n);
+		capture_put(cap, buf, n);
+	}
+}
+
+/*
+ * Write len bytes, reading the port whenever it has something.
+ * Flow control stops the port from taking more, so this is where
+ * the time goes on a busy link.
+ */
+static int send_chunk(int fd, const unsigned char *buf, int len, struct capture *cap) {
+	while(len > 0) {
+		struct pollfd pfd = { fd, POLLIN | POLLOUT, 0 };
+		if(poll(&pfd, 1, -1) == -1) {
+			if(errno == EINTR) continue;
+			perror("poll");
+			return -1;
+		}
+		if(pfd.revents & POLLIN) echo_input(fd, cap);
+		if(pfd.revents & (POLLOUT | POLLERR | POLLHUP)) {
+			int n = write(fd, buf, len);
+			if(n == -1) {
+				if(errno == EAGAIN || errno == EINTR) continue;
+				perror("write");
+				return -1;
+			}
+			buf += n;
+			len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * path "-" is stdin.  With pace_ms the data goes out in pace_bytes
+ * chunks, each one drained to the wire before the pause.  baud is
+ * only used to show how much of the line rate was used.
+ */
+int raw_send(int fd, const char *path, int pace_ms, int pace_bytes, unsigned long baud,
+	     struct capture *cap) {
+	static unsigned char buf[CHUNKSZ];
+	long long sent = 0, size = -1;
+	double start, last, secs;
+	int in, n = 0, err = 0, chunk = pace_ms ? pace_bytes : CHUNKSZ;
+	struct stat st;
+
+	if(chunk <= 0 || chunk > CHUNKSZ) chunk = CHUNKSZ;
+	in = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+	if(in == -1) {
+		perror(path);
+		return -1;
+	}
+	if(fstat(in, &st) == 0 && S_ISREG(st.st_mode)) size = st.st_size;
+
+	start = last = mono_secs();
+	for(;;) {
+		int got = 0;
+		/* fill the chunk, a pipe may hand it over in pieces */
+		while(got < chunk && (n = read(in, buf + got, chunk - got)) > 0) got += n;
+		if(n == -1) {
+			perror(path);
+			err = 1;
+			break;
+		}
+		if(got == 0) break;
+		if(send_chunk(fd, buf, got, cap) == -1) {
+			err = 1;
+			break;
+		}
+		sent += got;
+		if(pace_ms) {
+			struct timespec ts = { pace_ms / 1000, pace_ms % 1000 * 1000000 };
+			tcdrain(fd);
+			nanosleep(&ts, NULL);
+		}
+		if(mono_secs() - last >= 1) {
+			last = mono_secs();
+			stats(sent, size, last - start, 0);
+		}
+	}
+	if(in != STDIN_FILENO) close(in);
+
+	/* done means on the wire, not in the driver's buffer */
+	tcdrain(fd);
+	echo_input(fd, cap);
+	secs = mono_secs() - start;
+	stats(sent, size, secs, 1);
+	if(baud && secs > 0) {
+		/* 10 bits per byte for 8N1 */
+		fprintf(stderr, " in %.2f s, %.0f%% of the line rate", secs, sent * 10 / secs / baud * 100);
+	}
+	fprintf(stderr, "\n");
+	if(!err && size >= 0 && sent != size) {
+		fprintf(stderr, "%s: short send\n", path);
+		err = 1;
+	}
+	return err ? -1 : 0;
+}
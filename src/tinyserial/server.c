@@ -0,0 +1,705 @@
+/*
+ * Serve a port over TCP
+ *
+ * Part of the swlib tinyserial fork, see com.c for the license.
+ *
+ * Any number of clients (up to MAXCLIENTS) see what the port sends,
+ * the first one to connect is also the writer; when it goes away the
+ * oldest remaining client takes over.  Port data is read once and
+ * sent to every client from the same buffer.  A client that can not
+ * keep up is queued up to QMAX and then dropped, so it never holds
+ * up the others.
+ *
+ * In raw mode the writer's data is spliced from the socket to the
+ * port through a pipe, without passing through user space.  While the
+ * port can not take more, the writer is not read, so TCP flow control
+ * pushes back on the client.
+ *
+ * With telnet set the clients speak telnet with the RFC 2217
+ * COM-PORT-OPTION, which lets the writer change the baud rate, data
+ * bits, parity, stop bits, flow control and the modem lines.  The
+ * other clients may only query them.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "com.h"
+
+#define MAXCLIENTS	16
+#define READSZ		65536
+#define QMAX		(1024 * 1024)
+
+#define EV_LISTEN	MAXCLIENTS
+#define EV_PORT		(MAXCLIENTS + 1)
+#define EV_SIGNAL	(MAXCLIENTS + 2)
+
+/* telnet */
+#define SE	240
+#define SB	250
+#define WILL	251
+#define WONT	252
+#define DO	253
+#define DONT	254
+#define IAC	255
+#define OPT_BINARY	0
+#define OPT_SGA		3
+#define OPT_COMPORT	44
+
+/* RFC 2217 client to server commands, replies are +100 */
+#define CPO_SIGNATURE		0
+#define CPO_SET_BAUDRATE	1
+#define CPO_SET_DATASIZE	2
+#define CPO_SET_PARITY		3
+#define CPO_SET_STOPSIZE	4
+#define CPO_SET_CONTROL		5
+#define CPO_NOTIFY_LINESTATE	6
+#define CPO_NOTIFY_MODEMSTATE	7
+#define CPO_FLOWCONTROL_SUSPEND	8
+#define CPO_FLOWCONTROL_RESUME	9
+#define CPO_SET_LINESTATE_MASK	10
+#define CPO_SET_MODEMSTATE_MASK	11
+#define CPO_PURGE_DATA		12
+
+enum { T_DATA, T_IAC, T_OPT, T_SB, T_SBIAC };
+
+struct client {
+	int fd;
+	unsigned long seq;		/* connection order */
+	char *q;			/* output the socket did not take */
+	int qlen, qsize;
+	/* telnet state */
+	int tstate, verb, cr;
+	unsigned char sb[64];
+	int sblen;
+	unsigned char us[256], him[256];
+};
+
+static struct client clients[MAXCLIENTS];
+static unsigned long nextseq;
+static int epfd, comfd, telnet, writer = -1;
+static int pipefd[2] = { -1, -1 }, piped, use_splice = 1;
+static unsigned char pbuf[2 * READSZ];	/* decoded telnet data for the port */
+static int plen, poff;
+static int breaking;
+
+static void ep_set(int fd, int events, int tag, int op) {
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.u32 = tag;
+	if(epoll_ctl(epfd, op, fd, &ev) == -1 && op != EPOLL_CTL_DEL) perror("epoll_ctl");
+}
+
+static int port_pending(void) {
+	return piped || plen > poff;
+}
+
+/* Client events: readers are always read (for telnet commands and EOF) */
+static void client_events(int i) {
+	struct client *c = &clients[i];
+	int ev = 0;
+	if(i != writer || !port_pending()) ev |= EPOLLIN;
+	if(c->qlen) ev |= EPOLLOUT;
+	ep_set(c->fd, ev, i, EPOLL_CTL_MOD);
+}
+
+static void port_events(void) {
+	ep_set(comfd, EPOLLIN | (port_pending() ? EPOLLOUT : 0), EV_PORT, EPOLL_CTL_MOD);
+}
+
+static void drop_client(int i, const char *why) {
+	struct client *c = &clients[i];
+	int j, next = -1;
+
+	fprintf(stderr, "client %d: %s\n", i, why);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	free(c->q);
+	c->q = NULL;
+	c->qlen = c->qsize = 0;
+	if(i != writer) return;
+
+	/* data already taken from the old writer still goes out */
+	for(j = 0; j < MAXCLIENTS; j++) {
+		if(clients[j].fd != -1 && (next == -1 || clients[j].seq < clients[next].seq)) next = j;
+	}
+	writer = next;
+	if(writer != -1) {
+		fprintf(stderr, "client %d: now the writer\n", writer);
+		client_events(writer);
+	}
+}
+
+static void client_flush(int i) {
+	struct client *c = &clients[i];
+	int n;
+
+	if(!c->qlen) return;
+	n = send(c->fd, c->q, c->qlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(n == -1) {
+		if(errno != EAGAIN && errno != EINTR) drop_client(i, strerror(errno));
+		return;
+	}
+	memmove(c->q, c->q + n, c->qlen - n);
+	c->qlen -= n;
+	if(!c->qlen) client_events(i);
+}
+
+static void client_send(int i, const void *data, int len) {
+	struct client *c = &clients[i];
+	int n = 0, was = c->qlen;
+
+	if(c->fd == -1) return;
+	if(!c->qlen) {
+		n = send(c->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n == -1) {
+			if(errno != EAGAIN && errno != EINTR) {
+				drop_client(i, strerror(errno));
+				return;
+			}
+			n = 0;
+		}
+		if(n == len) return;
+	}
+	if(c->qlen + len - n > QMAX) {
+		drop_client(i, "too slow, dropped");
+		return;
+	}
+	if(c->qlen + len - n > c->qsize) {
+		c->qsize = c->qlen + len - n + READSZ;
+		c->q = realloc(c->q, c->qsize);
+	}
+	memcpy(c->q + c->qlen, (const char *)data + n, len - n);
+	c->qlen += len - n;
+	if(!was) client_events(i);
+}
+
+/***********************************************************************
+ * Writer to port
+ ***********************************************************************/
+
+static int drain_port(void) {
+	while(piped) {
+		int n = splice(pipefd[0], NULL, comfd, NULL, piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(n == -1 && errno == EINVAL) {
+			/* the driver can not take spliced data, copy from now on */
+			n = read(pipefd[0], pbuf + plen, piped);
+			if(n > 0) plen += n;
+			piped = 0;
+			use_splice = 0;
+			break;
+		}
+		if(n == -1) {
+			if(errno == EAGAIN || errno == EINTR) return 0;
+			perror("splice to port");
+			return -1;
+		}
+		piped -= n;
+	}
+	while(plen > poff) {
+		int n = write(comfd, pbuf + poff, plen - poff);
+		if(n == -1) {
+			if(errno == EAGAIN || errno == EINTR) return 0;
+			perror("write to port");
+			return -1;
+		}
+		poff += n;
+	}
+	plen = poff = 0;
+	return 0;
+}
+
+/* Move what the writer sent on, and stop reading it while the port is full */
+static int port_output(void) {
+	static int blocked;
+	if(drain_port() == -1) return -1;
+	if(blocked != port_pending()) {
+		blocked = port_pending();
+		port_events();
+		if(writer != -1) client_events(writer);
+	}
+	return 0;
+}
+
+/***********************************************************************
+ * RFC 2217
+ ***********************************************************************/
+
+static void telnet_cmd(int i, int verb, int opt) {
+	unsigned char cmd[3] = { IAC, verb, opt };
+	client_send(i, cmd, 3);
+}
+
+static void sb_reply(int i, int cmd, const unsigned char *val, int len) {
+	unsigned char buf[4 + 2 * 64 + 2];
+	int n = 0, k;
+
+	buf[n++] = IAC;
+	buf[n++] = SB;
+	buf[n++] = OPT_COMPORT;
+	buf[n++] = cmd + 100;
+	for(k = 0; k < len && k < 64; k++) {
+		if(val[k] == IAC) buf[n++] = IAC;
+		buf[n++] = val[k];
+	}
+	buf[n++] = IAC;
+	buf[n++] = SE;
+	client_send(i, buf, n);
+}
+
+static int supported(int opt) {
+	return opt == OPT_BINARY || opt == OPT_SGA || opt == OPT_COMPORT;
+}
+
+/* Only answer changes, so that the two sides can not loop */
+static void negotiate(int i, int verb, int opt) {
+	struct client *c = &clients[i];
+
+	switch(verb) {
+	case WILL:
+		if(!supported(opt)) telnet_cmd(i, DONT, opt);
+		else if(!c->him[opt]) {
+			c->him[opt] = 1;
+			telnet_cmd(i, DO, opt);
+		}
+		break;
+	case WONT:
+		if(c->him[opt]) {
+			c->him[opt] = 0;
+			telnet_cmd(i, DONT, opt);
+		}
+		break;
+	case DO:
+		if(!supported(opt) || opt == OPT_COMPORT) telnet_cmd(i, WONT, opt);
+		else if(!c->us[opt]) {
+			c->us[opt] = 1;
+			telnet_cmd(i, WILL, opt);
+		}
+		break;
+	case DONT:
+		if(c->us[opt]) {
+			c->us[opt] = 0;
+			telnet_cmd(i, WONT, opt);
+		}
+		break;
+	}
+}
+
+static int modem_line(int bit, int set) {
+	unsigned int arg = bit;
+	if(set >= 0) ioctl(comfd, set ? TIOCMBIS : TIOCMBIC, &arg);
+	if(ioctl(comfd, TIOCMGET, &arg) == -1) return 0;
+	return !!(arg & bit);
+}
+
+/* The SET-CONTROL query that goes with a setting */
+static int control_query(int v) {
+	return v <= 3 ? 0 : v <= 6 ? 4 : v <= 9 ? 7 : v <= 12 ? 10 : v;
+}
+
+/* SET-CONTROL: queries get the current state, settings are echoed */
+static int set_control(int v) {
+	struct termios tio;
+
+	tcgetattr(comfd, &tio);
+	switch(v) {
+	case 0:
+		return tio.c_cflag & CRTSCTS ? 3 : tio.c_iflag & IXON ? 2 : 1;
+	case 1: case 2: case 3:
+		tio.c_cflag &= ~CRTSCTS;
+		tio.c_iflag &= ~(IXON | IXOFF);
+		if(v == 2) tio.c_iflag |= IXON | IXOFF;
+		if(v == 3) tio.c_cflag |= CRTSCTS;
+		tcsetattr(comfd, TCSADRAIN, &tio);
+		return v;
+	case 4:
+		return breaking ? 5 : 6;
+	case 5: case 6:
+		breaking = v == 5;
+		ioctl(comfd, breaking ? TIOCSBRK : TIOCCBRK);
+		return v;
+	case 7:
+		return modem_line(TIOCM_DTR, -1) ? 8 : 9;
+	case 8: case 9:
+		return modem_line(TIOCM_DTR, v == 8) ? 8 : 9;
+	case 10:
+		return modem_line(TIOCM_RTS, -1) ? 11 : 12;
+	case 11: case 12:
+		return modem_line(TIOCM_RTS, v == 11) ? 11 : 12;
+	}
+	return v;
+}
+
+static void comport(int i) {
+	struct client *c = &clients[i];
+	int cmd = c->sb[1], allowed = i == writer;
+	unsigned char *val = c->sb + 2, out[4];
+	int vlen = c->sblen - 2, v = vlen > 0 ? val[0] : 0;
+	struct termios tio;
+
+	if(c->sblen < 2 || c->sb[0] != OPT_COMPORT) return;
+	tcgetattr(comfd, &tio);
+	switch(cmd) {
+	case CPO_SIGNATURE: {
+		static const char sig[] = "tinyserial com";
+		sb_reply(i, cmd, (const unsigned char *)sig, sizeof sig - 1);
+		return;
+	}
+	case CPO_SET_BAUDRATE: {
+		unsigned long rate = vlen >= 4 ? (unsigned long)val[0] << 24 | val[1] << 16 | val[2] << 8 | val[3] : 0;
+		if(rate && allowed && set_speed(comfd, rate) == -1) perror("set speed");
+		rate = port_speed(comfd);
+		out[0] = rate >> 24; out[1] = rate >> 16; out[2] = rate >> 8; out[3] = rate;
+		sb_reply(i, cmd, out, 4);
+		return;
+	}
+	/* the replies say what the driver really took */
+	case CPO_SET_DATASIZE:
+		if(v >= 5 && v <= 8 && allowed) {
+			static const int sizes[] = { CS5, CS6, CS7, CS8 };
+			tio.c_cflag = (tio.c_cflag & ~CSIZE) | sizes[v - 5];
+			tcsetattr(comfd, TCSADRAIN, &tio);
+			tcgetattr(comfd, &tio);
+		}
+		switch(tio.c_cflag & CSIZE) {
+		case CS5: out[0] = 5; break;
+		case CS6: out[0] = 6; break;
+		case CS7: out[0] = 7; break;
+		default: out[0] = 8; break;
+		}
+		break;
+	case CPO_SET_PARITY:
+		if(v >= 1 && v <= 5 && allowed) {
+			tio.c_cflag &= ~(PARENB | PARODD | CMSPAR);
+			if(v == 2) tio.c_cflag |= PARENB | PARODD;
+			if(v == 3) tio.c_cflag |= PARENB;
+			if(v == 4) tio.c_cflag |= PARENB | CMSPAR | PARODD;
+			if(v == 5) tio.c_cflag |= PARENB | CMSPAR;
+			tcsetattr(comfd, TCSADRAIN, &tio);
+			tcgetattr(comfd, &tio);
+		}
+		if(!(tio.c_cflag & PARENB)) out[0] = 1;
+		else if(tio.c_cflag & CMSPAR) out[0] = tio.c_cflag & PARODD ? 4 : 5;
+		else out[0] = tio.c_cflag & PARODD ? 2 : 3;
+		break;
+	case CPO_SET_STOPSIZE:
+		/* 1.5 stop bits (3) is not something termios can do */
+		if((v == 1 || v == 2) && allowed) {
+			if(v == 2) tio.c_cflag |= CSTOPB;
+			else tio.c_cflag &= ~CSTOPB;
+			tcsetattr(comfd, TCSADRAIN, &tio);
+			tcgetattr(comfd, &tio);
+		}
+		out[0] = tio.c_cflag & CSTOPB ? 2 : 1;
+		break;
+	case CPO_SET_CONTROL:
+		out[0] = set_control(allowed ? v : control_query(v));
+		break;
+	case CPO_PURGE_DATA:
+		if(allowed) tcflush(comfd, v == 1 ? TCIFLUSH : v == 2 ? TCOFLUSH : TCIOFLUSH);
+		out[0] = v;
+		break;
+	case CPO_NOTIFY_LINESTATE:
+	case CPO_NOTIFY_MODEMSTATE:
+	case CPO_FLOWCONTROL_SUSPEND:
+	case CPO_FLOWCONTROL_RESUME:
+	case CPO_SET_LINESTATE_MASK:
+	case CPO_SET_MODEMSTATE_MASK:
+		/* no notifications are sent, just acknowledge */
+		sb_reply(i, cmd, val, vlen > 0 ? vlen : 0);
+		return;
+	default:
+		return;
+	}
+	sb_reply(i, cmd, out, 1);
+}
+
+/* Strip telnet commands, returns the number of data bytes left in out */
+static int telnet_in(int i, const unsigned char *in, int n, unsigned char *out) {
+	struct client *c = &clients[i];
+	int k, o = 0;
+
+	for(k = 0; k < n && c->fd != -1; k++) {
+		int b = in[k];
+		switch(c->tstate) {
+		case T_DATA:
+			if(b == IAC) {
+				c->tstate = T_IAC;
+			} else if(!(b == 0 && c->cr && !c->him[OPT_BINARY])) {
+				/* CR NUL is a bare CR outside binary mode */
+				out[o++] = b;
+			}
+			c->cr = b == '\r';
+			break;
+		case T_IAC:
+			c->tstate = T_DATA;
+			if(b == IAC) out[o++] = b;
+			else if(b >= WILL) {
+				c->verb = b;
+				c->tstate = T_OPT;
+			} else if(b == SB) {
+				c->sblen = 0;
+				c->tstate = T_SB;
+			}
+			break;
+		case T_OPT:
+			negotiate(i, c->verb, b);
+			c->tstate = T_DATA;
+			break;
+		case T_SB:
+			if(b == IAC) c->tstate = T_SBIAC;
+			else if(c->sblen < (int)sizeof c->sb) c->sb[c->sblen++] = b;
+			break;
+		case T_SBIAC:
+			if(b == IAC) {
+				if(c->sblen < (int)sizeof c->sb) c->sb[c->sblen++] = b;
+				c->tstate = T_SB;
+			} else {
+				if(b == SE) comport(i);
+				c->tstate = T_DATA;
+			}
+			break;
+		}
+	}
+	return o;
+}
+
+/***********************************************************************
+ * Event handlers
+ ***********************************************************************/
+
+static void client_input(int i) {
+	unsigned char buf[READSZ];
+	int n;
+
+	if(i == writer && !telnet && use_splice) {
+		n = splice(clients[i].fd, NULL, pipefd[1], NULL, READSZ, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(n > 0) {
+			piped += n;
+			port_output();
+			return;
+		}
+		if(n == 0) {
+			drop_client(i, "disconnected");
+			return;
+		}
+		if(errno == EAGAIN || errno == EINTR) return;
+		if(errno != EINVAL) {
+			drop_client(i, strerror(errno));
+			return;
+		}
+		/* the kernel can not splice this, copy instead */
+		use_splice = 0;
+	}
+	n = read(clients[i].fd, buf, sizeof buf);
+	if(n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+	if(n <= 0) {
+		drop_client(i, "disconnected");
+		return;
+	}
+	if(telnet) n = telnet_in(i, buf, n, buf);
+	if(i != writer || n <= 0) return;
+	memcpy(pbuf + plen, buf, n);
+	plen += n;
+	port_output();
+}
+
+static int port_input(void) {
+	static unsigned char buf[READSZ], esc[2 * READSZ];
+	unsigned char *data = buf;
+	int n, i, k;
+
+	n = read(comfd, buf, sizeof buf);
+	if(n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+	if(n <= 0) {
+		fprintf(stderr, "nothing to read. probably port disconnected.\n");
+		return -1;
+	}
+	if(telnet) {
+		for(i = k = 0; i < n; i++) {
+			if(buf[i] == IAC) esc[k++] = IAC;
+			esc[k++] = buf[i];
+		}
+		data = esc;
+		n = k;
+	}
+	for(i = 0; i < MAXCLIENTS; i++) {
+		if(clients[i].fd != -1) client_send(i, data, n);
+	}
+	return 0;
+}
+
+static void accept_client(int lfd) {
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof sa;
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+	int fd, i, one = 1;
+
+	fd = accept(lfd, (struct sockaddr *)&sa, &salen);
+	if(fd == -1) return;
+	for(i = 0; i < MAXCLIENTS && clients[i].fd != -1; i++);
+	if(i == MAXCLIENTS) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	memset(&clients[i], 0, sizeof clients[i]);
+	clients[i].fd = fd;
+	clients[i].seq = nextseq++;
+	if(writer == -1) writer = i;
+	ep_set(fd, EPOLLIN, i, EPOLL_CTL_ADD);
+	if(getnameinfo((struct sockaddr *)&sa, salen, host, sizeof host, serv, sizeof serv,
+		       NI_NUMERICHOST | NI_NUMERICSERV)) {
+		strcpy(host, "?");
+		strcpy(serv, "?");
+	}
+	fprintf(stderr, "client %d: %s port %s, %s\n", i, host, serv, i == writer ? "writer" : "reader");
+
+	if(telnet) {
+		/* offer what we want, replies to these are not answered */
+		struct client *c = &clients[i];
+		c->us[OPT_BINARY] = c->us[OPT_SGA] = 1;
+		c->him[OPT_BINARY] = c->him[OPT_SGA] = c->him[OPT_COMPORT] = 1;
+		telnet_cmd(i, WILL, OPT_BINARY);
+		telnet_cmd(i, DO, OPT_BINARY);
+		telnet_cmd(i, WILL, OPT_SGA);
+		telnet_cmd(i, DO, OPT_SGA);
+		telnet_cmd(i, DO, OPT_COMPORT);
+	}
+}
+
+/*
+ * [HOST:]PORT, without a host only local clients can connect and
+ * "*" listens on all interfaces.
+ */
+static int listen_on(const char *spec) {
+	struct addrinfo hints, *res, *ai;
+	char host[256], *port;
+	const char *node;
+	int fd = -1, one = 1, err;
+
+	snprintf(host, sizeof host, "%s", spec);
+	port = strrchr(host, ':');
+	if(port) *port++ = 0;
+	else port = host;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(port == host || !*host) {
+		node = "127.0.0.1";
+	} else if(!strcmp(host, "*")) {
+		node = NULL;
+		hints.ai_flags = AI_PASSIVE;
+	} else {
+		node = host;
+	}
+	err = getaddrinfo(node, port, &hints, &res);
+	if(err) {
+		fprintf(stderr, "%s: %s\n", spec, gai_strerror(err));
+		return -1;
+	}
+	for(ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+		if(fd == -1) continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 8) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if(fd == -1) perror(spec);
+	return fd;
+}
+
+/*
+ * Serve comfd on [HOST:]PORT until SIGINT/SIGTERM or the port goes
+ * away.  The port must already be set up and non-blocking.
+ */
+int serve(int fd, const char *spec, int use_telnet) {
+	struct epoll_event events[MAXCLIENTS + 3];
+	sigset_t mask;
+	int lfd, sfd, i, n, ret = 0;
+
+	comfd = fd;
+	telnet = use_telnet;
+	for(i = 0; i < MAXCLIENTS; i++) clients[i].fd = -1;
+	if((lfd = listen_on(spec)) == -1) return -1;
+	if(pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) == -1) use_splice = 0;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	ep_set(lfd, EPOLLIN, EV_LISTEN, EPOLL_CTL_ADD);
+	ep_set(comfd, EPOLLIN, EV_PORT, EPOLL_CTL_ADD);
+	if(sfd != -1) ep_set(sfd, EPOLLIN, EV_SIGNAL, EPOLL_CTL_ADD);
+	fprintf(stderr, "serving on %s (%s)\n", spec, telnet ? "RFC 2217" : "raw");
+
+	for(;;) {
+		n = epoll_wait(epfd, events, MAXCLIENTS + 3, -1);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			perror("epoll_wait");
+			ret = -1;
+			break;
+		}
+		for(i = 0; i < n; i++) {
+			unsigned int tag = events[i].data.u32;
+			unsigned int ev = events[i].events;
+
+			if(tag == EV_SIGNAL) {
+				fprintf(stderr, "terminating\n");
+				goto done;
+			} else if(tag == EV_LISTEN) {
+				accept_client(lfd);
+			} else if(tag == EV_PORT) {
+				if(ev & EPOLLOUT && port_output() == -1) {
+					ret = -1;
+					goto done;
+				}
+				if(ev & (EPOLLIN | EPOLLERR | EPOLLHUP) && port_input() == -1) {
+					ret = -1;
+					goto done;
+				}
+			} else if(clients[tag].fd != -1) {
+				if(ev & EPOLLOUT) client_flush(tag);
+				if(clients[tag].fd != -1 && ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) client_input(tag);
+			}
+		}
+	}
+
+done:
+	for(i = 0; i < MAXCLIENTS; i++) {
+		if(clients[i].fd != -1) {
+			close(clients[i].fd);
+			free(clients[i].q);
+		}
+	}
+	if(pipefd[0] != -1) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	if(sfd != -1) close(sfd);
+	close(lfd);
+	close(epfd);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	return ret;
+}
@@ -0,0 +1,1118 @@
+/*
+ * XMODEM / YMODEM / ZMODEM file transfer
+ *
+ * Part of the swlib tinyserial fork, see com.c for the license.
+ *
+ * Supported:
+ *  - XMODEM (128 byte blocks, checksum or CRC, the receiver's first
+ *    request picks which) and XMODEM-1K (1K blocks when the receiver
+ *    asks for CRC), only when asked for, as plain XMODEM-CRC
+ *    receivers take nothing but 128 byte blocks
+ *  - YMODEM batch (file name, size and mtime in block 0)
+ *  - YMODEM-g, which streams 1K blocks without waiting for an ACK
+ *    per block and so runs at the line rate on error free links
+ *  - ZMODEM batch, streaming with CRC-32 and restarting from the
+ *    receiver's position after an error, see the end of the file
+ *
+ * The XMODEM family uses CRC-16 when the receiver asks for it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "com.h"
+
+#define SOH	0x01
+#define STX	0x02
+#define EOT	0x04
+#define ACK	0x06
+#define NAK	0x15
+#define CAN	0x18
+#define CPMEOF	0x1a
+#define CRCREQ	'C'
+#define GREQ	'G'
+
+#define RETRIES		10
+#define TIMEOUT_MS	3000
+#define START_TRIES	20
+
+#define IS_XMODEM(proto)	((proto) == XFER_XMODEM || (proto) == XFER_XMODEM_1K)
+
+static int zsend(char **files, int nfiles);
+static int zrecv(const char *dir);
+
+static unsigned short crctab[256];
+
+static void crc_init(void) {
+	int i, j;
+	if(crctab[1]) return;
+	for(i = 0; i < 256; i++) {
+		unsigned short crc = i << 8;
+		for(j = 0; j < 8; j++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		crctab[i] = crc;
+	}
+}
+
+static unsigned short crc16(const unsigned char *p, int len) {
+	unsigned short crc = 0;
+	while(len--) crc = (crc << 8) ^ crctab[(crc >> 8) ^ *p++];
+	return crc;
+}
+
+/*
+ * Buffered reads from the port, so that block data does not cost a
+ * syscall per byte.
+ */
+static struct {
+	int fd;
+	int len, off;
+	unsigned char buf[4096];
+} rx;
+
+static int getbyte(int ms) {
+	if(rx.off == rx.len) {
+		struct pollfd pfd = { rx.fd, POLLIN, 0 };
+		int n = poll(&pfd, 1, ms);
+		if(n <= 0) return -1;
+		n = read(rx.fd, rx.buf, sizeof rx.buf);
+		if(n <= 0) return -1;
+		rx.len = n;
+		rx.off = 0;
+	}
+	return rx.buf[rx.off++];
+}
+
+static void purge(void) {
+	rx.off = rx.len = 0;
+	while(getbyte(100) != -1) rx.off = rx.len;
+}
+
+static void putbyte(int c) {
+	unsigned char b = c;
+	write_all(rx.fd, &b, 1);
+}
+
+static void cancel(void) {
+	static const unsigned char can[] = { CAN, CAN, CAN, CAN, CAN, 8, 8, 8, 8, 8 };
+	write_all(rx.fd, can, sizeof can);
+}
+
+struct progress {
+	const char *name;
+	long long bytes, size;
+	struct timeval start, last;
+};
+
+static void progress(struct progress *p, int done) {
+	struct timeval now;
+	double secs;
+
+	gettimeofday(&now, NULL);
+	if(!done && now.tv_sec == p->last.tv_sec) return;
+	p->last = now;
+	secs = now.tv_sec - p->start.tv_sec + (now.tv_usec - p->start.tv_usec) / 1e6;
+	fprintf(stderr, "\r%s: %lld", p->name, p->bytes);
+	if(p->size >= 0) fprintf(stderr, "/%lld", p->size);
+	fprintf(stderr, " bytes, %.1f KB/s%s", secs > 0 ? p->bytes / secs / 1024 : 0.0, done ? "\r\n" : "");
+}
+
+static void progress_start(struct progress *p, const char *name, long long size) {
+	const char *slash = strrchr(name, '/');
+	p->name = slash ? slash + 1 : name;
+	p->bytes = 0;
+	p->size = size;
+	gettimeofday(&p->start, NULL);
+	p->last = p->start;
+}
+
+/***********************************************************************
+ * Sending
+ ***********************************************************************/
+
+/* Wait for the receiver to say how it wants the data */
+static int wait_request(void) {
+	int tries, c;
+	for(tries = 0; tries < START_TRIES; tries++) {
+		c = getbyte(TIMEOUT_MS);
+		if(c == CRCREQ || c == GREQ || c == NAK) return c;
+		if(c == CAN && getbyte(TIMEOUT_MS) == CAN) return -1;
+	}
+	return -1;
+}
+
+static int send_block(int blk, const unsigned char *data, int size, int mode) {
+	unsigned char pkt[3 + 1024 + 2];
+	int len, tries, c;
+
+	pkt[0] = size == 1024 ? STX : SOH;
+	pkt[1] = blk;
+	pkt[2] = ~blk;
+	memcpy(pkt + 3, data, size);
+	len = 3 + size;
+	if(mode == NAK) {
+		unsigned char sum = 0;
+		int i;
+		for(i = 0; i < size; i++) sum += data[i];
+		pkt[len++] = sum;
+	} else {
+		unsigned short crc = crc16(data, size);
+		pkt[len++] = crc >> 8;
+		pkt[len++] = crc;
+	}
+	for(tries = 0; tries < RETRIES; tries++) {
+		if(write_all(rx.fd, pkt, len) == -1) return -1;
+		if(mode == GREQ) {
+			/* streaming: the receiver only speaks up to abort */
+			return getbyte(0) == CAN ? -1 : 0;
+		}
+		c = getbyte(TIMEOUT_MS * 3);
+		if(c == ACK) return 0;
+		if(c == CAN && getbyte(TIMEOUT_MS) == CAN) return -1;
+		/* NAK, garbage or timeout: send it again */
+	}
+	return -1;
+}
+
+static int send_eot(int mode) {
+	int tries, c;
+	for(tries = 0; tries < RETRIES; tries++) {
+		putbyte(EOT);
+		c = getbyte(TIMEOUT_MS);
+		if(c == ACK) return 0;
+		/* NAK on the first EOT is normal */
+	}
+	return mode == GREQ ? 0 : -1;
+}
+
+static int send_header(const char *path, struct stat *st, int mode) {
+	unsigned char blk[1024];
+	int len, size;
+
+	memset(blk, 0, sizeof blk);
+	if(st) {
+		const char *name = strrchr(path, '/');
+		name = name ? name + 1 : path;
+		len = snprintf((char *)blk, sizeof blk - 64, "%s", name) + 1;
+		len += snprintf((char *)blk + len, sizeof blk - len, "%lld %llo %o",
+				(long long)st->st_size, (long long)st->st_mtime, st->st_mode & 0777);
+	} else {
+		len = 0;
+	}
+	size = len < 128 ? 128 : 1024;
+	return send_block(0, blk, size, mode);
+}
+
+static int send_file(const char *path, int proto, int *mode) {
+	unsigned char buf[1024];
+	struct progress p;
+	struct stat st;
+	int fd, blk = 1, n;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		if(fd != -1) close(fd);
+		return -1;
+	}
+	if((*mode = wait_request()) == -1) goto fail;
+	if(!IS_XMODEM(proto)) {
+		if(send_header(path, &st, *mode) == -1) goto fail;
+		if((*mode = wait_request()) == -1) goto fail;
+	}
+	progress_start(&p, path, st.st_size);
+	for(;;) {
+		/* 1K blocks only for XMODEM-1K and YMODEM, and never with
+		 * checksums, which means the original 128 byte variant */
+		int size = *mode == NAK || proto == XFER_XMODEM ? 128 : 1024;
+		int got = 0;
+
+		while(got < size && (n = read(fd, buf + got, size - got)) > 0) got += n;
+		if(got == 0) break;
+		if(got <= 128 && size == 1024) size = 128;
+		memset(buf + got, CPMEOF, size - got);
+		if(send_block(blk++, buf, size, *mode) == -1) goto fail;
+		p.bytes += got;
+		progress(&p, 0);
+	}
+	close(fd);
+	if(send_eot(*mode) == -1) return -1;
+	progress(&p, 1);
+	return 0;
+
+fail:
+	close(fd);
+	cancel();
+	fprintf(stderr, "\r\n%s: transfer aborted\r\n", path);
+	return -1;
+}
+
+int xfer_send(int fd, int proto, char **files, int nfiles) {
+	int i, mode;
+
+	crc_init();
+	rx.fd = fd;
+	rx.off = rx.len = 0;
+	if(proto == XFER_ZMODEM) return zsend(files, nfiles);
+	if(IS_XMODEM(proto) && nfiles != 1) {
+		fprintf(stderr, "XMODEM sends exactly one file\r\n");
+		return -1;
+	}
+	for(i = 0; i < nfiles; i++) {
+		if(send_file(files[i], proto, &mode) == -1) return -1;
+	}
+	if(!IS_XMODEM(proto)) {
+		/* empty block 0 ends the batch */
+		if((mode = wait_request()) == -1) return -1;
+		if(send_header(NULL, NULL, mode == GREQ ? CRCREQ : mode) == -1) return -1;
+	}
+	return 0;
+}
+
+/***********************************************************************
+ * Receiving
+ ***********************************************************************/
+
+/*
+ * Read one block.  Returns the block size, 0 for EOT, -1 on timeout
+ * or a bad block, -2 if the sender cancelled.
+ */
+static int recv_block(unsigned char *data, int *blk, int crc, int ms) {
+	int c, size, i, len;
+	unsigned char hdr[2], tail[2];
+
+	c = getbyte(ms);
+	switch(c) {
+	case SOH: size = 128; break;
+	case STX: size = 1024; break;
+	case EOT: return 0;
+	case CAN:
+		if(getbyte(TIMEOUT_MS) == CAN) return -2;
+		return -1;
+	default:
+		return -1;
+	}
+	for(i = 0; i < 2; i++) {
+		if((c = getbyte(TIMEOUT_MS)) == -1) return -1;
+		hdr[i] = c;
+	}
+	for(i = 0; i < size; i++) {
+		if((c = getbyte(TIMEOUT_MS)) == -1) return -1;
+		data[i] = c;
+	}
+	len = crc ? 2 : 1;
+	for(i = 0; i < len; i++) {
+		if((c = getbyte(TIMEOUT_MS)) == -1) return -1;
+		tail[i] = c;
+	}
+	if((unsigned char)~hdr[0] != hdr[1]) return -1;
+	if(crc) {
+		if(crc16(data, size) != (tail[0] << 8 | tail[1])) return -1;
+	} else {
+		unsigned char sum = 0;
+		for(i = 0; i < size; i++) sum += data[i];
+		if(sum != tail[0]) return -1;
+	}
+	*blk = hdr[0];
+	return size;
+}
+
+/* Ask for the first block, falling back to checksums for old senders */
+static int recv_start(unsigned char *data, int *blk, int *req, int proto) {
+	int tries, n;
+	for(tries = 0; tries < START_TRIES; tries++) {
+		if(IS_XMODEM(proto) && tries == START_TRIES / 2) *req = NAK;
+		putbyte(*req);
+		n = recv_block(data, blk, *req != NAK, TIMEOUT_MS);
+		if(n != -1) return n;
+		purge();
+	}
+	return -1;
+}
+
+static int recv_file(const char *dir, const char *name, int proto, int *req,
+		     unsigned char *data, int n, int blk) {
+	char path[4096];
+	long long size = -1;
+	unsigned long long mtime = 0;
+	unsigned int mode = 0644;
+	struct progress p;
+	int fd, expect = 1, errors = 0;
+
+	if(!IS_XMODEM(proto)) {
+		/* block 0: name, then "size mtime mode" */
+		const char *base;
+		data[n-1] = 0;
+		base = strrchr((char *)data, '/');
+		base = base ? base + 1 : (char *)data;
+		if((int)strlen((char *)data) + 1 < n)
+			sscanf((char *)data + strlen((char *)data) + 1, "%lld %llo %o", &size, &mtime, &mode);
+		snprintf(path, sizeof path, "%s/%s", dir, base);
+		name = path;
+		if(*req != GREQ) putbyte(ACK);
+		putbyte(*req);
+		n = recv_block(data, &blk, 1, TIMEOUT_MS * 3);
+	}
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, (mode & 0777) | 0600);
+	if(fd == -1) {
+		perror(name);
+		cancel();
+		return -1;
+	}
+	progress_start(&p, name, size);
+	for(;;) {
+		if(n > 0 && blk == (expect & 0xff)) {
+			int len = n;
+			if(size >= 0 && p.bytes + len > size) len = size - p.bytes;
+			if(len > 0 && write_all(fd, data, len) == -1) break;
+			p.bytes += len;
+			progress(&p, 0);
+			expect++;
+			errors = 0;
+			if(*req != GREQ) putbyte(ACK);
+		} else if(n > 0 && blk == ((expect - 1) & 0xff)) {
+			/* our ACK got lost */
+			putbyte(ACK);
+		} else if(n == 0) {
+			/* EOT: the first one is NAKed to make sure it is real */
+			if(*req != GREQ) {
+				putbyte(NAK);
+				if(getbyte(TIMEOUT_MS) != EOT) {
+					if(++errors > RETRIES) break;
+					continue;
+				}
+			}
+			putbyte(ACK);
+			close(fd);
+			if(mtime) {
+				struct timeval tv[2] = { { mtime, 0 }, { mtime, 0 } };
+				utimes(name, tv);
+			}
+			progress(&p, 1);
+			return 0;
+		} else if(n == -2 || *req == GREQ || ++errors > RETRIES) {
+			/* YMODEM-g can not recover from errors */
+			break;
+		} else {
+			purge();
+			putbyte(NAK);
+		}
+		n = recv_block(data, &blk, *req != NAK, TIMEOUT_MS * 3);
+	}
+	close(fd);
+	cancel();
+	fprintf(stderr, "\r\n%s: transfer aborted\r\n", name);
+	return -1;
+}
+
+/*
+ * For XMODEM path is the file to write, for YMODEM the directory to
+ * put the received files in.
+ */
+int xfer_recv(int fd, int proto, const char *path) {
+	unsigned char data[1024];
+	int req = proto == XFER_YMODEM_G ? GREQ : CRCREQ;
+	int n, blk;
+
+	crc_init();
+	rx.fd = fd;
+	rx.off = rx.len = 0;
+	if(proto == XFER_ZMODEM) return zrecv(path);
+	for(;;) {
+		n = recv_start(data, &blk, &req, proto);
+		if(n < 0) {
+			fprintf(stderr, "\r\nno sender\r\n");
+			return -1;
+		}
+		if(IS_XMODEM(proto)) {
+			if(n == 0 || blk != 1) return -1;
+			return recv_file(NULL, path, proto, &req, data, n, blk);
+		}
+		if(n == 0 || blk != 0) return -1;
+		if(!data[0]) {
+			/* empty block 0: end of batch */
+			putbyte(ACK);
+			return 0;
+		}
+		if(recv_file(path, NULL, proto, &req, data, n, blk) == -1) return -1;
+	}
+}
+
+/***********************************************************************
+ * ZMODEM
+ ***********************************************************************/
+
+/*
+ * The sender streams data subpackets back to back and the receiver
+ * only speaks up when one arrives damaged, with a ZRPOS that makes
+ * the sender go back to where the good data ends.  The sender asks
+ * for a ZACK every ZWINDOW/4 bytes and never gets more than ZWINDOW
+ * ahead of the last one, so a receiver that stopped taking data is
+ * noticed.  Receivers that can not overlap disk and serial I/O, or
+ * that give a buffer size, get ZCRCW frames and are waited for.
+ *
+ * Frames use CRC-32 when the receiver can do it (all lrzsz versions
+ * can), CRC-16 otherwise.  Remote commands (ZCOMMAND) are refused.
+ */
+#define ZPAD		'*'
+#define ZDLE		0x18
+#define ZBIN		'A'
+#define ZHEX		'B'
+#define ZBIN32		'C'
+#define XON		0x11
+#define XOFF		0x13
+
+/* frame types */
+#define ZRQINIT		0
+#define ZRINIT		1
+#define ZSINIT		2
+#define ZACK		3
+#define ZFILE		4
+#define ZSKIP		5
+#define ZNAK		6
+#define ZABORT		7
+#define ZFIN		8
+#define ZRPOS		9
+#define ZDATA		10
+#define ZEOF		11
+#define ZFERR		12
+#define ZCHALLENGE	14
+#define ZCAN		16
+#define ZCOMMAND	18
+
+/* ZRINIT flags, in ZF0 */
+#define ZF0		3
+#define CANFDX		0x01
+#define CANOVIO		0x02
+#define CANFC32		0x20
+#define ZCBIN		1		/* ZFILE ZF0: binary, no conversion */
+
+/* data subpacket ends */
+#define ZCRCE		'h'		/* end of frame, a header follows */
+#define ZCRCG		'i'		/* more data follows */
+#define ZCRCQ		'j'		/* more data follows, ZACK wanted */
+#define ZCRCW		'k'		/* end of frame, ZACK wanted */
+#define ZRUB0		'l'
+#define ZRUB1		'm'
+
+/* what zdl_read() returns besides data bytes */
+#define GOTOR		0x100		/* | the frame end */
+#define GOTCAN		0x200		/* five CANs */
+
+#define ZBLOCK		1024
+#define ZMAXDATA	8192		/* largest subpacket taken */
+#define ZWINDOW		(64 * 1024)
+#define ZGARBAGE	(4 * ZWINDOW)	/* skipped while looking for a header */
+
+static unsigned long crc32tab[256];
+static unsigned char zesc[256];
+
+static void zcrc_init(void) {
+	static const unsigned char esc[] = { ZDLE, 0x10, XON, XOFF };
+	unsigned long crc;
+	int i, j;
+
+	crc_init();
+	if(crc32tab[1]) return;
+	for(i = 0; i < 256; i++) {
+		crc = i;
+		for(j = 0; j < 8; j++) crc = crc & 1 ? (crc >> 1) ^ 0xedb88320UL : crc >> 1;
+		crc32tab[i] = crc;
+	}
+	for(i = 0; i < (int)sizeof esc; i++) zesc[esc[i]] = zesc[esc[i] | 0x80] = 1;
+}
+
+static unsigned long crc32_upd(unsigned long crc, const unsigned char *p, int len) {
+	while(len--) crc = crc32tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static unsigned long get32(const unsigned char *hdr) {
+	return hdr[0] | hdr[1] << 8 | hdr[2] << 16 | (unsigned long)hdr[3] << 24;
+}
+
+static void put32(unsigned char *hdr, unsigned long n) {
+	hdr[0] = n;
+	hdr[1] = n >> 8;
+	hdr[2] = n >> 16;
+	hdr[3] = n >> 24;
+}
+
+/*
+ * Frames are put together in tx and written with one call.
+ */
+static struct {
+	int len;
+	unsigned char buf[2 * ZMAXDATA + 64];
+} tx;
+
+static int tx_flush(void) {
+	int ret = write_all(rx.fd, tx.buf, tx.len);
+	tx.len = 0;
+	return ret;
+}
+
+static void tx_esc(int c) {
+	c &= 0xff;
+	if(zesc[c]) {
+		tx.buf[tx.len++] = ZDLE;
+		c ^= 0x40;
+	}
+	tx.buf[tx.len++] = c;
+}
+
+static int zhex_header(int type, const unsigned char *hdr) {
+	static const char hex[] = "0123456789abcdef";
+	unsigned char h[7];
+	unsigned short crc;
+	int i;
+
+	h[0] = type;
+	memcpy(h + 1, hdr, 4);
+	crc = crc16(h, 5);
+	h[5] = crc >> 8;
+	h[6] = crc;
+	tx.buf[tx.len++] = ZPAD;
+	tx.buf[tx.len++] = ZPAD;
+	tx.buf[tx.len++] = ZDLE;
+	tx.buf[tx.len++] = ZHEX;
+	for(i = 0; i < 7; i++) {
+		tx.buf[tx.len++] = hex[h[i] >> 4];
+		tx.buf[tx.len++] = hex[h[i] & 15];
+	}
+	tx.buf[tx.len++] = '\r';
+	tx.buf[tx.len++] = '\n' | 0x80;
+	if(type != ZFIN && type != ZACK) tx.buf[tx.len++] = XON;
+	return tx_flush();
+}
+
+static int zbin_header(int type, const unsigned char *hdr, int crc32) {
+	unsigned char h[5];
+	int i;
+
+	h[0] = type;
+	memcpy(h + 1, hdr, 4);
+	tx.buf[tx.len++] = ZPAD;
+	tx.buf[tx.len++] = ZDLE;
+	tx.buf[tx.len++] = crc32 ? ZBIN32 : ZBIN;
+	for(i = 0; i < 5; i++) tx_esc(h[i]);
+	if(crc32) {
+		unsigned long crc = ~crc32_upd(0xffffffffUL, h, 5);
+		for(i = 0; i < 4; i++) tx_esc(crc >> (8 * i));
+	} else {
+		unsigned short crc = crc16(h, 5);
+		tx_esc(crc >> 8);
+		tx_esc(crc);
+	}
+	return tx_flush();
+}
+
+static int zsend_data(const unsigned char *p, int len, int end, int crc32) {
+	unsigned char e = end;
+	int i;
+
+	for(i = 0; i < len; i++) tx_esc(p[i]);
+	tx.buf[tx.len++] = ZDLE;
+	tx.buf[tx.len++] = end;
+	if(crc32) {
+		unsigned long crc = ~crc32_upd(crc32_upd(0xffffffffUL, p, len), &e, 1);
+		for(i = 0; i < 4; i++) tx_esc(crc >> (8 * i));
+	} else {
+		unsigned short crc = crc16(p, len);
+		crc = (crc << 8) ^ crctab[(crc >> 8) ^ e];
+		tx_esc(crc >> 8);
+		tx_esc(crc);
+	}
+	if(end == ZCRCW) tx.buf[tx.len++] = XON;
+	return tx_flush();
+}
+
+/*
+ * One byte of ZDLE encoded data: the byte, GOTOR | the frame end,
+ * GOTCAN, or -1 on a timeout or a bad escape.  XON and XOFF are
+ * never data, they may be added on the way.
+ */
+static int zdl_read(int ms) {
+	int c, cans;
+
+	for(;;) {
+		if((c = getbyte(ms)) == -1) return -1;
+		if(c == ZDLE) break;
+		if((c & 0x7f) != XON && (c & 0x7f) != XOFF) return c;
+	}
+	for(cans = 1;;) {
+		if((c = getbyte(ms)) == -1) return -1;
+		if(c == ZDLE) {
+			if(++cans >= 5) return GOTCAN;
+			continue;
+		}
+		if((c & 0x7f) == XON || (c & 0x7f) == XOFF) continue;
+		break;
+	}
+	switch(c) {
+	case ZCRCE: case ZCRCG: case ZCRCQ: case ZCRCW:
+		return GOTOR | c;
+	case ZRUB0:
+		return 0x7f;
+	case ZRUB1:
+		return 0xff;
+	}
+	return (c & 0x60) == 0x40 ? c ^ 0x40 : -1;
+}
+
+static int hexdigit(int ms) {
+	int c = getbyte(ms);
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Wait for a header.  Returns its type with the four data bytes in
+ * hdr, ZCAN if the other side cancelled, or -1 on a timeout or a
+ * damaged header.  Whatever comes before the header is skipped.
+ * *crc32 tells if it was a CRC-32 one.
+ */
+static int zget_header(unsigned char *hdr, int *crc32, int ms) {
+	unsigned char h[9];
+	int c, i, n, cans = 0, garbage = 0, fmt;
+
+	for(;;) {
+		if((c = getbyte(ms)) == -1) return -1;
+		if(c == CAN) {
+			if(++cans >= 5) return ZCAN;
+			continue;
+		}
+		cans = 0;
+		if(c != ZPAD) {
+			if(++garbage > ZGARBAGE) return -1;
+			continue;
+		}
+		while((c = getbyte(ms)) == ZPAD);
+		if(c != ZDLE) continue;
+		fmt = getbyte(ms);
+		if(fmt == ZHEX || fmt == ZBIN || fmt == ZBIN32) break;
+		if(fmt == -1) return -1;
+	}
+	if(fmt == ZHEX) {
+		for(i = 0; i < 7; i++) {
+			int hi = hexdigit(ms), lo = hexdigit(ms);
+			if(hi < 0 || lo < 0) return -1;
+			h[i] = hi << 4 | lo;
+		}
+		/* CR LF, the LF maybe with the high bit set */
+		getbyte(ms);
+		getbyte(ms);
+		if(crc16(h, 7)) return -1;
+		*crc32 = 0;
+	} else {
+		n = fmt == ZBIN32 ? 9 : 7;
+		for(i = 0; i < n; i++) {
+			if((c = zdl_read(ms)) < 0 || c > 0xff) return c == GOTCAN ? ZCAN : -1;
+			h[i] = c;
+		}
+		if(fmt == ZBIN32) {
+			if((~crc32_upd(0xffffffffUL, h, 5) & 0xffffffffUL) != get32(h + 5)) return -1;
+		} else if(crc16(h, 7)) {
+			return -1;
+		}
+		*crc32 = fmt == ZBIN32;
+	}
+	memcpy(hdr, h + 1, 4);
+	return h[0];
+}
+
+/*
+ * Read a data subpacket.  Returns the frame end with the length in
+ * *len, GOTCAN, or -1 on a timeout or a bad CRC.
+ */
+static int zget_data(unsigned char *buf, int *len, int crc32, int ms) {
+	unsigned char tail[4], e;
+	int c, n = 0, i;
+
+	for(;;) {
+		if((c = zdl_read(ms)) < 0 || c == GOTCAN) return c;
+		if(c & GOTOR) break;
+		if(n == ZMAXDATA) return -1;
+		buf[n++] = c;
+	}
+	e = c;
+	for(i = 0; i < (crc32 ? 4 : 2); i++) {
+		if((c = zdl_read(ms)) < 0 || c > 0xff) return c == GOTCAN ? c : -1;
+		tail[i] = c;
+	}
+	if(crc32) {
+		if((~crc32_upd(crc32_upd(0xffffffffUL, buf, n), &e, 1) & 0xffffffffUL) != get32(tail)) return -1;
+	} else {
+		unsigned short crc = crc16(buf, n);
+		crc = (crc << 8) ^ crctab[(crc >> 8) ^ e];
+		if(crc != (tail[0] << 8 | tail[1])) return -1;
+	}
+	*len = n;
+	return e;
+}
+
+/* A header from the receiver if one has started to come in, else -1 */
+static int zpoll(unsigned char *hdr) {
+	int c, crc32, cans = 0;
+
+	while((c = getbyte(0)) != -1) {
+		if(c == CAN) {
+			if(++cans >= 5) return ZCAN;
+		} else if(c == ZPAD) {
+			rx.off--;
+			return zget_header(hdr, &crc32, TIMEOUT_MS);
+		}
+	}
+	return -1;
+}
+
+struct zpeer {
+	int crc32;		/* receiver takes CRC-32 */
+	int stream;		/* and full streaming */
+	long window;		/* never more than this ahead of its ZACKs */
+};
+
+static const unsigned char zero[4];
+
+/*
+ * Send file data from pos to the end.  Returns 0 once the receiver
+ * took the ZEOF, 1 if it skipped the file, -1 on failure.
+ */
+static int zsend_fdata(int fd, long long pos, struct zpeer *z, struct progress *p) {
+	unsigned char buf[ZBLOCK], hdr[4];
+	long long acked, asked, last = -1;
+	int n, type, end, errors = 0, crc32;
+
+	for(;;) {
+		/* (re)start a frame at pos */
+		if(lseek(fd, pos, SEEK_SET) == -1) return -1;
+		put32(hdr, pos);
+		if(zbin_header(ZDATA, hdr, z->crc32) == -1) return -1;
+		acked = asked = pos;
+		do {
+			n = read(fd, buf, sizeof buf);
+			if(n < 0) return -1;
+			pos += n;
+			if(n < (int)sizeof buf)
+				end = ZCRCE;
+			else if(!z->stream && pos - acked >= z->window)
+				end = ZCRCW;
+			else if(pos - asked >= ZWINDOW / 4)
+				end = ZCRCQ;
+			else
+				end = ZCRCG;
+			if(end == ZCRCQ) asked = pos;
+			if(zsend_data(buf, n, end, z->crc32) == -1) return -1;
+			p->bytes = pos;
+			progress(p, 0);
+
+			/* hear the receiver out, waiting if it must catch up */
+			for(;;) {
+				if(end == ZCRCW || pos - acked > ZWINDOW)
+					type = zget_header(hdr, &crc32, TIMEOUT_MS);
+				else
+					type = zpoll(hdr);
+				if(type == ZACK) {
+					acked = get32(hdr);
+					if(end == ZCRCW) break;
+				} else if(type == ZRPOS) {
+					break;
+				} else if(type == ZCAN || type == ZABORT || type == ZFERR) {
+					return -1;
+				} else if(type == -1 && (end == ZCRCW || pos - acked > ZWINDOW)) {
+					/* a ZACK got lost, go back to the last one */
+					put32(hdr, acked);
+					type = ZRPOS;
+					break;
+				} else if(type == -1) {
+					break;
+				}
+			}
+			if(type == ZRPOS) break;
+		} while(end != ZCRCE && end != ZCRCW);
+
+		if(type == ZRPOS) {
+			/* data went bad, go back to where the receiver is */
+			pos = get32(hdr);
+			if(pos != last) errors = 0;
+			if(++errors > RETRIES) return -1;
+			last = pos;
+			tcflush(rx.fd, TCOFLUSH);
+			continue;
+		}
+		if(end == ZCRCW) continue;
+
+		/* the end of the file */
+		put32(hdr, pos);
+		if(zbin_header(ZEOF, hdr, z->crc32) == -1) return -1;
+		for(;;) {
+			type = zget_header(hdr, &crc32, TIMEOUT_MS);
+			if(type == ZRINIT) return 0;
+			if(type == ZSKIP) return 1;
+			if(type == ZRPOS) break;
+			if(type == ZACK) continue;
+			if(type == ZCAN || type == ZABORT || type == ZFERR || ++errors > RETRIES) return -1;
+			/* lost, say it again */
+			put32(hdr, pos);
+			if(zbin_header(ZEOF, hdr, z->crc32) == -1) return -1;
+		}
+		pos = get32(hdr);
+		tcflush(rx.fd, TCOFLUSH);
+	}
+}
+
+static int zsend_file(const char *path, struct zpeer *z, int filesleft, long long bytesleft) {
+	unsigned char info[1024], hdr[4];
+	const char *name;
+	struct progress p;
+	struct stat st;
+	int fd, len, tries, type, crc32, stale, ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		if(fd != -1) close(fd);
+		return -1;
+	}
+	/* name, then "size mtime mode serial files-left bytes-left" */
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	memset(info, 0, sizeof info);
+	len = snprintf((char *)info, sizeof info - 128, "%s", name) + 1;
+	len += snprintf((char *)info + len, sizeof info - len, "%lld %llo %o 0 %d %lld",
+			(long long)st.st_size, (long long)st.st_mtime, st.st_mode & 0777,
+			filesleft, bytesleft) + 1;
+	progress_start(&p, path, st.st_size);
+	for(tries = 0; tries < RETRIES; tries++) {
+		unsigned char f[4] = { 0, 0, 0, ZCBIN };
+		if(zbin_header(ZFILE, f, z->crc32) == -1 ||
+		   zsend_data(info, len, ZCRCW, z->crc32) == -1) break;
+		/* the receiver answers ZRQINIT too, one ZRINIT may be an old one */
+		stale = 0;
+		do {
+			type = zget_header(hdr, &crc32, TIMEOUT_MS);
+		} while(type == ZACK || (type == ZRINIT && !stale++));
+		if(type == ZRPOS) {
+			/* not 0 when the receiver resumes a partial file */
+			ret = zsend_fdata(fd, get32(hdr), z, &p);
+			break;
+		}
+		if(type == ZSKIP) {
+			ret = 1;
+			break;
+		}
+		if(type == ZCAN || type == ZABORT || type == ZFERR) break;
+		/* ZRINIT, ZNAK or nothing: it did not get the ZFILE */
+	}
+	close(fd);
+	if(ret == 1) fprintf(stderr, "\r%s: skipped by the receiver\r\n", p.name);
+	if(ret == 0) progress(&p, 1);
+	return ret == -1 ? -1 : 0;
+}
+
+static int zsend(char **files, int nfiles) {
+	unsigned char hdr[4];
+	struct zpeer z;
+	struct stat st;
+	long long bytesleft = 0;
+	int i, tries, type, crc32, bufsize;
+
+	zcrc_init();
+	for(i = 0; i < nfiles; i++) {
+		if(stat(files[i], &st) == 0) bytesleft += st.st_size;
+	}
+	/* "rz\r" starts a receiver waiting at a shell prompt */
+	write_all(rx.fd, "rz\r", 3);
+	for(tries = 0;; tries++) {
+		if(tries % 2 == 0 && zhex_header(ZRQINIT, zero) == -1) return -1;
+		type = zget_header(hdr, &crc32, TIMEOUT_MS);
+		if(type == ZRINIT) break;
+		if(type == ZCHALLENGE) zhex_header(ZACK, hdr);
+		if(type == ZCAN || tries >= START_TRIES) {
+			fprintf(stderr, "\r\nno receiver\r\n");
+			return -1;
+		}
+	}
+	bufsize = hdr[0] | hdr[1] << 8;
+	z.crc32 = !!(hdr[ZF0] & CANFC32);
+	z.stream = (hdr[ZF0] & (CANFDX | CANOVIO)) == (CANFDX | CANOVIO) && !bufsize;
+	z.window = bufsize ? bufsize : (hdr[ZF0] & CANOVIO) ? ZWINDOW : ZBLOCK;
+
+	for(i = 0; i < nfiles; i++) {
+		if(stat(files[i], &st) == 0) bytesleft -= st.st_size;
+		if(zsend_file(files[i], &z, nfiles - i - 1, bytesleft) == -1) {
+			cancel();
+			fprintf(stderr, "\r\n%s: transfer aborted\r\n", files[i]);
+			return -1;
+		}
+	}
+	for(tries = 0; tries < RETRIES; tries++) {
+		if(zhex_header(ZFIN, zero) == -1) return -1;
+		type = zget_header(hdr, &crc32, TIMEOUT_MS);
+		if(type == ZFIN) {
+			write_all(rx.fd, "OO", 2);
+			return 0;
+		}
+		/*
+		 * Every file was taken already, so a receiver that went
+		 * away after a lost ZFIN is not an error.
+		 */
+		if(type == -1 || type == ZCAN) return 0;
+	}
+	return 0;
+}
+
+static int zsend_rinit(void) {
+	unsigned char f[4] = { 0, 0, 0, CANFDX | CANOVIO | CANFC32 };
+	return zhex_header(ZRINIT, f);
+}
+
+static int zsend_pos(int type, long long pos) {
+	unsigned char hdr[4];
+	put32(hdr, pos);
+	return zhex_header(type, hdr);
+}
+
+/*
+ * Receive files into dir until the sender says ZFIN.
+ */
+static int zrecv(const char *dir) {
+	static unsigned char buf[ZMAXDATA + 1];
+	unsigned char hdr[4];
+	char path[4096];
+	unsigned long long mtime = 0;
+	unsigned int mode = 0644;
+	long long size = -1, offset = 0;
+	struct progress p;
+	int fd = -1, type, end, n, crc32, errors = 0;
+
+	zcrc_init();
+	if(zsend_rinit() == -1) return -1;
+	for(;;) {
+		type = zget_header(hdr, &crc32, TIMEOUT_MS);
+		switch(type) {
+		case ZRQINIT:
+			if(zsend_rinit() == -1) goto fail;
+			continue;
+		case ZSINIT:
+			/* the attention string, nothing we need */
+			if(zget_data(buf, &n, crc32, TIMEOUT_MS) < 0) {
+				zhex_header(ZNAK, zero);
+				continue;
+			}
+			zhex_header(ZACK, zero);
+			continue;
+		case ZFILE: {
+			const char *base;
+
+			if(zget_data(buf, &n, crc32, TIMEOUT_MS) != ZCRCW) {
+				zhex_header(ZNAK, zero);
+				continue;
+			}
+			if(fd == -1) {
+				buf[n] = 0;
+				base = strrchr((char *)buf, '/');
+				base = base ? base + 1 : (char *)buf;
+				size = -1;
+				mtime = 0;
+				mode = 0644;
+				if((int)strlen((char *)buf) + 1 < n)
+					sscanf((char *)buf + strlen((char *)buf) + 1, "%lld %llo %o", &size, &mtime, &mode);
+				snprintf(path, sizeof path, "%s/%.255s", dir, base);
+				fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, (mode & 0777) | 0600);
+				if(fd == -1) {
+					perror(path);
+					goto fail;
+				}
+				offset = 0;
+				progress_start(&p, path, size);
+			}
+			/* a ZFILE again means our ZRPOS got lost */
+			if(zsend_pos(ZRPOS, offset) == -1) goto fail;
+			continue;
+		}
+		case ZDATA:
+			if(fd == -1) {
+				zsend_rinit();
+				continue;
+			}
+			if((long long)get32(hdr) != offset) {
+				/* the rest of a frame we had asked to go back on */
+				if(zsend_pos(ZRPOS, offset) == -1) goto fail;
+				continue;
+			}
+			for(;;) {
+				end = zget_data(buf, &n, crc32, TIMEOUT_MS);
+				if(end == GOTCAN) goto fail;
+				if(end < 0) {
+					/* skip to the next header, ask for the data again */
+					if(++errors > RETRIES) goto fail;
+					purge();
+					if(zsend_pos(ZRPOS, offset) == -1) goto fail;
+					break;
+				}
+				errors = 0;
+				if(n && write_all(fd, buf, n) == -1) {
+					perror(path);
+					goto fail;
+				}
+				offset += n;
+				p.bytes = offset;
+				progress(&p, 0);
+				if(end == ZCRCW || end == ZCRCQ) {
+					if(zsend_pos(ZACK, offset) == -1) goto fail;
+				}
+				if(end == ZCRCW || end == ZCRCE) break;
+			}
+			continue;
+		case ZEOF:
+			/* one that overtook data we are still waiting for */
+			if(fd == -1 || (long long)get32(hdr) != offset) continue;
+			close(fd);
+			fd = -1;
+			if(mtime) {
+				struct timeval tv[2] = { { mtime, 0 }, { mtime, 0 } };
+				utimes(path, tv);
+			}
+			progress(&p, 1);
+			if(zsend_rinit() == -1) return -1;
+			continue;
+		case ZFIN:
+			zhex_header(ZFIN, zero);
+			/* the sender's "OO", if it comes */
+			getbyte(1000);
+			getbyte(100);
+			return fd == -1 ? 0 : -1;
+		case ZCAN:
+		case ZABORT:
+			goto fail;
+		case ZCOMMAND:
+			fprintf(stderr, "\r\nremote command refused\r\n");
+			goto fail;
+		case -1:
+			if(++errors > RETRIES) goto fail;
+			if(fd == -1)
+				zsend_rinit();
+			else
+				zsend_pos(ZRPOS, offset);
+			continue;
+		default:
+			/* ZNAK, ZSKIP, ZFERR... from a confused sender */
+			continue;
+		}
+	}
+
+fail:
+	if(fd != -1) close(fd);
+	cancel();
+	fprintf(stderr, "\r\n%s: transfer aborted\r\n", fd != -1 ? path : "ZMODEM");
+	return -1;
+}